@@ -0,0 +1,79 @@
+// Counts lines, words and bytes of a file, as a native ZurOS program.
+// Build it on the host (user programs live at 0x40000000 and up):
+//   gcc -m32 -ffreestanding -nostdlib -static -O2 -fno-pic -no-pie \
+//       -Wl,-Ttext-segment=0x40000000 -o wc.elf wc.c
+// put wc.elf on hdd.img, then in ZurOS: run wc.elf notes.txt
+
+#define SYS_EXIT  1
+#define SYS_WRITE 4
+#define SYS_FREAD 100
+#define SYS_FSIZE 103
+
+static int syscall4(int n, int a, int b, int c, int d) {
+    int r;
+    __asm__ volatile("int $0x80" : "=a"(r) : "a"(n), "b"(a), "c"(b), "d"(c), "S"(d) : "memory");
+    return r;
+}
+
+static void print(const char* s) {
+    int len = 0;
+    while (s[len]) len++;
+    syscall4(SYS_WRITE, 1, (int)s, len, 0);
+}
+
+static void print_num(unsigned v) {
+    char buf[12];
+    int pos = sizeof(buf);
+    buf[--pos] = '\0';
+    do {
+        buf[--pos] = '0' + v % 10;
+        v /= 10;
+    } while (v);
+    print(buf + pos);
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        print("usage: wc FILE\n");
+        return 1;
+    }
+    if (syscall4(SYS_FSIZE, (int)argv[1], 0, 0, 0) < 0) {
+        print("wc: no such file\n");
+        return 1;
+    }
+
+    static char buf[4096];
+    unsigned lines = 0, words = 0, bytes = 0, offset = 0;
+    int in_word = 0, n;
+    while ((n = syscall4(SYS_FREAD, (int)argv[1], (int)buf, sizeof(buf), offset)) > 0) {
+        for (int i = 0; i < n; i++) {
+            char c = buf[i];
+            if (c == '\n') lines++;
+            if (c == ' ' || c == '\n' || c == '\t') in_word = 0;
+            else if (!in_word) { in_word = 1; words++; }
+        }
+        bytes += n;
+        offset += n;
+    }
+
+    print_num(lines);
+    print(" ");
+    print_num(words);
+    print(" ");
+    print_num(bytes);
+    print("\n");
+    return 0;
+}
+
+// the kernel starts us with esp at argc, then argv[]
+__attribute__((naked, noreturn)) void _start(void) {
+    __asm__ volatile(
+        "mov (%esp), %eax\n\t"
+        "lea 4(%esp), %ecx\n\t"
+        "push %ecx\n\t"
+        "push %eax\n\t"
+        "call main\n\t"
+        "mov %eax, %ebx\n\t"
+        "mov $1, %eax\n\t"
+        "int $0x80");
+}
@@ -1,15 +1,295 @@
+MB_FLAGS equ 0x07           ; page align modules + give us the memory map + a video mode
+
 section .multiboot_header
     align 4
     dd 0x1BADB002           ; random number I NEED TO ADD
-    dd 0x00                 ; flags
-    dd -(0x1BADB002 + 0x00) ; checksum
+    dd MB_FLAGS             ; flags
+    dd -(0x1BADB002 + MB_FLAGS) ; checksum
+    dd 0, 0, 0, 0, 0        ; load addresses, unused (flag 16 is off, it's ELF)
+    dd 0                    ; linear framebuffer (see Framebuffer console in kernel.c)
+    dd 1024                 ; width
+    dd 768                  ; height
+    dd 32                   ; bits per pixel
+
+section .bss
+align 8
+global boot_tsc_entry
+boot_tsc_entry:
+    resd 2                  ; TSC at the very first instruction, for boottime
+align 16384                 ; KSTACK_SIZE: kernel.c finds the StackHead by masking esp
+stack_bottom:
+    resb 16384
+stack_top:
 
 ; Kernel entry point
 section .text
 global start
 extern kmain
+extern boot_thread
 
 start:
     cli             ; disable interrupts
+    mov ecx, eax    ; rdtsc overwrites eax (the multiboot magic)
+    rdtsc
+    mov [boot_tsc_entry], eax
+    mov [boot_tsc_entry + 4], edx
+    mov eax, ecx
+    mov esp, stack_top
+    mov dword [stack_bottom], boot_thread ; StackHead.thread
+    push ebx        ; multiboot info
+    push eax        ; multiboot magic
     call kmain      ; jump to C kernel
     hlt             ; halt CPU if kmain returns
+
+; ================== CPU exception and IRQ stubs ==================
+; every stub pushes the same frame (error code + vector) so isr_common
+; can hand one InterruptFrame* to isr_handler in kernel.c
+extern isr_handler
+
+%macro ISR_NOERR 1
+isr%1:
+    push dword 0            ; fake error code
+    push dword %1           ; vector number
+    jmp isr_common
+%endmacro
+
+%macro ISR_ERR 1
+isr%1:
+    push dword %1           ; CPU already pushed the error code
+    jmp isr_common
+%endmacro
+
+ISR_NOERR 0
+ISR_NOERR 1
+ISR_NOERR 2
+ISR_NOERR 3
+ISR_NOERR 4
+ISR_NOERR 5
+ISR_NOERR 6
+ISR_NOERR 7
+ISR_ERR   8
+ISR_NOERR 9
+ISR_ERR   10
+ISR_ERR   11
+ISR_ERR   12
+ISR_ERR   13
+ISR_ERR   14
+ISR_NOERR 15
+ISR_NOERR 16
+ISR_ERR   17
+ISR_NOERR 18
+ISR_NOERR 19
+ISR_NOERR 20
+ISR_ERR   21
+ISR_NOERR 22
+ISR_NOERR 23
+ISR_NOERR 24
+ISR_NOERR 25
+ISR_NOERR 26
+ISR_NOERR 27
+ISR_NOERR 28
+ISR_ERR   29
+ISR_ERR   30
+ISR_NOERR 31
+
+; hardware IRQs, remapped by the PIC to vectors 32-47
+ISR_NOERR 32
+ISR_NOERR 33
+ISR_NOERR 34
+ISR_NOERR 35
+ISR_NOERR 36
+ISR_NOERR 37
+ISR_NOERR 38
+ISR_NOERR 39
+ISR_NOERR 40
+ISR_NOERR 41
+ISR_NOERR 42
+ISR_NOERR 43
+ISR_NOERR 44
+ISR_NOERR 45
+ISR_NOERR 46
+ISR_NOERR 47
+
+; local APIC timer, IPIs and the APIC spurious vector, 48-63
+ISR_NOERR 48
+ISR_NOERR 49
+ISR_NOERR 50
+ISR_NOERR 51
+ISR_NOERR 52
+ISR_NOERR 53
+ISR_NOERR 54
+ISR_NOERR 55
+ISR_NOERR 56
+ISR_NOERR 57
+ISR_NOERR 58
+ISR_NOERR 59
+ISR_NOERR 60
+ISR_NOERR 61
+ISR_NOERR 62
+ISR_NOERR 63
+
+; int 0x80, syscalls from ring 3 (see User programs in kernel.c)
+global isr128
+ISR_NOERR 128
+
+isr_common:
+    pusha
+    push ds
+    push es
+    push fs
+    push gs
+    mov ax, 0x10            ; kernel data selector
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov gs, ax
+    push esp                ; InterruptFrame*
+    call isr_handler
+    add esp, 4
+    pop gs
+    pop fs
+    pop es
+    pop ds
+    popa
+    add esp, 8              ; drop vector + error code
+    iret
+
+; ================== thread switch ==================
+; void switch_context(uint32_t* save_esp, uint32_t load_esp)
+; saves the callee-saved registers and eflags on the old stack, stores its esp,
+; then loads the new one and pops the same frame there. A new thread's stack is
+; built by thread_create to look like it switched away just before thread_entry.
+global switch_context
+switch_context:
+    mov eax, [esp + 4]      ; save_esp
+    mov edx, [esp + 8]      ; load_esp
+    push ebp
+    push ebx
+    push esi
+    push edi
+    pushfd
+    mov [eax], esp
+    mov esp, edx
+    popfd
+    pop edi
+    pop esi
+    pop ebx
+    pop ebp
+    ret
+
+; ================== ring 3 ==================
+; int user_enter(uint32_t entry, uint32_t user_esp, uint32_t* kernel_esp, uint32_t* tss_esp0)
+; saves the callee-saved registers, stores the kernel esp in *kernel_esp (for
+; user_leave) and *tss_esp0 (where the CPU puts the frame when ring 3 gets
+; interrupted), then irets to `entry` on the user stack with interrupts on.
+; Called with interrupts off.
+global user_enter
+global user_leave
+user_enter:
+    push ebp
+    push ebx
+    push esi
+    push edi
+    mov eax, [esp + 28]     ; kernel_esp
+    mov [eax], esp
+    mov eax, [esp + 32]     ; tss_esp0
+    mov [eax], esp
+    mov ecx, [esp + 20]     ; entry
+    mov edx, [esp + 24]     ; user_esp
+    mov ax, 0x23            ; user data selector
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov gs, ax
+    push dword 0x23         ; ss
+    push edx                ; esp
+    push dword 0x202        ; eflags: IF
+    push dword 0x1B         ; cs
+    push ecx                ; eip
+    iret
+
+; void user_leave(uint32_t kernel_esp, int code)
+; abandons whatever the kernel was doing for the program (a syscall or an
+; interrupt frame) and returns `code` from its user_enter
+user_leave:
+    mov eax, [esp + 8]
+    mov esp, [esp + 4]
+    mov cx, 0x10            ; ds/es/fs/gs are already kernel ones here, but be sure
+    mov ds, cx
+    mov es, cx
+    mov fs, cx
+    mov gs, cx
+    pop edi
+    pop esi
+    pop ebx
+    pop ebp
+    ret
+
+; ================== AP trampoline ==================
+; Copied to AP_TRAMPOLINE (0x8000) by smp_init; a CPU woken with a STARTUP
+; IPI starts here in real mode at 0800:0000. Everything is addressed through
+; TRAMP() because the code runs from the copy, not from where it was linked.
+AP_TRAMPOLINE equ 0x8000
+%define TRAMP(x) ((x) - ap_trampoline + AP_TRAMPOLINE)
+
+extern ap_main
+global ap_trampoline
+global ap_trampoline_end
+global ap_tramp_data
+
+bits 16
+ap_trampoline:
+    cli
+    xor ax, ax
+    mov ds, ax
+    o32 lgdt [TRAMP(ap_gdtr)]
+    mov eax, cr0
+    or eax, 1               ; PE
+    mov cr0, eax
+    jmp dword 0x08:TRAMP(ap_protected)
+
+bits 32
+ap_protected:
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov gs, ax
+    mov ss, ax
+    mov eax, [TRAMP(ap_tramp_data) + 4]
+    mov cr4, eax            ; PSE (and the FPU bits) like the BSP
+    mov eax, [TRAMP(ap_tramp_data)]
+    mov cr3, eax
+    mov eax, cr0
+    or eax, 0x80000000      ; PG
+    mov cr0, eax
+    mov esp, [TRAMP(ap_tramp_data) + 8]
+    mov eax, ap_main        ; absolute, a relative call would miss from the copy
+    call eax
+.hang:
+    cli
+    hlt
+    jmp .hang
+
+align 8
+ap_gdt:
+    dq 0
+    dq 0x00CF9A000000FFFF   ; code, 4GB flat
+    dq 0x00CF92000000FFFF   ; data, 4GB flat
+ap_gdtr:
+    dw 23
+    dd TRAMP(ap_gdt)
+ap_tramp_data:
+    dd 0                    ; cr3
+    dd 0                    ; cr4
+    dd 0                    ; stack top (the AP's idle thread)
+ap_trampoline_end:
+
+section .data
+global isr_stub_table
+isr_stub_table:
+%assign i 0
+%rep 64
+    dd isr %+ i
+%assign i i+1
+%endrep
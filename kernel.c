@@ -1,6 +1,7 @@
 #include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
+#include <immintrin.h>
 
 #define VGA_WIDTH 80
 #define VGA_HEIGHT 25
@@ -19,19 +20,539 @@ void unescape_newlines(char* str) {
 }
 
 
+// ================== CPU features ==================
+#define CPU_TSC   0x01
+#define CPU_FXSR  0x02
+#define CPU_SSE2  0x04
+#define CPU_XSAVE 0x08
+#define CPU_AVX   0x10
+#define CPU_AVX2  0x20
+#define CPU_ERMS  0x40   // fast rep movsb/stosb
+
+uint32_t cpu_features = 0;
+uint32_t cpu_xsave_size = 512; // bytes needed to save the FPU/SIMD state
+
+// Every kernel stack is KSTACK_SIZE bytes and aligned to it, with a StackHead
+// at the bottom (kernel.asm sets up the boot stack's). Masking esp finds it, so
+// the running thread is known on every CPU without per-CPU segments.
+#define KSTACK_SIZE (16 * 1024)
+
+typedef struct {
+    struct Thread* thread;
+    // >0 while an interrupt handler runs; SIMD variants are off limits there
+    // because isr_common doesn't save the interrupted code's XMM/YMM registers
+    volatile int irq_depth;
+    int console;            // virtual console it prints to and reads from
+} StackHead;
+
+static inline StackHead* stack_head(void) {
+    uint32_t esp;
+    __asm__("mov %%esp, %0" : "=r"(esp));
+    return (StackHead*)(esp & ~(KSTACK_SIZE - 1));
+}
+
+#define interrupt_depth (stack_head()->irq_depth)
+
+static inline void cpuid(uint32_t leaf, uint32_t sub, uint32_t* a, uint32_t* b, uint32_t* c, uint32_t* d) {
+    __asm__ volatile("cpuid" : "=a"(*a), "=b"(*b), "=c"(*c), "=d"(*d) : "a"(leaf), "c"(sub));
+}
+
+// cli that remembers whether interrupts were on, for short critical sections
+static inline uint32_t irq_save(void) {
+    uint32_t flags;
+    __asm__ volatile("pushf; pop %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+static inline void irq_restore(uint32_t flags) {
+    if (flags & 0x200) __asm__ volatile("sti" : : : "memory");
+}
+
+static inline void cpu_relax(void) {
+    __asm__ volatile("pause" : : : "memory");
+}
+
+// ----------------- spinlocks -----------------
+// For state shared between CPUs. Hold them briefly and never sleep with one;
+// the _irqsave versions also keep this CPU's interrupts out. A CPU spinning on
+// a lock still answers TLB flush requests, so a shootdown can't deadlock
+// against it (see tlb_shootdown).
+typedef struct {
+    volatile uint32_t locked;
+} Spinlock;
+
+// FIFO fair: CPUs get the lock in the order they asked for it
+typedef struct {
+    volatile uint16_t next;
+    volatile uint16_t serving;
+} TicketLock;
+
+extern volatile uint32_t tlb_flush_mask;
+void tlb_flush_service(void);
+
+static inline void spin_wait_hint(void) {
+    cpu_relax();
+    if (tlb_flush_mask) tlb_flush_service();
+}
+
+static inline int spin_trylock(Spinlock* l) {
+    return !__atomic_exchange_n(&l->locked, 1, __ATOMIC_ACQUIRE);
+}
+
+static inline void spin_lock(Spinlock* l) {
+    while (!spin_trylock(l))
+        while (l->locked) spin_wait_hint();
+}
+
+static inline void spin_unlock(Spinlock* l) {
+    __atomic_store_n(&l->locked, 0, __ATOMIC_RELEASE);
+}
+
+static inline uint32_t spin_lock_irqsave(Spinlock* l) {
+    uint32_t flags = irq_save();
+    spin_lock(l);
+    return flags;
+}
+
+static inline void spin_unlock_irqrestore(Spinlock* l, uint32_t flags) {
+    spin_unlock(l);
+    irq_restore(flags);
+}
+
+static inline void ticket_lock(TicketLock* l) {
+    uint16_t me = __atomic_fetch_add(&l->next, 1, __ATOMIC_RELAXED);
+    while (__atomic_load_n(&l->serving, __ATOMIC_ACQUIRE) != me) spin_wait_hint();
+}
+
+static inline int ticket_trylock(TicketLock* l) {
+    uint16_t serving = __atomic_load_n(&l->serving, __ATOMIC_RELAXED);
+    return __atomic_compare_exchange_n(&l->next, &serving, serving + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static inline void ticket_unlock(TicketLock* l) {
+    __atomic_store_n(&l->serving, l->serving + 1, __ATOMIC_RELEASE);
+}
+
+static inline uint64_t rdtsc(void) {
+    uint32_t lo, hi;
+    __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+void libc_select(void);
+
+// turns on the FPU, SSE and AVX as far as cpu_init found them; the other CPUs
+// (see SMP) run just this
+void cpu_enable_fpu(void) {
+    // x87: no emulation, report errors natively
+    uint32_t cr0, cr4;
+    __asm__ volatile("mov %%cr0, %0" : "=r"(cr0));
+    cr0 &= ~(1u << 2);             // EM
+    cr0 |= (1u << 1) | (1u << 5);  // MP, NE
+    __asm__ volatile("mov %0, %%cr0" : : "r"(cr0));
+    __asm__ volatile("fninit");
+
+    if (cpu_features & CPU_FXSR) {
+        __asm__ volatile("mov %%cr4, %0" : "=r"(cr4));
+        cr4 |= (1u << 9) | (1u << 10); // OSFXSR, OSXMMEXCPT
+        __asm__ volatile("mov %0, %%cr4" : : "r"(cr4));
+    }
+
+    if (cpu_features & CPU_AVX) {
+        __asm__ volatile("mov %%cr4, %0" : "=r"(cr4));
+        cr4 |= (1u << 18); // OSXSAVE
+        __asm__ volatile("mov %0, %%cr4" : : "r"(cr4));
+
+        // XCR0: x87 | SSE | AVX
+        __asm__ volatile("xsetbv" : : "c"(0), "a"(7), "d"(0));
+    }
+}
+
+// detects what the CPU can do and turns on the FPU, SSE and (if present) AVX
+void cpu_init(void) {
+    uint32_t a, b, c, d, max_leaf;
+    cpuid(0, 0, &max_leaf, &b, &c, &d);
+    cpuid(1, 0, &a, &b, &c, &d);
+
+    if (d & (1 << 4))  cpu_features |= CPU_TSC;
+    if (d & (1 << 24)) cpu_features |= CPU_FXSR;
+    if ((d & (1 << 26)) && (d & (1 << 24))) cpu_features |= CPU_SSE2;
+    if (c & (1 << 26)) cpu_features |= CPU_XSAVE;
+    int has_avx = (c & (1 << 28)) != 0;
+
+    if (max_leaf >= 7) {
+        uint32_t b7, c7, d7, a7;
+        cpuid(7, 0, &a7, &b7, &c7, &d7);
+        if (b7 & (1 << 9)) cpu_features |= CPU_ERMS;
+        if (has_avx && (b7 & (1 << 5))) cpu_features |= CPU_AVX2;
+    }
+
+    if ((cpu_features & CPU_XSAVE) && has_avx) cpu_features |= CPU_AVX;
+    cpu_enable_fpu();
+
+    if (cpu_features & CPU_AVX) {
+        cpuid(0xD, 0, &a, &b, &c, &d); // size for what XCR0 has on now
+        cpu_xsave_size = b;
+    } else {
+        cpu_features &= ~(CPU_AVX2 | CPU_XSAVE);
+    }
+
+    libc_select();
+}
+
 // ================== C funtions from C libs ==================
-void* memcpy(void* dest, const void* src, size_t n) {
-    unsigned char* d = dest;
-    const unsigned char* s = src;
-    for (size_t i = 0; i < n; i++)
-        d[i] = s[i];
+// memcpy & co. dispatch through pointers picked by libc_select() once the CPU
+// is known: rep movs/stos everywhere, SSE2 or AVX2 loops where available.
+// Before cpu_init (and inside interrupt handlers) the rep versions are used.
+
+static inline void rep_movsb(void* d, const void* s, size_t n) {
+    __asm__ volatile("rep movsb" : "+D"(d), "+S"(s), "+c"(n) : : "memory");
+}
+
+static inline void rep_stosb(void* d, uint8_t v, size_t n) {
+    __asm__ volatile("rep stosb" : "+D"(d), "+c"(n) : "a"(v) : "memory");
+}
+
+static void* memcpy_rep(void* dest, const void* src, size_t n) {
+    void* d = dest;
+    size_t dwords = n / 4;
+    __asm__ volatile("rep movsl" : "+D"(d), "+S"(src), "+c"(dwords) : : "memory");
+    rep_movsb(d, src, n % 4);
     return dest;
 }
 
-void* memset(void* dest, int val, size_t n) {
-    unsigned char* d = dest;
+static void* memset_rep(void* dest, int val, size_t n) {
+    void* d = dest;
+    uint32_t v = (uint8_t)val * 0x01010101u;
+    size_t dwords = n / 4;
+    __asm__ volatile("rep stosl" : "+D"(d), "+c"(dwords) : "a"(v) : "memory");
+    rep_stosb(d, (uint8_t)val, n % 4);
+    return dest;
+}
+
+__attribute__((target("sse2")))
+static void* memcpy_sse2(void* dest, const void* src, size_t n) {
+    uint8_t* d = dest;
+    const uint8_t* s = src;
+
+    if (n >= 64) {
+        size_t head = (16 - ((uint32_t)d & 15)) & 15;
+        rep_movsb(d, s, head);
+        d += head; s += head; n -= head;
+
+        for (; n >= 64; n -= 64, d += 64, s += 64) {
+            __m128i a = _mm_loadu_si128((const __m128i*)s);
+            __m128i b = _mm_loadu_si128((const __m128i*)(s + 16));
+            __m128i c = _mm_loadu_si128((const __m128i*)(s + 32));
+            __m128i e = _mm_loadu_si128((const __m128i*)(s + 48));
+            _mm_store_si128((__m128i*)d, a);
+            _mm_store_si128((__m128i*)(d + 16), b);
+            _mm_store_si128((__m128i*)(d + 32), c);
+            _mm_store_si128((__m128i*)(d + 48), e);
+        }
+    }
+    for (; n >= 16; n -= 16, d += 16, s += 16)
+        _mm_storeu_si128((__m128i*)d, _mm_loadu_si128((const __m128i*)s));
+    rep_movsb(d, s, n);
+    return dest;
+}
+
+__attribute__((target("avx2")))
+static void* memcpy_avx2(void* dest, const void* src, size_t n) {
+    uint8_t* d = dest;
+    const uint8_t* s = src;
+
+    if (n >= 128) {
+        size_t head = (32 - ((uint32_t)d & 31)) & 31;
+        rep_movsb(d, s, head);
+        d += head; s += head; n -= head;
+
+        for (; n >= 128; n -= 128, d += 128, s += 128) {
+            __m256i a = _mm256_loadu_si256((const __m256i*)s);
+            __m256i b = _mm256_loadu_si256((const __m256i*)(s + 32));
+            __m256i c = _mm256_loadu_si256((const __m256i*)(s + 64));
+            __m256i e = _mm256_loadu_si256((const __m256i*)(s + 96));
+            _mm256_store_si256((__m256i*)d, a);
+            _mm256_store_si256((__m256i*)(d + 32), b);
+            _mm256_store_si256((__m256i*)(d + 64), c);
+            _mm256_store_si256((__m256i*)(d + 96), e);
+        }
+    }
+    for (; n >= 32; n -= 32, d += 32, s += 32)
+        _mm256_storeu_si256((__m256i*)d, _mm256_loadu_si256((const __m256i*)s));
+    _mm256_zeroupper();
+    rep_movsb(d, s, n);
+    return dest;
+}
+
+__attribute__((target("sse2")))
+static void* memset_sse2(void* dest, int val, size_t n) {
+    uint8_t* d = dest;
+    __m128i v = _mm_set1_epi8((char)val);
+
+    if (n >= 64) {
+        size_t head = (16 - ((uint32_t)d & 15)) & 15;
+        rep_stosb(d, (uint8_t)val, head);
+        d += head; n -= head;
+
+        for (; n >= 64; n -= 64, d += 64) {
+            _mm_store_si128((__m128i*)d, v);
+            _mm_store_si128((__m128i*)(d + 16), v);
+            _mm_store_si128((__m128i*)(d + 32), v);
+            _mm_store_si128((__m128i*)(d + 48), v);
+        }
+    }
+    for (; n >= 16; n -= 16, d += 16)
+        _mm_storeu_si128((__m128i*)d, v);
+    rep_stosb(d, (uint8_t)val, n);
+    return dest;
+}
+
+__attribute__((target("avx2")))
+static void* memset_avx2(void* dest, int val, size_t n) {
+    uint8_t* d = dest;
+    __m256i v = _mm256_set1_epi8((char)val);
+
+    if (n >= 128) {
+        size_t head = (32 - ((uint32_t)d & 31)) & 31;
+        rep_stosb(d, (uint8_t)val, head);
+        d += head; n -= head;
+
+        for (; n >= 128; n -= 128, d += 128) {
+            _mm256_store_si256((__m256i*)d, v);
+            _mm256_store_si256((__m256i*)(d + 32), v);
+            _mm256_store_si256((__m256i*)(d + 64), v);
+            _mm256_store_si256((__m256i*)(d + 96), v);
+        }
+    }
+    for (; n >= 32; n -= 32, d += 32)
+        _mm256_storeu_si256((__m256i*)d, v);
+    _mm256_zeroupper();
+    rep_stosb(d, (uint8_t)val, n);
+    return dest;
+}
+
+static size_t strlen_generic(const char* str) {
+    size_t len = 0;
+    while (str[len]) len++;
+    return len;
+}
+
+// aligned loads never cross a page boundary, so reading past the
+// terminator inside the same 16/32 byte block is safe
+__attribute__((target("sse2")))
+static size_t strlen_sse2(const char* str) {
+    const char* p = (const char*)((uint32_t)str & ~15u);
+    __m128i zero = _mm_setzero_si128();
+    uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_load_si128((const __m128i*)p), zero));
+    mask >>= (uint32_t)str & 15;
+    if (mask) return __builtin_ctz(mask);
+
+    for (;;) {
+        p += 16;
+        mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_load_si128((const __m128i*)p), zero));
+        if (mask) return p + __builtin_ctz(mask) - str;
+    }
+}
+
+__attribute__((target("avx2")))
+static size_t strlen_avx2(const char* str) {
+    const char* p = (const char*)((uint32_t)str & ~31u);
+    __m256i zero = _mm256_setzero_si256();
+    uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_load_si256((const __m256i*)p), zero));
+    mask >>= (uint32_t)str & 31;
+    if (mask) { _mm256_zeroupper(); return __builtin_ctz(mask); }
+
+    for (;;) {
+        p += 32;
+        mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_load_si256((const __m256i*)p), zero));
+        if (mask) { _mm256_zeroupper(); return p + __builtin_ctz(mask) - str; }
+    }
+}
+
+static char* strchr_generic(const char* s, int c) {
+    while (*s) {
+        if (*s == (char)c) return (char*)s;
+        s++;
+    }
+    return (char)c == '\0' ? (char*)s : NULL;
+}
+
+__attribute__((target("sse2")))
+static char* strchr_sse2(const char* s, int c) {
+    const char* p = (const char*)((uint32_t)s & ~15u);
+    __m128i zero = _mm_setzero_si128();
+    __m128i needle = _mm_set1_epi8((char)c);
+
+    __m128i v = _mm_load_si128((const __m128i*)p);
+    uint32_t mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, zero), _mm_cmpeq_epi8(v, needle)));
+    mask &= 0xFFFFu << ((uint32_t)s & 15);
+
+    while (!mask) {
+        p += 16;
+        v = _mm_load_si128((const __m128i*)p);
+        mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, zero), _mm_cmpeq_epi8(v, needle)));
+    }
+    const char* hit = p + __builtin_ctz(mask);
+    return *hit == (char)c ? (char*)hit : NULL;
+}
+
+static int memcmp_generic(const void* a, const void* b, size_t n) {
+    const unsigned char* x = a;
+    const unsigned char* y = b;
     for (size_t i = 0; i < n; i++)
-        d[i] = (unsigned char)val;
+        if (x[i] != y[i]) return x[i] - y[i];
+    return 0;
+}
+
+__attribute__((target("sse2")))
+static int memcmp_sse2(const void* a, const void* b, size_t n) {
+    const unsigned char* x = a;
+    const unsigned char* y = b;
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i va = _mm_loadu_si128((const __m128i*)(x + i));
+        __m128i vb = _mm_loadu_si128((const __m128i*)(y + i));
+        uint32_t diff = ~_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) & 0xFFFF;
+        if (diff) {
+            uint32_t at = i + __builtin_ctz(diff);
+            return x[at] - y[at];
+        }
+    }
+    return memcmp_generic(x + i, y + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static int memcmp_avx2(const void* a, const void* b, size_t n) {
+    const unsigned char* x = a;
+    const unsigned char* y = b;
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i va = _mm256_loadu_si256((const __m256i*)(x + i));
+        __m256i vb = _mm256_loadu_si256((const __m256i*)(y + i));
+        uint32_t diff = ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb));
+        if (diff) {
+            _mm256_zeroupper();
+            uint32_t at = i + __builtin_ctz(diff);
+            return x[at] - y[at];
+        }
+    }
+    _mm256_zeroupper();
+    return memcmp_generic(x + i, y + i, n - i);
+}
+
+// Word at a time: a 32-bit word x has a zero byte iff (x - 0x01010101) & ~x &
+// 0x80808080 is nonzero, and x ^ (c * 0x01010101) has one where x has c.
+static void* memchr_generic(const void* s, int c, size_t n) {
+    const uint8_t* p = s;
+    uint8_t ch = (uint8_t)c;
+    for (; n && ((uint32_t)p & 3); n--, p++)
+        if (*p == ch) return (void*)p;
+
+    uint32_t pattern = ch * 0x01010101u;
+    for (; n >= 4; n -= 4, p += 4) {
+        uint32_t x = *(const uint32_t*)p ^ pattern;
+        if ((x - 0x01010101u) & ~x & 0x80808080u) break; // it's in this word
+    }
+    for (; n; n--, p++)
+        if (*p == ch) return (void*)p;
+    return NULL;
+}
+
+// aligned loads like strlen_sse2: the bytes before s and past s + n that the
+// first and last block pick up are masked off, never dereferenced across a page
+__attribute__((target("sse2")))
+static void* memchr_sse2(const void* s, int c, size_t n) {
+    if (n == 0) return NULL;
+    const uint8_t* p = (const uint8_t*)((uint32_t)s & ~15u);
+    const uint8_t* end = (const uint8_t*)s + n;
+    __m128i needle = _mm_set1_epi8((char)c);
+
+    uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_load_si128((const __m128i*)p), needle));
+    mask &= 0xFFFFu << ((uint32_t)s & 15);
+    for (;;) {
+        if (mask) {
+            const uint8_t* hit = p + __builtin_ctz(mask);
+            return hit < end ? (void*)hit : NULL;
+        }
+        p += 16;
+        if (p >= end) return NULL;
+        mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_load_si128((const __m128i*)p), needle));
+    }
+}
+
+void* (*memcpy_impl)(void*, const void*, size_t) = memcpy_rep;
+void* (*memset_impl)(void*, int, size_t) = memset_rep;
+size_t (*strlen_impl)(const char*) = strlen_generic;
+char* (*strchr_impl)(const char*, int) = strchr_generic;
+int (*memcmp_impl)(const void*, const void*, size_t) = memcmp_generic;
+void* (*memchr_impl)(const void*, int, size_t) = memchr_generic;
+
+void libc_select(void) {
+    if (cpu_features & CPU_AVX2) {
+        memcpy_impl = memcpy_avx2;
+        memset_impl = memset_avx2;
+        strlen_impl = strlen_avx2;
+        strchr_impl = strchr_sse2;
+        memcmp_impl = memcmp_avx2;
+        memchr_impl = memchr_sse2;
+    } else if (cpu_features & CPU_SSE2) {
+        memcpy_impl = memcpy_sse2;
+        memset_impl = memset_sse2;
+        strlen_impl = strlen_sse2;
+        strchr_impl = strchr_sse2;
+        memcmp_impl = memcmp_sse2;
+        memchr_impl = memchr_sse2;
+    }
+}
+
+void* memcpy(void* dest, const void* src, size_t n) {
+    if (interrupt_depth) return memcpy_rep(dest, src, n);
+    return memcpy_impl(dest, src, n);
+}
+
+void* memset(void* dest, int val, size_t n) {
+    if (interrupt_depth) return memset_rep(dest, val, n);
+    return memset_impl(dest, val, n);
+}
+
+size_t strlen(const char* str) {
+    if (interrupt_depth) return strlen_generic(str);
+    return strlen_impl(str);
+}
+
+char* strchr(const char* s, int c) {
+    if (interrupt_depth) return strchr_generic(s, c);
+    return strchr_impl(s, c);
+}
+
+int memcmp(const void* a, const void* b, size_t n) {
+    if (interrupt_depth) return memcmp_generic(a, b, n);
+    return memcmp_impl(a, b, n);
+}
+
+void* memchr(const void* s, int c, size_t n) {
+    if (interrupt_depth) return memchr_generic(s, c, n);
+    return memchr_impl(s, c, n);
+}
+
+void* memmove(void* dest, const void* src, size_t n) {
+    uint8_t* d = dest;
+    const uint8_t* s = src;
+    if (d + n <= s || s + n <= d) return memcpy(dest, src, n);
+    if (d < s) return memcpy_rep(dest, src, n); // forwards never reads what it wrote
+
+    // backwards from the end, 16 bytes at a time: each block is loaded whole
+    // before it's stored, so the overlap can't feed it bytes it just wrote.
+    // No std/rep movs, the ISR stubs don't clear the direction flag.
+    while (n >= 16) {
+        n -= 16;
+        const uint32_t* from = (const uint32_t*)(s + n);
+        uint32_t a = from[0], b = from[1], c = from[2], e = from[3];
+        uint32_t* to = (uint32_t*)(d + n);
+        to[0] = a; to[1] = b; to[2] = c; to[3] = e;
+    }
+    while (n--) d[n] = s[n];
     return dest;
 }
 
@@ -53,14 +574,6 @@ char* strtok(char* str, const char* delim) {
     return start;
 }
 
-char* strchr(const char* s, int c) {
-    while (*s) {
-        if (*s == (char)c) return (char*)s;
-        s++;
-    }
-    return NULL;
-}
-
 int strncmp(const char* a, const char* b, size_t n) {
     size_t i;
     for (i = 0; i < n; i++) {
@@ -71,1268 +584,7193 @@ int strncmp(const char* a, const char* b, size_t n) {
 }
 
 volatile uint16_t* vga_memory = (volatile uint16_t*)0xB8000;
-int cursor_x = 0;
-int cursor_y = 0;
-int shift_pressed = 0;
-unsigned char os_color;
 
 char echo_text[256];
 unsigned char echo_color;
 
 // ================== VGA output ==================
+// Text goes into a shadow, a copy of the screen in RAM kept as a ring of
+// rows: scrolling moves the ring's head and blanks one row instead of moving the
+// whole screen. VGA memory is slow to write and slower to read, so it's only
+// written, a whole changed row at a time, when a line ends (at most once per
+// CONSOLE_FLUSH_MS), when a reader is about to wait for a key and from the
+// timer once output goes quiet. With a framebuffer (see Framebuffer console)
+// the same rows are drawn there instead, in more columns and rows.
+//
+// There are NUM_CONSOLES of these (Alt+F1 to Alt+F4), each with its own shadow,
+// cursor and color. A thread prints to and reads from the console in its
+// StackHead, which jobs inherit from whoever started them, so cursor_x,
+// cursor_y and os_color below always mean "the calling thread's console". In
+// text mode every console is flushed into its own page of the 32KB VGA window,
+// whether it's shown or not, and switching only moves the CRTC start address.
+#define CONSOLE_FLUSH_MS 10
+#define CON_MAX_COLS 160
+#define CON_MAX_ROWS 64
+#define NUM_CONSOLES 4
+#define VGA_PAGE_CELLS 2048         // 4KB per console page, 80x25 fits
+
+typedef struct {
+    uint16_t shadow[CON_MAX_ROWS][CON_MAX_COLS];
+    int head;                       // shadow row on top of the screen
+    uint8_t dirty[CON_MAX_ROWS];    // screen rows the display hasn't caught up with
+    int cursor_x;
+    int cursor_y;
+    uint8_t color;
+    uint32_t history_index;         // see Read a line
+    uint8_t mods;                   // Shift/Ctrl as they were when the last key read was pressed
+} Console;
+
+Console consoles[NUM_CONSOLES];
+int con_visible = 0;                // the one on screen, gets the keyboard
+int con_cols = VGA_WIDTH;
+int con_rows = VGA_HEIGHT;
+int con_any_dirty = 0;
+uint32_t con_flushed_at = 0;        // timer tick of the last flush
+extern volatile uint64_t timer_ticks;
+
+#define con_here (&consoles[stack_head()->console])
+#define cursor_x (con_here->cursor_x)
+#define cursor_y (con_here->cursor_y)
+#define os_color (con_here->color)
+#define KBD_SHIFT 1
+#define KBD_CTRL 2
+#define shift_pressed (con_here->mods & KBD_SHIFT)
+#define ctrl_pressed (con_here->mods & KBD_CTRL)
+
+int fb_active = 0;
+void fb_flush_row(int y, const uint16_t* cells);
+
+static inline uint16_t* con_row_of(Console* c, int y) {
+    return c->shadow[(c->head + y) % con_rows];
+}
+
+static inline uint16_t* con_row(int y) {
+    return con_row_of(con_here, y);
+}
+
+static inline void con_touch(int y) {
+    con_here->dirty[y] = 1;
+    con_any_dirty = 1;
+}
+
+// two cells per store
+static void con_fill_row(uint16_t* row, uint8_t color) {
+    uint32_t cell = (color << 8) | ' ';
+    uint32_t* w = (uint32_t*)row;
+    for (int x = 0; x < con_cols / 2; x++)
+        w[x] = cell | (cell << 16);
+}
+
+// One CPU at a time on the screen. Recursive per thread, so kprint can call
+// kput_char and a panic in the middle of a print still gets through.
+TicketLock console_lock;
+struct Thread* console_owner = NULL;
+int console_nest = 0;
+
+// console_lock held
+static void console_flush_locked(void) {
+    if (!con_any_dirty) return;
+    con_any_dirty = 0;
+    con_flushed_at = (uint32_t)timer_ticks;
+    for (int i = 0; i < NUM_CONSOLES; i++) {
+        Console* c = &consoles[i];
+        if (fb_active && i != con_visible) continue; // redrawn when switched to
+        volatile uint16_t* page = vga_memory + i * VGA_PAGE_CELLS;
+        for (int y = 0; y < con_rows; y++) {
+            if (!c->dirty[y]) continue;
+            c->dirty[y] = 0;
+            if (fb_active)
+                fb_flush_row(y, con_row_of(c, y));
+            else
+                memcpy((void*)(page + y * VGA_WIDTH), con_row_of(c, y), VGA_WIDTH * 2);
+        }
+    }
+}
+
+static uint32_t console_acquire(void) {
+    uint32_t flags = irq_save();
+    struct Thread* self = stack_head()->thread;
+    if (console_owner != self) {
+        ticket_lock(&console_lock);
+        console_owner = self;
+    }
+    console_nest++;
+    return flags;
+}
+
+static void console_release(uint32_t flags) {
+    if (--console_nest == 0) {
+        console_owner = NULL;
+        ticket_unlock(&console_lock);
+    }
+    irq_restore(flags);
+}
+
+// puts everything printed so far on the screen
+void console_flush(void) {
+    uint32_t flags = console_acquire();
+    console_flush_locked();
+    console_release(flags);
+}
+
+// from the timer: catches up if nobody is printing right now
+void console_flush_idle(void) {
+    if (con_any_dirty && ticket_trylock(&console_lock)) {
+        console_flush_locked();
+        ticket_unlock(&console_lock);
+    }
+}
+
 // as the name suggests it just clears the screen
 void kclear(void) {
-    for (int y = 0; y < VGA_HEIGHT; y++) {
-        for (int x = 0; x < VGA_WIDTH; x++) {
-            vga_memory[y * VGA_WIDTH + x] = (os_color << 8) | ' ';
-        }
+    uint32_t flags = console_acquire();
+    for (int y = 0; y < con_rows; y++) {
+        con_fill_row(con_row(y), os_color);
+        con_touch(y);
     }
     cursor_x = 0;
     cursor_y = 0;
+    console_release(flags);
 }
 
+// console_lock held
 void scroll() {
     // If we're still within the screen, nothing to do
-    if (cursor_y < VGA_HEIGHT)
+    if (cursor_y < con_rows)
         return;
 
-    // Move everything up by one line
-    memcpy(
-        (void*)vga_memory,
-        (void*)(vga_memory + VGA_WIDTH),
-        (VGA_HEIGHT - 1) * VGA_WIDTH * 2     // two bytes per cell
-    );
-
-    // Clear last line
-    for (int x = 0; x < VGA_WIDTH; x++)
-        vga_memory[(VGA_HEIGHT - 1) * VGA_WIDTH + x] = (os_color << 8) | ' ';
+    // the old top row becomes the new bottom one
+    Console* c = con_here;
+    c->head = (c->head + 1) % con_rows;
+    con_fill_row(con_row(con_rows - 1), os_color);
+    for (int y = 0; y < con_rows; y++)
+        con_touch(y);
 
     // Place cursor on last line
-    cursor_y = VGA_HEIGHT - 1;
+    cursor_y = con_rows - 1;
+}
+
+// one cell anywhere on the screen, the cursor stays where it is
+void console_put(int x, int y, char c, uint8_t color) {
+    uint32_t flags = console_acquire();
+    con_row(y)[x] = (color << 8) | (uint8_t)c;
+    con_touch(y);
+    console_release(flags);
 }
 
+// in Threads: takes the text instead of the screen when the calling command's
+// output goes into a pipe ("read x | grep y"), returns 0 otherwise
+int pipe_redirect(const char* s, uint32_t len);
+void serial_putc(char c); // in Serial port, copies the console to COM1
+
 // prints out a single character (virgin function)
 void kput_char(char c, uint8_t color) {
+    if (pipe_redirect(&c, 1)) return;
+    uint32_t flags = console_acquire();
+    if (con_here == &consoles[con_visible]) serial_putc(c); // COM1 follows the screen
     if (c == '\n') {
         cursor_x = 0;
         cursor_y++;
     } else {
-        vga_memory[cursor_y * VGA_WIDTH + cursor_x] = (color << 8) | c;
+        con_row(cursor_y)[cursor_x] = (color << 8) | (uint8_t)c;
+        con_touch(cursor_y);
         cursor_x++;
-        if (cursor_x >= VGA_WIDTH) {
+        if (cursor_x >= con_cols) {
             cursor_x = 0;
             cursor_y++;
         }
     }
 
     scroll();
+    // ticks are milliseconds; before the timer runs every line goes out
+    if (c == '\n' && (!timer_ticks || (uint32_t)timer_ticks - con_flushed_at >= CONSOLE_FLUSH_MS))
+        console_flush_locked();
+    console_release(flags);
 }
 
 void kput_charnf(char c, uint8_t color, int y) {
-    int cursor_y_back = cursor_y;
-    cursor_y = y;
-    cursor_x = 0;               // start at beginning of the given row
-    if (c == '\n') {
-        cursor_x = 0;
-        cursor_y++;            // increment the row correctly
-    } else {
-        vga_memory[cursor_y * VGA_WIDTH + cursor_x] = (color << 8) | c;
-        cursor_x++;
-        if (cursor_x >= VGA_WIDTH) {
-            cursor_x = 0;
-            cursor_y++;       // increment the row correctly
-        }
-    }
-    if (cursor_y >= VGA_HEIGHT) {
-        cursor_y = 0;
-    }
-    cursor_y = cursor_y_back;   // restore the global cursor_y so kprintnf controls the row
+    if (c != '\n' && y >= 0 && y < con_rows)
+        console_put(0, y, c, color); // first column of row y, the cursor stays put
 }
 
 // prints out a bunch of single characters (chad function)
 void kprint(const char* str, uint8_t color) {
+    if (pipe_redirect(str, strlen(str))) return;
+    uint32_t flags = console_acquire(); // lines from different CPUs don't mix
     for (int i = 0; str[i] != '\0'; i++) {
         kput_char(str[i], color);
     }
+    console_release(flags);
+}
+
+// like kprint, for text that isn't NUL terminated (a line out of a file)
+void kwrite(const char* s, uint32_t len, uint8_t color) {
+    if (pipe_redirect(s, len)) return;
+    uint32_t flags = console_acquire();
+    for (uint32_t i = 0; i < len; i++)
+        kput_char(s[i], color);
+    console_release(flags);
 }
 
 void kprintnf(const char* str, uint8_t color, int y) {
+    uint32_t flags = console_acquire();
     int x = 0; // local cursor for this line
     for (int i = 0; str[i]; i++) {
         char c = str[i];
         if (c == '\n') break; // ignore newlines in kprintnf
-        if (x >= VGA_WIDTH) break;
-        vga_memory[y * VGA_WIDTH + x] = (color << 8) | c;
+        if (x >= con_cols) break;
+        con_row(y)[x] = (color << 8) | (uint8_t)c;
         x++;
     }
+    con_touch(y);
+    console_release(flags);
 }
 
-// ================== PS/2 keyboard input ==================
-// some weird shit I don't understand
-static inline uint8_t inb(uint16_t port) {
-    uint8_t ret;
-    __asm__ volatile ("inb %1, %0" : "=a"(ret) : "Nd"(port));
-    return ret;
+void kprint_hex(uint32_t v, uint8_t color) {
+    char buf[11] = "0x00000000";
+    for (int i = 0; i < 8; i++)
+        buf[9 - i] = "0123456789ABCDEF"[(v >> (i * 4)) & 0xF];
+    kprint(buf, color);
 }
 
-uint8_t read_scancode(void) {
-    while (!(inb(0x64) & 1)) { } // wait for output buffer full
-    return inb(0x60);
+void kprint_dec(uint32_t v, uint8_t color) {
+    char buf[11];
+    int pos = 0;
+    do {
+        buf[pos++] = '0' + v % 10;
+        v /= 10;
+    } while (v > 0);
+    while (pos--) kput_char(buf[pos], color);
 }
 
-// just a keyboard keys map (I swiched tab to 'Z')
-char scancode_to_ascii(uint8_t sc) {
-    static const char map[128] = {
-        0,27,'1','2','3','4','5','6','7','8','9','0','-','=','\b',
-        'Z','q','w','e','r','t','y','u','i','o','p','[',']','\n',
-        0,'a','s','d','f','g','h','j','k','l',';','\'','`',
-        0,'\\','z','x','c','v','b','n','m',',','.','/',
-        0,' ',' ',' ',' ',' ',' ',' ',' ',' ',' ',' ',' ',' ',' ',' '
-    };
-
-    static const char map_shift[128] = {
-        0,27,'!','@','#','$','%','^','&','*','(',')','_','+','\b',
-        'Z','Q','W','E','R','T','Y','U','I','O','P','{','}','\n',
-        0,'A','S','D','F','G','H','J','K','L',':','"','~',
-        0,'|','Z','X','C','V','B','N','M','<','>','?',
-        0,' ',' ',' ',' ',' ',' ',' ',' ',' ',' ',' ',' ',' ',' ',' '
-    };
-
-    if (sc == 0x2A || sc == 0x36) { // shift pressed
-        shift_pressed = 1;
-        return 0;
+void kprint_int(int v, uint8_t color) {
+    if (v < 0) {
+        kput_char('-', color);
+        kprint_dec(0u - (uint32_t)v, color);
+    } else {
+        kprint_dec(v, color);
     }
-    if (sc == 0xAA || sc == 0xB6) { // shift released
-        shift_pressed = 0;
-        return 0;
+}
+
+// ================== Kernel log ==================
+// klog() keeps the diagnostics that used to scroll off the screen and be gone:
+// a ring of fixed-size records (TSC, level, subsystem tag, text) that dmesg
+// reads and klogd appends to dmesg.txt a batch at a time (see kernel log on
+// disk). Logging takes no lock, so it's fine with ata_lock or the console
+// held and inside interrupt handlers: a writer claims a slot with one atomic
+// add, copies its text in and publishes the slot by storing its sequence
+// number last. A reader that sees the number change while copying drops the
+// record, it was overwritten by a newer one.
+#define KLOG_RECORDS 512            // power of two
+#define KLOG_TEXT 104               // makes a record 128 bytes
+#define KLOG_ERR 3
+#define KLOG_WARN 4
+#define KLOG_INFO 6
+
+typedef struct {
+    volatile uint32_t seq;          // slot index + 1 once written, 0 while being written
+    uint8_t level;
+    uint8_t len;
+    char tag[8];
+    uint64_t tsc;                   // 0 = no TSC
+    char text[KLOG_TEXT];
+} KlogRecord;
+
+KlogRecord klog_ring[KLOG_RECORDS];
+volatile uint32_t klog_next = 0;    // records ever claimed
+
+void klog(int level, const char* tag, const char* msg) {
+    uint32_t i = __atomic_fetch_add(&klog_next, 1, __ATOMIC_RELAXED);
+    KlogRecord* r = &klog_ring[i % KLOG_RECORDS];
+    __atomic_store_n(&r->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    r->tsc = (cpu_features & CPU_TSC) ? rdtsc() : 0;
+    r->level = level;
+    uint32_t n = strlen(tag);
+    if (n > sizeof(r->tag) - 1) n = sizeof(r->tag) - 1;
+    memcpy(r->tag, tag, n);
+    r->tag[n] = '\0';
+    n = strlen(msg);
+    while (n && msg[n - 1] == '\n') n--; // the kprint'd messages end with one
+    if (n > KLOG_TEXT) n = KLOG_TEXT;
+    memcpy(r->text, msg, n);
+    r->len = n;
+
+    __atomic_store_n(&r->seq, i + 1, __ATOMIC_RELEASE);
+}
+
+// klog with " 0x12345678" after the text (an address, an id, a sector)
+void klog_hex(int level, const char* tag, const char* msg, uint32_t v) {
+    char buf[KLOG_TEXT];
+    uint32_t n = strlen(msg);
+    while (n && msg[n - 1] == '\n') n--;
+    if (n > KLOG_TEXT - 11) n = KLOG_TEXT - 11;
+    memcpy(buf, msg, n);
+    buf[n++] = ' ';
+    buf[n++] = '0';
+    buf[n++] = 'x';
+    for (int i = 7; i >= 0; i--)
+        buf[n++] = "0123456789ABCDEF"[(v >> (i * 4)) & 0xF];
+    buf[n] = '\0';
+    klog(level, tag, buf);
+}
+
+// Copies record `i` out of the ring. 1 = got it, 0 = overwritten by a newer
+// one, -1 = claimed but not written yet. A slot's seq is 0 both while record i
+// is written and while a newer one lapping it is, so that's told apart by how
+// far klog_next has got.
+int klog_read(uint32_t i, KlogRecord* out) {
+    KlogRecord* r = &klog_ring[i % KLOG_RECORDS];
+    uint32_t seq = __atomic_load_n(&r->seq, __ATOMIC_ACQUIRE);
+    if (seq != i + 1)
+        return __atomic_load_n(&klog_next, __ATOMIC_RELAXED) - i > KLOG_RECORDS ? 0 : -1;
+    memcpy(out, (const void*)r, sizeof(KlogRecord));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&r->seq, __ATOMIC_RELAXED) == seq;
+}
+
+// ================== Multiboot ==================
+#define MULTIBOOT_MAGIC 0x2BADB002
+#define MB_INFO_MEMORY  0x001
+#define MB_INFO_CMDLINE 0x004
+#define MB_INFO_MMAP    0x040
+#define MB_INFO_FRAMEBUFFER 0x1000
+#define MB_FB_RGB       1           // framebuffer_type: direct color (2 = EGA text)
+
+typedef struct {
+    uint32_t flags;
+    uint32_t mem_lower;
+    uint32_t mem_upper;
+    uint32_t boot_device;
+    uint32_t cmdline;
+    uint32_t mods_count;
+    uint32_t mods_addr;
+    uint32_t syms[4];
+    uint32_t mmap_length;
+    uint32_t mmap_addr;
+    uint32_t drives_length;
+    uint32_t drives_addr;
+    uint32_t config_table;
+    uint32_t boot_loader_name;
+    uint32_t apm_table;
+    uint32_t vbe_control_info;
+    uint32_t vbe_mode_info;
+    uint16_t vbe_mode;
+    uint16_t vbe_interface_seg;
+    uint16_t vbe_interface_off;
+    uint16_t vbe_interface_len;
+    uint64_t framebuffer_addr;
+    uint32_t framebuffer_pitch;
+    uint32_t framebuffer_width;
+    uint32_t framebuffer_height;
+    uint8_t framebuffer_bpp;
+    uint8_t framebuffer_type;
+    uint8_t red_field_position;
+    uint8_t red_mask_size;
+    uint8_t green_field_position;
+    uint8_t green_mask_size;
+    uint8_t blue_field_position;
+    uint8_t blue_mask_size;
+} __attribute__((packed)) MultibootInfo;
+
+typedef struct {
+    uint32_t size;       // size of the rest of the entry (not counting this field)
+    uint64_t addr;
+    uint64_t len;
+    uint32_t type;       // 1 = usable RAM
+} __attribute__((packed)) MultibootMmapEntry;
+
+// ================== Framebuffer console ==================
+// When GRUB gives us the linear framebuffer the multiboot header asks for,
+// the console rows are drawn there with an 8x8 font doubled to 8x16 cells:
+// 128x48 on 1024x768 instead of 80x25. Every font row is a byte, so for each
+// color attribute the 256 possible bytes are expanded into 8 pixels once
+// (fb_rows) and drawing a cell is 16 copies of 32 bytes, done with SSE2 where
+// there is one. Only cells that differ from what's on screen get drawn, which
+// is also how a scroll is handled: the framebuffer is never read back.
+// 32 bits per pixel only; anything else stays in text mode.
+#define FONT_W 8
+#define FONT_H 16                   // font rows are drawn twice
+
+static const uint8_t font8x8[95][8] = { // 0x20-0x7E, bit 0 is the leftmost pixel
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, // space
+    {0x18, 0x3C, 0x3C, 0x18, 0x18, 0x00, 0x18, 0x00}, // !
+    {0x36, 0x36, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, // "
+    {0x36, 0x36, 0x7F, 0x36, 0x7F, 0x36, 0x36, 0x00}, // #
+    {0x0C, 0x3E, 0x03, 0x1E, 0x30, 0x1F, 0x0C, 0x00}, // $
+    {0x00, 0x63, 0x33, 0x18, 0x0C, 0x66, 0x63, 0x00}, // %
+    {0x1C, 0x36, 0x1C, 0x6E, 0x3B, 0x33, 0x6E, 0x00}, // &
+    {0x06, 0x06, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00}, // '
+    {0x18, 0x0C, 0x06, 0x06, 0x06, 0x0C, 0x18, 0x00}, // (
+    {0x06, 0x0C, 0x18, 0x18, 0x18, 0x0C, 0x06, 0x00}, // )
+    {0x00, 0x66, 0x3C, 0xFF, 0x3C, 0x66, 0x00, 0x00}, // *
+    {0x00, 0x0C, 0x0C, 0x3F, 0x0C, 0x0C, 0x00, 0x00}, // +
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x0C, 0x0C, 0x06}, // ,
+    {0x00, 0x00, 0x00, 0x3F, 0x00, 0x00, 0x00, 0x00}, // -
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x0C, 0x0C, 0x00}, // .
+    {0x60, 0x30, 0x18, 0x0C, 0x06, 0x03, 0x01, 0x00}, // /
+    {0x3E, 0x63, 0x73, 0x7B, 0x6F, 0x67, 0x3E, 0x00}, // 0
+    {0x0C, 0x0E, 0x0C, 0x0C, 0x0C, 0x0C, 0x3F, 0x00}, // 1
+    {0x1E, 0x33, 0x30, 0x1C, 0x06, 0x33, 0x3F, 0x00}, // 2
+    {0x1E, 0x33, 0x30, 0x1C, 0x30, 0x33, 0x1E, 0x00}, // 3
+    {0x38, 0x3C, 0x36, 0x33, 0x7F, 0x30, 0x78, 0x00}, // 4
+    {0x3F, 0x03, 0x1F, 0x30, 0x30, 0x33, 0x1E, 0x00}, // 5
+    {0x1C, 0x06, 0x03, 0x1F, 0x33, 0x33, 0x1E, 0x00}, // 6
+    {0x3F, 0x33, 0x30, 0x18, 0x0C, 0x0C, 0x0C, 0x00}, // 7
+    {0x1E, 0x33, 0x33, 0x1E, 0x33, 0x33, 0x1E, 0x00}, // 8
+    {0x1E, 0x33, 0x33, 0x3E, 0x30, 0x18, 0x0E, 0x00}, // 9
+    {0x00, 0x0C, 0x0C, 0x00, 0x00, 0x0C, 0x0C, 0x00}, // :
+    {0x00, 0x0C, 0x0C, 0x00, 0x00, 0x0C, 0x0C, 0x06}, // ;
+    {0x18, 0x0C, 0x06, 0x03, 0x06, 0x0C, 0x18, 0x00}, // <
+    {0x00, 0x00, 0x3F, 0x00, 0x00, 0x3F, 0x00, 0x00}, // =
+    {0x06, 0x0C, 0x18, 0x30, 0x18, 0x0C, 0x06, 0x00}, // >
+    {0x1E, 0x33, 0x30, 0x18, 0x0C, 0x00, 0x0C, 0x00}, // ?
+    {0x3E, 0x63, 0x7B, 0x7B, 0x7B, 0x03, 0x1E, 0x00}, // @
+    {0x0C, 0x1E, 0x33, 0x33, 0x3F, 0x33, 0x33, 0x00}, // A
+    {0x3F, 0x66, 0x66, 0x3E, 0x66, 0x66, 0x3F, 0x00}, // B
+    {0x3C, 0x66, 0x03, 0x03, 0x03, 0x66, 0x3C, 0x00}, // C
+    {0x1F, 0x36, 0x66, 0x66, 0x66, 0x36, 0x1F, 0x00}, // D
+    {0x7F, 0x46, 0x16, 0x1E, 0x16, 0x46, 0x7F, 0x00}, // E
+    {0x7F, 0x46, 0x16, 0x1E, 0x16, 0x06, 0x0F, 0x00}, // F
+    {0x3C, 0x66, 0x03, 0x03, 0x73, 0x66, 0x7C, 0x00}, // G
+    {0x33, 0x33, 0x33, 0x3F, 0x33, 0x33, 0x33, 0x00}, // H
+    {0x1E, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x1E, 0x00}, // I
+    {0x78, 0x30, 0x30, 0x30, 0x33, 0x33, 0x1E, 0x00}, // J
+    {0x67, 0x66, 0x36, 0x1E, 0x36, 0x66, 0x67, 0x00}, // K
+    {0x0F, 0x06, 0x06, 0x06, 0x46, 0x66, 0x7F, 0x00}, // L
+    {0x63, 0x77, 0x7F, 0x7F, 0x6B, 0x63, 0x63, 0x00}, // M
+    {0x63, 0x67, 0x6F, 0x7B, 0x73, 0x63, 0x63, 0x00}, // N
+    {0x1C, 0x36, 0x63, 0x63, 0x63, 0x36, 0x1C, 0x00}, // O
+    {0x3F, 0x66, 0x66, 0x3E, 0x06, 0x06, 0x0F, 0x00}, // P
+    {0x1E, 0x33, 0x33, 0x33, 0x3B, 0x1E, 0x38, 0x00}, // Q
+    {0x3F, 0x66, 0x66, 0x3E, 0x36, 0x66, 0x67, 0x00}, // R
+    {0x1E, 0x33, 0x07, 0x0E, 0x38, 0x33, 0x1E, 0x00}, // S
+    {0x3F, 0x2D, 0x0C, 0x0C, 0x0C, 0x0C, 0x1E, 0x00}, // T
+    {0x33, 0x33, 0x33, 0x33, 0x33, 0x33, 0x3F, 0x00}, // U
+    {0x33, 0x33, 0x33, 0x33, 0x33, 0x1E, 0x0C, 0x00}, // V
+    {0x63, 0x63, 0x63, 0x6B, 0x7F, 0x77, 0x63, 0x00}, // W
+    {0x63, 0x63, 0x36, 0x1C, 0x1C, 0x36, 0x63, 0x00}, // X
+    {0x33, 0x33, 0x33, 0x1E, 0x0C, 0x0C, 0x1E, 0x00}, // Y
+    {0x7F, 0x63, 0x31, 0x18, 0x4C, 0x66, 0x7F, 0x00}, // Z
+    {0x1E, 0x06, 0x06, 0x06, 0x06, 0x06, 0x1E, 0x00}, // [
+    {0x03, 0x06, 0x0C, 0x18, 0x30, 0x60, 0x40, 0x00}, // backslash
+    {0x1E, 0x18, 0x18, 0x18, 0x18, 0x18, 0x1E, 0x00}, // ]
+    {0x08, 0x1C, 0x36, 0x63, 0x00, 0x00, 0x00, 0x00}, // ^
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xFF}, // _
+    {0x0C, 0x0C, 0x18, 0x00, 0x00, 0x00, 0x00, 0x00}, // `
+    {0x00, 0x00, 0x1E, 0x30, 0x3E, 0x33, 0x6E, 0x00}, // a
+    {0x07, 0x06, 0x06, 0x3E, 0x66, 0x66, 0x3B, 0x00}, // b
+    {0x00, 0x00, 0x1E, 0x33, 0x03, 0x33, 0x1E, 0x00}, // c
+    {0x38, 0x30, 0x30, 0x3E, 0x33, 0x33, 0x6E, 0x00}, // d
+    {0x00, 0x00, 0x1E, 0x33, 0x3F, 0x03, 0x1E, 0x00}, // e
+    {0x1C, 0x36, 0x06, 0x0F, 0x06, 0x06, 0x0F, 0x00}, // f
+    {0x00, 0x00, 0x6E, 0x33, 0x33, 0x3E, 0x30, 0x1F}, // g
+    {0x07, 0x06, 0x36, 0x6E, 0x66, 0x66, 0x67, 0x00}, // h
+    {0x0C, 0x00, 0x0E, 0x0C, 0x0C, 0x0C, 0x1E, 0x00}, // i
+    {0x30, 0x00, 0x30, 0x30, 0x30, 0x33, 0x33, 0x1E}, // j
+    {0x07, 0x06, 0x66, 0x36, 0x1E, 0x36, 0x67, 0x00}, // k
+    {0x0E, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x1E, 0x00}, // l
+    {0x00, 0x00, 0x33, 0x7F, 0x7F, 0x6B, 0x63, 0x00}, // m
+    {0x00, 0x00, 0x1F, 0x33, 0x33, 0x33, 0x33, 0x00}, // n
+    {0x00, 0x00, 0x1E, 0x33, 0x33, 0x33, 0x1E, 0x00}, // o
+    {0x00, 0x00, 0x3B, 0x66, 0x66, 0x3E, 0x06, 0x0F}, // p
+    {0x00, 0x00, 0x6E, 0x33, 0x33, 0x3E, 0x30, 0x78}, // q
+    {0x00, 0x00, 0x3B, 0x6E, 0x66, 0x06, 0x0F, 0x00}, // r
+    {0x00, 0x00, 0x3E, 0x03, 0x1E, 0x30, 0x1F, 0x00}, // s
+    {0x08, 0x0C, 0x3E, 0x0C, 0x0C, 0x2C, 0x18, 0x00}, // t
+    {0x00, 0x00, 0x33, 0x33, 0x33, 0x33, 0x6E, 0x00}, // u
+    {0x00, 0x00, 0x33, 0x33, 0x33, 0x1E, 0x0C, 0x00}, // v
+    {0x00, 0x00, 0x63, 0x6B, 0x7F, 0x7F, 0x36, 0x00}, // w
+    {0x00, 0x00, 0x63, 0x36, 0x1C, 0x36, 0x63, 0x00}, // x
+    {0x00, 0x00, 0x33, 0x33, 0x33, 0x3E, 0x30, 0x1F}, // y
+    {0x00, 0x00, 0x3F, 0x19, 0x0C, 0x26, 0x3F, 0x00}, // z
+    {0x38, 0x0C, 0x0C, 0x07, 0x0C, 0x0C, 0x38, 0x00}, // {
+    {0x18, 0x18, 0x18, 0x00, 0x18, 0x18, 0x18, 0x00}, // |
+    {0x07, 0x0C, 0x0C, 0x38, 0x0C, 0x0C, 0x07, 0x00}, // }
+    {0x6E, 0x3B, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, // ~
+};
+
+static const uint32_t vga_palette[16] = {
+    0x000000, 0x0000AA, 0x00AA00, 0x00AAAA, 0xAA0000, 0xAA00AA, 0xAA5500, 0xAAAAAA,
+    0x555555, 0x5555FF, 0x55FF55, 0x55FFFF, 0xFF5555, 0xFF55FF, 0xFFFF55, 0xFFFFFF,
+};
+
+uint8_t* fb_base = NULL;
+uint32_t fb_pitch = 0;
+uint32_t fb_width = 0;
+uint32_t fb_height = 0;
+uint8_t fb_red_pos = 16, fb_green_pos = 8, fb_blue_pos = 0;
+
+uint32_t* fb_rows[256];             // per attribute: 256 font bytes x 8 pixels
+uint32_t fb_rows_spare[256 * 8];    // used when kmalloc says no
+int fb_rows_spare_attr = -1;
+uint16_t fb_shown[CON_MAX_ROWS][CON_MAX_COLS]; // cells as they are on screen
+uint8_t fb_row_valid[CON_MAX_ROWS];
+
+void* kmalloc(size_t size);
+void* mmio_map(uint32_t phys, uint32_t size);
+
+static uint32_t fb_color(int vga) {
+    uint32_t rgb = vga_palette[vga & 15];
+    return ((rgb >> 16) & 0xFF) << fb_red_pos | ((rgb >> 8) & 0xFF) << fb_green_pos | (rgb & 0xFF) << fb_blue_pos;
+}
+
+static const uint32_t* fb_expanded(uint8_t attr) {
+    uint32_t* rows = fb_rows[attr];
+    if (rows) return rows;
+    rows = kmalloc(sizeof(fb_rows_spare));
+    if (rows) {
+        fb_rows[attr] = rows;
+    } else {
+        rows = fb_rows_spare;
+        if (fb_rows_spare_attr == attr) return rows;
+        fb_rows_spare_attr = attr;
     }
 
-    if (sc < 128) {
-        return shift_pressed ? map_shift[sc] : map[sc];
+    uint32_t fg = fb_color(attr & 15), bg = fb_color(attr >> 4);
+    for (int bits = 0; bits < 256; bits++)
+        for (int x = 0; x < FONT_W; x++)
+            rows[bits * 8 + x] = (bits >> x) & 1 ? fg : bg;
+    return rows;
+}
+
+// the 8 pixels of font row `row` (0-7) of a shadow cell
+static inline const uint32_t* fb_cell_row(uint16_t cell, int row) {
+    uint8_t c = cell & 0xFF;
+    uint8_t bits = c >= 0x20 && c < 0x7F ? font8x8[c - 0x20][row] : 0;
+    return fb_expanded(cell >> 8) + bits * 8;
+}
+
+// one scanline of a row of cells; `shown` NULL draws them all
+static void fb_blit_generic(uint8_t* dst, const uint16_t* cells, const uint16_t* shown, int cols, int row) {
+    for (int x = 0; x < cols; x++, dst += FONT_W * 4) {
+        if (shown && cells[x] == shown[x]) continue;
+        const uint32_t* px = fb_cell_row(cells[x], row);
+        uint32_t* d = (uint32_t*)dst;
+        for (int i = 0; i < FONT_W; i++) d[i] = px[i];
     }
-    return 0;
 }
 
-// ================== Read a line ==================
-// cooooooakjhvdsgkhnlvjsfkjsghlhskgjfhjgvsdfhjkskhjlgfsfpol function :3
-#define HISTORY_SIZE 32
-#define MAX_CMD_LEN 256
+__attribute__((target("sse2")))
+static void fb_blit_sse2(uint8_t* dst, const uint16_t* cells, const uint16_t* shown, int cols, int row) {
+    for (int x = 0; x < cols; x++, dst += FONT_W * 4) {
+        if (shown && cells[x] == shown[x]) continue;
+        const uint32_t* px = fb_cell_row(cells[x], row);
+        _mm_storeu_si128((__m128i*)dst, _mm_loadu_si128((const __m128i*)px));
+        _mm_storeu_si128((__m128i*)(dst + 16), _mm_loadu_si128((const __m128i*)(px + 4)));
+    }
+}
 
-char history[HISTORY_SIZE][MAX_CMD_LEN];
-int history_count = 0;    // number of stored commands
-int history_index = 0;    // index for navigating history
+void (*fb_blit_impl)(uint8_t*, const uint16_t*, const uint16_t*, int, int) = fb_blit_generic;
 
-void kread_line(char* buffer, int maxlen) {
-    int pos = 0;
-    int extended = 0;      // for detecting arrow keys
-    history_index = history_count; // start at “newest” position
+// console_lock held
+void fb_flush_row(int y, const uint16_t* cells) {
+    const uint16_t* shown = fb_row_valid[y] ? fb_shown[y] : NULL;
+    if (shown && memcmp(shown, cells, con_cols * 2) == 0) return;
 
-    while (1) {
-        uint8_t sc = read_scancode();
-        
-        // Check for extended code prefix
-        if (sc == 0xE0) {
-            extended = 1;
-            continue; // next scancode will be arrow
-        }
+    // the timer flushes too, and interrupt handlers leave the SSE registers alone
+    void (*blit)(uint8_t*, const uint16_t*, const uint16_t*, int, int) =
+        interrupt_depth ? fb_blit_generic : fb_blit_impl;
+    uint8_t* line = fb_base + y * FONT_H * fb_pitch;
+    for (int s = 0; s < FONT_H; s++, line += fb_pitch)
+        blit(line, cells, shown, con_cols, s / 2);
 
-        // Handle extended codes (arrows)
-        if (extended) {
-            extended = 0;
-            if (sc == 0x48) { // Up arrow
-                if (history_count > 0 && history_index > 0) {
-                    history_index--;
-                    // Clear current line
-                    while (pos > 0) {
-                        pos--;
-                        cursor_x--;
-                        if (cursor_x < 0) cursor_x = VGA_WIDTH - 1;
-                        vga_memory[cursor_y * VGA_WIDTH + cursor_x] = (os_color << 8) | ' ';
-                    }
-                    // Load command from history
-                    strncpy(buffer, history[history_index], maxlen);
-                    buffer[maxlen-1] = '\0';
-                    pos = strlen(buffer);
-                    kprint(buffer, os_color);
-                }
-                continue;
-            }
-            else if (sc == 0x50) { // Down arrow
-                if (history_count > 0 && history_index < history_count - 1) {
-                    history_index++;
-                    // Clear current line
-                    while (pos > 0) {
-                        pos--;
-                        cursor_x--;
-                        if (cursor_x < 0) cursor_x = VGA_WIDTH - 1;
-                        vga_memory[cursor_y * VGA_WIDTH + cursor_x] = (os_color << 8) | ' ';
-                    }
-                    strncpy(buffer, history[history_index], maxlen);
-                    buffer[maxlen-1] = '\0';
-                    pos = strlen(buffer);
-                    kprint(buffer, os_color);
-                } else if (history_index == history_count - 1) {
-                    // Clear to empty line if at the newest
-                    while (pos > 0) {
-                        pos--;
-                        cursor_x--;
-                        if (cursor_x < 0) cursor_x = VGA_WIDTH - 1;
-                        vga_memory[cursor_y * VGA_WIDTH + cursor_x] = (os_color << 8) | ' ';
-                    }
-                    buffer[0] = '\0';
-                    pos = 0;
-                    history_index = history_count;
-                }
-                continue;
-            }
-            continue; // ignore left/right arrows for now
-        }
-
-        char c = scancode_to_ascii(sc);
-        if (!c) continue;
-
-        // Enter
-        if (c == '\n') {
-            kput_char('\n', os_color);
-            buffer[pos] = '\0';
-
-            // Save to history
-            if (pos > 0) {
-                if (history_count < HISTORY_SIZE) {
-                    strncpy(history[history_count], buffer, MAX_CMD_LEN);
-                    history[history_count][MAX_CMD_LEN-1] = '\0';
-                    history_count++;
-                } else {
-                    // Shift older commands up
-                    for (int i = 1; i < HISTORY_SIZE; i++)
-                        strncpy(history[i-1], history[i], MAX_CMD_LEN);
-                    strncpy(history[HISTORY_SIZE-1], buffer, MAX_CMD_LEN);
-                    history[HISTORY_SIZE-1][MAX_CMD_LEN-1] = '\0';
-                }
-            }
-            history_index = history_count;
-            return;
-        }
+    memcpy(fb_shown[y], cells, con_cols * 2);
+    fb_row_valid[y] = 1;
+}
 
-        // Backspace
-        if (c == '\b') {
-            if (pos > 0) {
-                pos--;
-                cursor_x--;
-                if (cursor_x < 0) cursor_x = VGA_WIDTH - 1;
-                vga_memory[cursor_y * VGA_WIDTH + cursor_x] = (os_color << 8) | ' ';
-            }
-            continue;
+// switches the console over to the framebuffer if GRUB set one up for us
+void fb_console_init(MultibootInfo* mbi) {
+    if (!(mbi->flags & MB_INFO_FRAMEBUFFER) || mbi->framebuffer_type != MB_FB_RGB) return;
+    if (mbi->framebuffer_bpp != 32 || (mbi->framebuffer_addr >> 32)) return;
+    if (mbi->framebuffer_width < VGA_WIDTH * FONT_W || mbi->framebuffer_height < VGA_HEIGHT * FONT_H) return;
+
+    uint8_t* base = mmio_map((uint32_t)mbi->framebuffer_addr, mbi->framebuffer_pitch * mbi->framebuffer_height);
+    if (!base) return;
+
+    uint32_t flags = console_acquire();
+    fb_base = base;
+    fb_pitch = mbi->framebuffer_pitch;
+    fb_width = mbi->framebuffer_width;
+    fb_height = mbi->framebuffer_height;
+    fb_red_pos = mbi->red_field_position;
+    fb_green_pos = mbi->green_field_position;
+    fb_blue_pos = mbi->blue_field_position;
+    if (cpu_features & CPU_SSE2) fb_blit_impl = fb_blit_sse2;
+
+    // put the rings back in order before they get longer
+    for (int i = 0; i < NUM_CONSOLES; i++) {
+        Console* c = &consoles[i];
+        while (c->head) {
+            uint16_t first[CON_MAX_COLS];
+            memcpy(first, c->shadow[0], sizeof(first));
+            for (int y = 1; y < con_rows; y++)
+                memcpy(c->shadow[y - 1], c->shadow[y], sizeof(first));
+            memcpy(c->shadow[con_rows - 1], first, sizeof(first));
+            c->head--;
         }
+    }
 
-        // Normal character
-        if (pos < maxlen - 1) {
-            buffer[pos++] = c;
-            kput_char(c, os_color);
+    int old_rows = con_rows;
+    con_cols = fb_width / FONT_W;
+    con_rows = fb_height / FONT_H;
+    if (con_cols > CON_MAX_COLS) con_cols = CON_MAX_COLS;
+    if (con_rows > CON_MAX_ROWS) con_rows = CON_MAX_ROWS;
+    for (int i = 0; i < NUM_CONSOLES; i++) {
+        Console* c = &consoles[i];
+        for (int y = 0; y < con_rows; y++) {
+            uint16_t* row = con_row_of(c, y);
+            if (y >= old_rows) con_fill_row(row, c->color);
+            else for (int x = VGA_WIDTH; x < con_cols; x++) row[x] = (c->color << 8) | ' ';
+            c->dirty[y] = 1;
         }
     }
-}
-
-// the same as strcmp but checks if the string1 starts with string2
-int starts_with(const char* str, const char* prefix) {
-    int i = 0;
-    while (prefix[i]) {
-        if (str[i] != prefix[i]) return 0;
-        i++;
+    for (int y = 0; y < con_rows; y++)
+        fb_row_valid[y] = 0;
+    con_any_dirty = 1;
+
+    // the strip right and below the cells never gets drawn otherwise
+    uint32_t bg = fb_color(os_color >> 4);
+    for (uint32_t y = 0; y < fb_height; y++) {
+        uint32_t* p = (uint32_t*)(fb_base + y * fb_pitch);
+        for (uint32_t x = 0; x < fb_width; x++) p[x] = bg;
     }
-    return 1;
-}
 
-// strlen
-size_t strlen(const char* str) {
-    size_t len = 0;
-    while (str[len]) len++;
-    return len;
+    fb_active = 1;
+    console_flush_locked();
+    console_release(flags);
 }
 
-char* strncpy(char* dest, const char* src, size_t n) {
-    size_t i = 0;
-    for (; i < n && src[i]; i++) dest[i] = src[i];
-    for (; i < n; i++) dest[i] = '\0';
-    return dest;
-}
+// ================== Physical memory manager ==================
+// one bit per 4KB frame below IDENTITY_LIMIT (the part of RAM the kernel can
+// address directly): 0 = free, 1 = used or not RAM at all
+#define FRAME_SIZE 4096
+#define MAX_FRAMES (0x40000000u / FRAME_SIZE)
 
-int strcmp(const char* a, const char* b) {
-    int i = 0;
-    while (a[i] && b[i]) {
-        if (a[i] != b[i]) return 0;  // mismatch
-        i++;
-    }
-    // both must end at the same time
-    return (a[i] == b[i]) ? 1 : 0;
+extern uint8_t _kernel_start[];
+extern uint8_t _kernel_end[];
+
+uint32_t frame_bitmap[MAX_FRAMES / 32];
+uint32_t frame_count = 0;     // frames below the highest usable address
+uint32_t frames_total = 0;    // usable frames reported by the bootloader
+uint32_t frames_used = 0;
+uint32_t frame_hint = 0;      // first word that may have a free bit
+
+static inline int frame_is_used(uint32_t f) {
+    return frame_bitmap[f / 32] & (1u << (f % 32));
 }
-static inline void outw(uint16_t port, uint16_t val) {
-    __asm__ volatile("outw %0, %1" : : "a"(val), "Nd"(port));
+
+static void frame_set(uint32_t f, int used) {
+    if (used) frame_bitmap[f / 32] |= 1u << (f % 32);
+    else      frame_bitmap[f / 32] &= ~(1u << (f % 32));
 }
 
-void shutdown(void) {
-    // shutting down (I dunno if it will work on a real computer, it works in qemu for shure)
-	kprint("Shutting down...", os_color);
-    outw(0x604, 0x2000);
-    for (;;); // hang if not powered off
+static void pmm_mark_range(uint64_t start, uint64_t end, int used) {
+    if (start >= MAX_FRAMES * (uint64_t)FRAME_SIZE) return;
+    if (end > MAX_FRAMES * (uint64_t)FRAME_SIZE) end = MAX_FRAMES * (uint64_t)FRAME_SIZE;
+
+    // free only whole frames, reserve every frame the range touches
+    uint32_t first = used ? (uint32_t)(start / FRAME_SIZE) : (uint32_t)((start + FRAME_SIZE - 1) / FRAME_SIZE);
+    uint32_t last  = used ? (uint32_t)((end + FRAME_SIZE - 1) / FRAME_SIZE) : (uint32_t)(end / FRAME_SIZE);
+    for (uint32_t f = first; f < last; f++) {
+        if (!used && frame_is_used(f)) { frames_total++; }
+        if (used && !frame_is_used(f)) { frames_total--; }
+        frame_set(f, used);
+    }
+    if (!used && last > frame_count) frame_count = last;
 }
 
-typedef struct {
-    enum { ARG_STR, ARG_INT } type;
-    union {
-        char* s;
-        int i;
-    } v;
-} PrintArg;
+void pmm_init(uint32_t magic, MultibootInfo* mbi) {
+    memset(frame_bitmap, 0xFF, sizeof(frame_bitmap));
+    frames_total = 0;
+
+    if (magic == MULTIBOOT_MAGIC && (mbi->flags & MB_INFO_MMAP)) {
+        uint32_t p = mbi->mmap_addr;
+        while (p < mbi->mmap_addr + mbi->mmap_length) {
+            MultibootMmapEntry* e = (MultibootMmapEntry*)p;
+            if (e->type == 1)
+                pmm_mark_range(e->addr, e->addr + e->len, 0);
+            p += e->size + 4;
+        }
+    } else if (magic == MULTIBOOT_MAGIC && (mbi->flags & MB_INFO_MEMORY)) {
+        pmm_mark_range(0x100000, 0x100000 + (uint64_t)mbi->mem_upper * 1024, 0);
+    } else {
+        pmm_mark_range(0x100000, 0x1000000, 0); // no info at all: assume 16MB
+    }
 
-void kprintf_dynamic(const char* fmt, uint8_t color, PrintArg* list, int count) {
-    int idx = 0;
+    // never hand out the real mode area, the kernel image or the boot info
+    pmm_mark_range(0, 0x100000, 1);
+    pmm_mark_range((uint32_t)_kernel_start, (uint32_t)_kernel_end, 1);
+    if (magic == MULTIBOOT_MAGIC) {
+        pmm_mark_range((uint32_t)mbi, (uint32_t)mbi + sizeof(MultibootInfo), 1);
+        if (mbi->flags & MB_INFO_MMAP)
+            pmm_mark_range(mbi->mmap_addr, mbi->mmap_addr + mbi->mmap_length, 1);
+    }
+    frames_used = 0;
+    frame_hint = 0;
+}
 
-    const char* p = fmt;
-    while (*p) {
-        if (*p == '%') {
-            p++;
-            if (*p == 's') {
-                if (idx < count && list[idx].type == ARG_STR)
-                    kprint(list[idx++].v.s, color);
-            } else if (*p == 'i') {
-                if (idx < count && list[idx].type == ARG_INT) {
-                    char buf[32];
-                    int v = list[idx++].v.i;
-
-                    int pos = 0, neg = 0;
-                    if (v < 0) { neg = 1; v = -v; }
-
-                    if (v == 0) buf[pos++] = '0';
-                    else {
-                        char tmp[16];
-                        int t = 0;
-                        while (v) { tmp[t++] = (v % 10) + '0'; v /= 10; }
-                        if (neg) buf[pos++] = '-';
-                        while (t--) buf[pos++] = tmp[t];
-                    }
-                    buf[pos] = 0;
-                    kprint(buf, color);
-                }
-            }
-            else kput_char(*p, color);
-        } else {
-            kput_char(*p, color);
+// contiguous run of `count` frames starting at a multiple of `align` frames,
+// returns the physical (= virtual) address
+static void* pmm_find_pages(uint32_t count, uint32_t align) {
+    uint32_t run = 0;
+    for (uint32_t f = frame_hint * 32; f < frame_count; f++) {
+        if (run == 0 && (f % 32) == 0 && frame_bitmap[f / 32] == 0xFFFFFFFF) {
+            f += 31; // whole word used, skip it
+            continue;
+        }
+        if (frame_is_used(f)) { run = 0; continue; }
+        if (run == 0 && f % align) continue;
+        if (++run == count) {
+            uint32_t first = f + 1 - count;
+            for (uint32_t i = first; i <= f; i++) frame_set(i, 1);
+            frames_used += count;
+            if (count == 1 && first / 32 == frame_hint && frame_bitmap[frame_hint] == 0xFFFFFFFF)
+                frame_hint++;
+            return (void*)(first * FRAME_SIZE);
         }
-        p++;
     }
+    return NULL;
 }
 
-unsigned char hex_to_nibble(char c) {
-    if (c >= '0' && c <= '9') return c - '0';
-    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
-    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
-    return 0; // fallback
+Spinlock pmm_lock;
+
+void* pmm_alloc_pages(uint32_t count) {
+    uint32_t flags = spin_lock_irqsave(&pmm_lock);
+    void* p = pmm_find_pages(count, 1);
+    spin_unlock_irqrestore(&pmm_lock, flags);
+    return p;
 }
 
-// outb: write 8-bit value (byte)
-static inline void outb(uint16_t port, uint8_t value) {
-    __asm__ volatile ("outb %0, %1" : : "a"(value), "Nd"(port));
+// `count` frames starting at a multiple of `count` (a power of two), for
+// kernel stacks
+void* pmm_alloc_aligned(uint32_t count) {
+    uint32_t flags = spin_lock_irqsave(&pmm_lock);
+    void* p = pmm_find_pages(count, count);
+    spin_unlock_irqrestore(&pmm_lock, flags);
+    return p;
 }
 
-// inw: read 16-bit value (word)
-static inline uint16_t inw(uint16_t port) {
-    uint16_t ret;
-    __asm__ volatile ("inw %1, %0" : "=a"(ret) : "Nd"(port));
-    return ret;
+void* pmm_alloc_page(void) {
+    return pmm_alloc_pages(1);
 }
 
-// outl: write 32-bit value (dword)
-static inline void outl(uint16_t port, uint32_t value) {
-    __asm__ volatile ("outl %0, %1" : : "a"(value), "Nd"(port));
+void pmm_free_pages(void* addr, uint32_t count) {
+    uint32_t flags = spin_lock_irqsave(&pmm_lock);
+    uint32_t first = (uint32_t)addr / FRAME_SIZE;
+    for (uint32_t f = first; f < first + count; f++) frame_set(f, 0);
+    frames_used -= count;
+    if (first / 32 < frame_hint) frame_hint = first / 32;
+    spin_unlock_irqrestore(&pmm_lock, flags);
 }
 
-// inl: read 32-bit value (dword)
-static inline uint32_t inl(uint16_t port) {
-    uint32_t ret;
-    __asm__ volatile ("inl %1, %0" : "=a"(ret) : "Nd"(port));
-    return ret;
+void pmm_free_page(void* addr) {
+    pmm_free_pages(addr, 1);
 }
 
-void ata_read28(uint32_t lba, uint8_t *buffer) {
-    outb(0x1F6, 0xE0 | ((lba >> 24) & 0x0F));
-    outb(0x1F2, 1);                    // sector count
-    outb(0x1F3, (uint8_t) lba);
-    outb(0x1F4, (uint8_t)(lba >> 8));
-    outb(0x1F5, (uint8_t)(lba >> 16));
-    outb(0x1F7, 0x20);                 // READ SECTORS
-    
-    // wait for data
-    while (!(inb(0x1F7) & 0x08));
+// ================== Kernel heap ==================
+// kmalloc serves small requests from per-size slab caches (one page per slab,
+// header at the start of the page), bigger ones get whole pages with a small
+// header in front. kfree tells them apart by the magic at the page start.
+#define SLAB_MAGIC  0x51AB51AB
+#define LARGE_MAGIC 0x1A46E000
+
+typedef struct Slab {
+    uint32_t magic;
+    struct SlabCache* cache;
+    struct Slab* prev;
+    struct Slab* next;
+    void* free_list;     // singly linked through the free objects themselves
+    uint16_t in_use;
+    uint16_t capacity;
+} Slab;
+
+typedef struct SlabCache {
+    const char* name;
+    uint32_t obj_size;
+    Slab* partial;       // slabs with at least one free object
+    Slab* full;
+    uint32_t slabs;
+    uint32_t in_use;
+} SlabCache;
 
-    // read 256 words = 512 bytes
-    for (int i = 0; i < 256; i++)
-        ((uint16_t*)buffer)[i] = inw(0x1F0);
+typedef struct {
+    uint32_t magic;
+    uint32_t pages;
+    uint32_t size;
+    uint32_t _pad;
+} LargeHeader;
+
+SlabCache slab_caches[] = {
+    {"kmalloc-16", 16},
+    {"kmalloc-32", 32},
+    {"kmalloc-64", 64},
+    {"kmalloc-128", 128},
+    {"kmalloc-256", 256},
+    {"kmalloc-512", 512},
+    {"kmalloc-1024", 1024},
+};
+#define SLAB_CACHE_COUNT (sizeof(slab_caches)/sizeof(slab_caches[0]))
+#define SLAB_MAX_OBJ 1024
+#define SLAB_HEADER_SIZE ((sizeof(Slab) + 15) & ~15u)
+
+uint32_t large_allocs = 0;
+uint32_t large_pages = 0;
+
+static void slab_list_remove(Slab** list, Slab* s) {
+    if (s->prev) s->prev->next = s->next;
+    else *list = s->next;
+    if (s->next) s->next->prev = s->prev;
+    s->prev = s->next = NULL;
 }
 
-void ata_write28(uint32_t lba, uint8_t *buffer) {
-    outb(0x1F6, 0xE0 | ((lba >> 24) & 0x0F));
-    outb(0x1F2, 1);
-    outb(0x1F3, (uint8_t) lba);
-    outb(0x1F4, (uint8_t)(lba >> 8));
-    outb(0x1F5, (uint8_t)(lba >> 16));
-    outb(0x1F7, 0x30); // WRITE SECTORS
+static void slab_list_push(Slab** list, Slab* s) {
+    s->prev = NULL;
+    s->next = *list;
+    if (*list) (*list)->prev = s;
+    *list = s;
+}
 
-    // Write 256 words immediately
-    for (int i = 0; i < 256; i++)
-        outw(0x1F0, ((uint16_t*)buffer)[i]);
+static Slab* slab_create(SlabCache* c) {
+    Slab* s = pmm_alloc_pages(1);
+    if (!s) return NULL;
+
+    s->magic = SLAB_MAGIC;
+    s->cache = c;
+    s->in_use = 0;
+    s->capacity = (FRAME_SIZE - SLAB_HEADER_SIZE) / c->obj_size;
+    s->free_list = NULL;
+
+    uint8_t* base = (uint8_t*)s + SLAB_HEADER_SIZE;
+    for (int i = s->capacity - 1; i >= 0; i--) {
+        void** obj = (void**)(base + i * c->obj_size);
+        *obj = s->free_list;
+        s->free_list = obj;
+    }
+    c->slabs++;
+    return s;
 }
 
-typedef struct {
-    uint32_t fat_start;
-    uint32_t fat_size;
-    uint32_t data_start;
-    uint32_t sectors_per_cluster;
-} fat32_t;
+static void* heap_alloc(size_t size) {
+    if (size == 0) return NULL;
+
+    if (size > SLAB_MAX_OBJ) {
+        uint32_t pages = (size + sizeof(LargeHeader) + FRAME_SIZE - 1) / FRAME_SIZE;
+        LargeHeader* h = pmm_alloc_pages(pages);
+        if (!h) return NULL;
+        h->magic = LARGE_MAGIC;
+        h->pages = pages;
+        h->size = size;
+        large_allocs++;
+        large_pages += pages;
+        return h + 1;
+    }
 
-fat32_t fat;
+    SlabCache* c = &slab_caches[0];
+    while (c->obj_size < size) c++;
 
-void fat32_mount() {
-    uint8_t sector[512];
-    ata_read28(0, sector);
-    
-	uint16_t reserved = *(uint16_t*)&sector[0x0E];
-	uint8_t fats = sector[0x10];
-	uint32_t fat_size = *(uint32_t*)&sector[0x24];
+    if (!c->partial) {
+        Slab* s = slab_create(c);
+        if (!s) return NULL;
+        slab_list_push(&c->partial, s);
+    }
 
-	fat.fat_start = reserved;
-	fat.fat_size = fat_size;
-	fat.data_start = reserved + fats * fat_size;
-	fat.sectors_per_cluster = sector[13];
+    Slab* s = c->partial;
+    void** obj = s->free_list;
+    s->free_list = *obj;
+    s->in_use++;
+    c->in_use++;
+
+    if (!s->free_list) {
+        slab_list_remove(&c->partial, s);
+        slab_list_push(&c->full, s);
+    }
+    return obj;
 }
 
-struct FileEntry {
-    char     name[16];   // "file.txt"
-    uint32_t start;      // LBA where data starts
-    uint32_t size;       // size in bytes
-    uint8_t  used;       // 1 = used, 0 = empty
-};
+// returns 0 if `ptr` isn't something heap_alloc handed out
+static int heap_free(void* ptr) {
+    if (!ptr) return 1;
+
+    uint32_t* page = (uint32_t*)((uint32_t)ptr & ~(FRAME_SIZE - 1));
+    if (*page == LARGE_MAGIC) {
+        LargeHeader* h = (LargeHeader*)page;
+        large_allocs--;
+        large_pages -= h->pages;
+        h->magic = 0;
+        pmm_free_pages(h, h->pages);
+        return 1;
+    }
+    if (*page != SLAB_MAGIC) return 0;
 
-#define MAX_FILES 128
-#define FILETABLE_LBA 4096
-#define FIRST_DATA_LBA 4104
+    Slab* s = (Slab*)page;
+    SlabCache* c = s->cache;
+    int was_full = (s->free_list == NULL);
 
-uint32_t next_free_lba = FIRST_DATA_LBA;
+    *(void**)ptr = s->free_list;
+    s->free_list = ptr;
+    s->in_use--;
+    c->in_use--;
 
-typedef struct {
-    char name[16];
-    uint32_t start;
-    uint32_t size;
-    uint8_t used;
-    uint8_t _pad[7];
-} FileEntry;
+    if (was_full) {
+        slab_list_remove(&c->full, s);
+        slab_list_push(&c->partial, s);
+    }
 
-FileEntry files[MAX_FILES];
+    // give empty slabs back, but keep one around so alloc/free pairs don't thrash
+    if (s->in_use == 0 && (s->prev || s->next)) {
+        slab_list_remove(&c->partial, s);
+        s->magic = 0;
+        c->slabs--;
+        pmm_free_page(s);
+    }
+    return 1;
+}
 
-void fs_load() {
-    uint8_t buffer[512];
+// the heap is shared by every CPU; nothing in it sleeps, so a spinlock does
+Spinlock heap_lock;
 
-    // Clear files first so unused entries are clean
-    memset(files, 0, sizeof(files));
+int mmap_evict_one(void);
 
-    for (int i = 0; i < 8; i++) {               // 8 sectors = 4096 bytes
-        ata_read28(FILETABLE_LBA + i, buffer);
-        memcpy(((uint8_t*)files) + i*512, buffer, 512);
+// If RAM is full, a cached file page is dropped and the allocation retried.
+// That happens with heap_lock released: eviction may write a shared page back
+// to disk, and whatever it logs or prints can end up in kmalloc again (a pipe).
+void* kmalloc(size_t size) {
+    for (;;) {
+        uint32_t flags = spin_lock_irqsave(&heap_lock);
+        void* p = heap_alloc(size);
+        spin_unlock_irqrestore(&heap_lock, flags);
+        if (p || size == 0 || !mmap_evict_one()) return p;
     }
+}
 
-    // Ensure every filename is NUL-terminated (defensive)
-    for (int i = 0; i < MAX_FILES; i++) {
-        files[i].name[15] = '\0'; // ensure last byte is NUL
+void kfree(void* ptr) {
+    uint32_t flags = spin_lock_irqsave(&heap_lock);
+    int ok = heap_free(ptr);
+    spin_unlock_irqrestore(&heap_lock, flags);
+    if (!ok) { // printed with the lock dropped, kprint into a pipe allocates
+        klog_hex(KLOG_ERR, "heap", "kfree: bad pointer", (uint32_t)ptr);
+        kprint("kfree: bad pointer!\n", (os_color & 0xF0) | 0x0C);
     }
+}
 
-    // Recompute next_free_lba based on existing files so allocations never overlap
-    next_free_lba = FIRST_DATA_LBA;
-    for (int i = 0; i < MAX_FILES; i++) {
-        if (files[i].used) {
-            uint32_t file_sectors = (files[i].size + 511) / 512;
-            uint32_t end_lba = files[i].start + file_sectors;
-            if (end_lba > next_free_lba) next_free_lba = end_lba;
-        }
-    }
+// usable size of an allocation (what the cache/page rounding actually gave us)
+static size_t kmalloc_size(void* ptr) {
+    uint32_t* page = (uint32_t*)((uint32_t)ptr & ~(FRAME_SIZE - 1));
+    if (*page == LARGE_MAGIC)
+        return ((LargeHeader*)page)->pages * FRAME_SIZE - sizeof(LargeHeader);
+    return ((Slab*)page)->cache->obj_size;
 }
 
-void fs_save() {
-    uint8_t buffer[512];
+void* krealloc(void* ptr, size_t size) {
+    if (!ptr) return kmalloc(size);
+    if (size == 0) { kfree(ptr); return NULL; }
 
-    for (int i = 0; i < 8; i++) {
-        memcpy(buffer, ((uint8_t*)files) + i*512, 512);
-        ata_write28(FILETABLE_LBA + i, buffer);
-    }
+    size_t old = kmalloc_size(ptr);
+    if (size <= old) return ptr;
+
+    void* n = kmalloc(size);
+    if (!n) return NULL;
+    memcpy(n, ptr, old);
+    kfree(ptr);
+    return n;
 }
 
-uint32_t fs_allocate_sectors(uint32_t sectors) {
-    uint32_t start = next_free_lba;
-    next_free_lba += sectors;
-    return start;
+char* kstrdup(const char* s) {
+    size_t len = strlen(s);
+    char* d = kmalloc(len + 1);
+    if (d) memcpy(d, s, len + 1);
+    return d;
 }
 
-static int ata_write_safe(uint32_t lba, uint8_t* buf) {
-    int timeout = 1000000;
+// ================== Scratch arena ==================
+// Short-lived buffers for command handlers. Allocating is a pointer bump,
+// there is no free: handle_command marks the arena on entry and releases
+// back to the mark on exit, so nested commands (zscript) clean up after
+// themselves and the top-level command leaves the arena empty.
+#define ARENA_CHUNK_SIZE (64 * 1024)
+#define ARENA_ALIGN 16
+
+typedef struct ArenaChunk {
+    struct ArenaChunk* next;
+    uint32_t size;       // usable bytes after the header
+    uint32_t used;
+    uint32_t _pad;
+} ArenaChunk;
 
-    // Wait for drive not busy
-    while ((inb(0x1F7) & 0x80) && timeout--) { }
-    if (timeout <= 0) { kprint("ATA write timeout (BSY)\n", (os_color & 0xF0) | 0x0C); return 0; }
+typedef struct {
+    ArenaChunk* first;
+    ArenaChunk* current;
+} Arena;
 
-    // Select LBA and sector count
-    outb(0x1F6, 0xE0 | ((lba >> 24) & 0x0F));
-    outb(0x1F2, 1);
-    outb(0x1F3, (uint8_t) lba);
-    outb(0x1F4, (uint8_t)(lba >> 8));
-    outb(0x1F5, (uint8_t)(lba >> 16));
-    outb(0x1F7, 0x30); // WRITE SECTOR
+typedef struct {
+    ArenaChunk* chunk;
+    uint32_t used;
+} ArenaMark;
 
-    timeout = 1000000;
-    // Wait for DRQ = ready for data
-    while (!(inb(0x1F7) & 0x08) && timeout--) { }
-    if (timeout <= 0) { kprint("ATA write timeout (DRQ)\n", (os_color & 0xF0) | 0x0C); return 0; }
+static inline Arena* thread_arena(void); // every thread has its own, see Threads
 
-    // Write the 512-byte sector
-    for (int i = 0; i < 256; i++)
-        outw(0x1F0, ((uint16_t*)buf)[i]);
+void* arena_alloc(Arena* a, size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
 
-    timeout = 1000000;
-    // Wait for drive to finish writing
-    while ((inb(0x1F7) & 0x80) && timeout--) { }
-    if (timeout <= 0) { kprint("ATA write timeout after data!\n", (os_color & 0xF0) | 0x0C); return 0; }
+    ArenaChunk* c = a->current;
+    while (c && c->used + size > c->size) {
+        // chunks past the current one are leftovers from earlier commands, reuse them
+        c = c->next;
+        if (c) c->used = 0;
+    }
+
+    if (!c) {
+        uint32_t want = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+        c = kmalloc(sizeof(ArenaChunk) + want);
+        if (!c) return NULL;
+        c->size = want;
+        c->used = 0;
+        c->next = NULL;
+        if (a->current) {
+            // keep any spare chunks after the new one
+            ArenaChunk* tail = a->current;
+            while (tail->next) tail = tail->next;
+            tail->next = c;
+        } else {
+            a->first = c;
+        }
+    }
 
-    return 1; // success
+    a->current = c;
+    void* p = (uint8_t*)(c + 1) + c->used;
+    c->used += size;
+    return p;
 }
 
-#define MAX_SECTORS 65536 // adjust to your disk size
-uint8_t sector_bitmap[MAX_SECTORS / 8]; // 1 bit per sector: 0 = free, 1 = used
+ArenaMark arena_mark(Arena* a) {
+    ArenaMark m = { a->current, a->current ? a->current->used : 0 };
+    return m;
+}
 
-// ----------------- bitmap helpers -----------------
-void mark_sector(uint32_t lba, int used) {
-    uint32_t byte = lba / 8;
-    uint8_t bit = 1 << (lba % 8);
-    if (used)
-        sector_bitmap[byte] |= bit;
-    else
-        sector_bitmap[byte] &= ~bit;
+void arena_release(Arena* a, ArenaMark m) {
+    if (!m.chunk) {
+        a->current = a->first;
+        if (a->current) a->current->used = 0;
+        return;
+    }
+    a->current = m.chunk;
+    m.chunk->used = m.used;
+}
+
+// empties the arena and gives oversized/extra chunks back to the heap
+void arena_reset(Arena* a) {
+    if (!a->first) return;
+    ArenaChunk* c = a->first->next;
+    while (c) {
+        ArenaChunk* next = c->next;
+        kfree(c);
+        c = next;
+    }
+    if (a->first->size > ARENA_CHUNK_SIZE) {
+        kfree(a->first);
+        a->first = NULL;
+    } else {
+        a->first->next = NULL;
+        a->first->used = 0;
+    }
+    a->current = a->first;
+}
+
+void* scratch_alloc(size_t size) {
+    return arena_alloc(thread_arena(), size);
+}
+
+ArenaMark scratch_mark(void) {
+    return arena_mark(thread_arena());
+}
+
+void scratch_release(ArenaMark m) {
+    arena_release(thread_arena(), m);
+}
+
+// ================== Threads ==================
+// Kernel threads on every CPU. Each CPU has its own run queue and takes turns
+// round robin; its local APIC timer (the PIT with a single CPU) ends a slice
+// after THREAD_SLICE_MS. A CPU whose queue runs dry steals from the busiest
+// other one before it idles. Otherwise a thread only gives its CPU up when it
+// blocks (wait queue, mutex, sleep_ms) or ends. The boot thread becomes the
+// shell; background jobs get a stack from the PMM each.
+#define THREAD_SLICE_MS 10
+#define VAR_MAX_NESTING 16
+#define MAX_CPUS 8
+
+enum { THREAD_READY, THREAD_RUNNING, THREAD_BLOCKED, THREAD_DEAD };
+
+typedef struct WaitQueue {
+    struct Thread* head;
+    struct Thread* tail;
+    volatile uint32_t seq;      // bumped by every wakeup, see wq_prepare
+} WaitQueue;
+
+// the variable scopes a thread can see, innermost last (see Shell variables)
+typedef struct {
+    uint16_t ids[VAR_MAX_NESTING];
+    int depth;
+    int overflow;               // pushes past VAR_MAX_NESTING share the innermost
+} VarScopes;
+
+typedef struct Cpu {
+    int id;                     // index into cpus[], bit in cpus_online_mask
+    uint8_t apic_id;
+    volatile int online;
+    Spinlock rq_lock;
+    struct Thread* rq_head;
+    struct Thread* rq_tail;
+    volatile int rq_len;
+    struct Thread* idle;        // runs when there's nothing else, never queued
+    struct Thread* volatile running;
+    struct Thread* prev;        // just switched away from, see schedule_tail
+    volatile int need_resched;  // the slice is over, switch at the next chance
+    int in_schedule;            // no preempting the scheduler itself
+    uint32_t switches;
+    uint32_t steals;
+} Cpu;
+
+// What a command prints while its output is piped into the next one. The
+// stages of a pipeline run one after another, so a pipe is just a growing
+// buffer: the writer fills it, then the next stage reads it as a whole.
+#define PIPE_MAX (1024 * 1024)
+
+typedef struct Pipe {
+    char* data;
+    uint32_t len;
+    uint32_t cap;
+    uint32_t pos;               // how much a user program has read() so far
+    int full;                   // went over PIPE_MAX, the rest was dropped
+} Pipe;
+
+static void pipe_write(Pipe* p, const char* s, uint32_t n) {
+    if (p->len + n > p->cap) {
+        uint32_t cap = p->cap ? p->cap : 4096;
+        while (cap < p->len + n && cap < PIPE_MAX) cap *= 2;
+        if (cap > PIPE_MAX) cap = PIPE_MAX;
+        char* data = cap > p->cap ? kmalloc(cap) : NULL;
+        if (data) {
+            memcpy(data, p->data, p->len);
+            kfree(p->data);
+            p->data = data;
+            p->cap = cap;
+        }
+        if (p->len + n > p->cap) {
+            n = p->cap - p->len;
+            p->full = 1;
+        }
+    }
+    memcpy(p->data + p->len, s, n);
+    p->len += n;
+}
+
+typedef struct Thread {
+    uint32_t esp;               // saved by switch_context
+    int id;
+    volatile int state;
+    volatile int killed;        // kill asked it to stop at the next chance
+    volatile int on_cpu;        // registers still live on some CPU, don't run it yet
+    Cpu* cpu;                   // where it runs or ran last
+    struct Thread* next;        // run queue or wait queue
+    struct Thread* all_next;    // every thread, for jobs
+    WaitQueue* waiting_on;
+    void (*fn)(void*);
+    void* arg;
+    char* name;                 // what jobs shows
+    uint8_t* stack;             // KSTACK_SIZE, StackHead at the bottom; NULL for the boot thread
+    uint8_t* fpu;               // xsave/fxsave area, 64-byte aligned
+    void* fpu_alloc;
+
+    int shell;                  // a console's shell, not a job
+    int service;                // a kernel thread (klogd), not a job either
+    int command_depth;          // >0 while a command (or a zscript's nested command) runs
+    int zs_file_depth;          // scripts running right now
+    Arena arena;                // its scratch arena
+    VarScopes scopes;
+    Pipe* pipe_in;              // the previous pipeline stage's output, NULL = none
+    Pipe* pipe_out;             // where kprint goes instead of the screen, NULL = screen
+
+    uint32_t* pgdir;            // a user program's page directory, NULL = page_directory
+    uint32_t user_return;       // kernel esp to go back to when the program ends, and
+                                // where ring 3 enters the kernel while it runs
+} Thread;
+
+// void switch_context(uint32_t* save_esp, uint32_t load_esp), in kernel.asm
+extern void switch_context(uint32_t* save_esp, uint32_t load_esp);
+extern uint32_t page_directory[1024];
+void tss_set_stack(int cpu, uint32_t esp0);
+
+Cpu cpus[MAX_CPUS];
+int cpu_count = 1;              // entries of cpus[] in use, online or not
+volatile uint32_t cpus_online_mask = 1;
+
+// kernel.asm points the boot stack's StackHead here before kmain runs
+Thread boot_thread = {
+    .state = THREAD_RUNNING,
+    .on_cpu = 1,
+    .cpu = &cpus[0],
+    .name = "shell",
+    .shell = 1,
+    .scopes = { {0}, 1, 0 },
+};
+Thread idle_threads[MAX_CPUS];
+
+Thread* all_threads = &boot_thread;
+Spinlock threads_lock;          // all_threads, next_thread_id
+int next_thread_id = 1;
+Spinlock wait_lock;             // every wait queue and mutex, and who's blocked
+int threads_ready = 0;          // schedule() has somewhere to go (threads_init ran)
+uint8_t* fpu_initial = NULL;    // clean FPU state new threads start with
+
+static inline Thread* this_thread(void) {
+    return stack_head()->thread;
+}
+
+// only stable with interrupts off, a thread can move to another CPU otherwise
+static inline Cpu* this_cpu(void) {
+    return this_thread()->cpu;
+}
+
+volatile int panicking = 0;     // set before a panic prints anything
+
+// a panic or an interrupt handler always gets the screen
+int pipe_redirect(const char* s, uint32_t len) {
+    if (interrupt_depth || panicking) return 0;
+    Pipe* p = this_thread()->pipe_out;
+    if (!p) return 0;
+    pipe_write(p, s, len);
+    return 1;
+}
+
+static inline Arena* thread_arena(void) {
+    return &this_thread()->arena;
+}
+
+void smp_kick(Cpu* c);
+
+static void fpu_save(uint8_t* area) {
+    if (cpu_features & CPU_AVX)
+        __asm__ volatile("xsave (%0)" : : "r"(area), "a"(7), "d"(0) : "memory");
+    else if (cpu_features & CPU_FXSR)
+        __asm__ volatile("fxsave (%0)" : : "r"(area) : "memory");
+    else
+        __asm__ volatile("fnsave (%0)" : : "r"(area) : "memory");
+}
+
+static void fpu_restore(uint8_t* area) {
+    if (cpu_features & CPU_AVX)
+        __asm__ volatile("xrstor (%0)" : : "r"(area), "a"(7), "d"(0) : "memory");
+    else if (cpu_features & CPU_FXSR)
+        __asm__ volatile("fxrstor (%0)" : : "r"(area) : "memory");
+    else
+        __asm__ volatile("frstor (%0)" : : "r"(area) : "memory");
+}
+
+static int fpu_alloc(Thread* t) {
+    t->fpu_alloc = kmalloc(cpu_xsave_size + 64);
+    if (!t->fpu_alloc) return 0;
+    t->fpu = (uint8_t*)(((uint32_t)t->fpu_alloc + 63) & ~63u);
+    memset(t->fpu, 0, cpu_xsave_size); // xrstor faults on a dirty XSAVE header
+    return 1;
+}
+
+// ----------------- run queues -----------------
+static void rq_push(Cpu* c, Thread* t) {
+    t->next = NULL;
+    if (c->rq_tail) c->rq_tail->next = t;
+    else c->rq_head = t;
+    c->rq_tail = t;
+    c->rq_len++;
+}
+
+static Thread* rq_pop(Cpu* c) {
+    Thread* t = c->rq_head;
+    if (t) {
+        c->rq_head = t->next;
+        if (!c->rq_head) c->rq_tail = NULL;
+        t->next = NULL;
+        c->rq_len--;
+    }
+    return t;
+}
+
+static inline int cpu_load(Cpu* c) {
+    return c->rq_len + (c->running != c->idle);
+}
+
+// where a thread that became runnable should go: `pref` (the CPU it last ran
+// on, its cache is warm) unless some other CPU has less to do
+static Cpu* cpu_pick(Cpu* pref) {
+    Cpu* best = pref && pref->online ? pref : &cpus[0];
+    int best_load = cpu_load(best);
+    for (int i = 0; i < cpu_count && best_load > 0; i++) {
+        Cpu* c = &cpus[i];
+        if (c->online && cpu_load(c) < best_load) {
+            best = c;
+            best_load = cpu_load(c);
+        }
+    }
+    return best;
+}
+
+// queues `t` on some CPU and wakes that CPU up if it's idling; interrupts off
+static void thread_ready(Thread* t) {
+    Cpu* c = cpu_pick(t->cpu);
+    spin_lock(&c->rq_lock);
+    t->state = THREAD_READY;
+    rq_push(c, t);
+    spin_unlock(&c->rq_lock);
+    if (c->running == c->idle) smp_kick(c);
+}
+
+// takes the first thread of the busiest other CPU's queue
+static Thread* rq_steal(Cpu* self) {
+    Cpu* victim = NULL;
+    for (int i = 0; i < cpu_count; i++) {
+        Cpu* c = &cpus[i];
+        if (c != self && c->online && c->rq_len > (victim ? victim->rq_len : 0))
+            victim = c;
+    }
+    if (!victim || !spin_trylock(&victim->rq_lock)) return NULL;
+    Thread* t = rq_pop(victim);
+    spin_unlock(&victim->rq_lock);
+    if (t) self->steals++;
+    return t;
+}
+
+// ----------------- switching -----------------
+// first thing on the new stack after a switch: the old thread's registers are
+// all saved now, so another CPU may pick it up
+static void schedule_tail(void) {
+    Cpu* cpu = this_cpu();
+    __atomic_store_n(&cpu->prev->on_cpu, 0, __ATOMIC_RELEASE);
+    cpu->in_schedule = 0;
+}
+
+// Switches this CPU to its next thread. Interrupts must be off, and the
+// current thread has to be queued, blocked or dead already (unless it's the
+// idle thread, which is never queued).
+static void schedule(void) {
+    Cpu* cpu = this_cpu();
+    Thread* prev = this_thread();
+    cpu->in_schedule = 1;
+    cpu->need_resched = 0;
+
+    spin_lock(&cpu->rq_lock);
+    Thread* next = rq_pop(cpu);
+    spin_unlock(&cpu->rq_lock);
+    if (!next) next = rq_steal(cpu);
+    if (!next) next = prev->state == THREAD_RUNNING ? prev : cpu->idle;
+
+    if (next == prev) {
+        prev->state = THREAD_RUNNING;
+        cpu->in_schedule = 0;
+        return;
+    }
+
+    // save the FPU first: nothing may touch XMM/YMM before this
+    fpu_save(prev->fpu);
+    while (__atomic_load_n(&next->on_cpu, __ATOMIC_ACQUIRE))
+        spin_wait_hint(); // it's still switching away somewhere else
+    next->state = THREAD_RUNNING;
+    next->cpu = cpu;
+    next->on_cpu = 1;
+    cpu->prev = prev;
+    cpu->running = next;
+    cpu->switches++;
+    fpu_restore(next->fpu);
+
+    // its address space, and where ring 3 enters the kernel on this CPU
+    uint32_t cr3, want = (uint32_t)(next->pgdir ? next->pgdir : page_directory);
+    __asm__ volatile("mov %%cr3, %0" : "=r"(cr3));
+    if (cr3 != want) __asm__ volatile("mov %0, %%cr3" : : "r"(want) : "memory");
+    if (next->pgdir) tss_set_stack(cpu->id, next->user_return);
+
+    switch_context(&prev->esp, next->esp);
+    schedule_tail();
+}
+
+void thread_yield(void) {
+    if (!threads_ready) return;
+    uint32_t flags = irq_save();
+    Thread* self = this_thread();
+    Cpu* cpu = self->cpu;
+    if (self != cpu->idle) {
+        spin_lock(&cpu->rq_lock);
+        self->state = THREAD_READY;
+        rq_push(cpu, self);
+        spin_unlock(&cpu->rq_lock);
+    }
+    schedule();
+    irq_restore(flags);
+}
+
+// the idle thread of every CPU: halt until an interrupt brings work
+static void cpu_idle_loop(void) {
+    for (;;) {
+        __asm__ volatile("cli");
+        schedule();
+        __asm__ volatile("sti; hlt"); // a wakeup IPI right after sti still ends the hlt
+    }
+}
+
+// ----------------- wait queues -----------------
+// Waiting for a condition goes: take the queue's ticket, check, then wait with
+// the ticket. A wakeup in between changes the ticket and wq_wait returns right
+// away, so none gets lost even when the waker runs on another CPU:
+//     for (;;) { uint32_t t = wq_prepare(&q); if (done) break; wq_wait(&q, t); }
+static inline uint32_t wq_prepare(WaitQueue* q) {
+    uint32_t seq = q->seq;
+    __asm__ volatile("" ::: "memory");
+    return seq;
+}
+
+void wq_wait(WaitQueue* q, uint32_t seq) {
+    if (!threads_ready) {
+        // nothing to switch to yet, just sleep until the next interrupt
+        uint32_t flags = irq_save();
+        if (q->seq == seq) __asm__ volatile("sti; hlt");
+        irq_restore(flags);
+        return;
+    }
+
+    Thread* self = this_thread();
+    uint32_t flags = spin_lock_irqsave(&wait_lock);
+    if (q->seq != seq) {
+        spin_unlock_irqrestore(&wait_lock, flags);
+        return;
+    }
+    self->next = NULL;
+    self->waiting_on = q;
+    if (q->tail) q->tail->next = self;
+    else q->head = self;
+    q->tail = self;
+    self->state = THREAD_BLOCKED;
+    spin_unlock(&wait_lock);
+
+    schedule();
+    irq_restore(flags);
+}
+
+// wait_lock held
+static void wq_wake_locked(WaitQueue* q, int all) {
+    q->seq++;
+    while (q->head) {
+        Thread* t = q->head;
+        q->head = t->next;
+        if (!q->head) q->tail = NULL;
+        t->waiting_on = NULL;
+        thread_ready(t);
+        if (!all) break;
+    }
+}
+
+void wq_wake_one(WaitQueue* q) {
+    uint32_t flags = spin_lock_irqsave(&wait_lock);
+    wq_wake_locked(q, 0);
+    spin_unlock_irqrestore(&wait_lock, flags);
+}
+
+void wq_wake_all(WaitQueue* q) {
+    uint32_t flags = spin_lock_irqsave(&wait_lock);
+    wq_wake_locked(q, 1);
+    spin_unlock_irqrestore(&wait_lock, flags);
+}
+
+// ----------------- mutexes -----------------
+// Recursive, so a function holding one can call another that takes it too.
+// For anything that may sleep or do disk I/O while holding it; short
+// sections use a Spinlock.
+typedef struct {
+    Thread* owner;
+    int count;
+    WaitQueue waiters;
+} Mutex;
+
+void mutex_lock(Mutex* m) {
+    Thread* self = this_thread();
+    for (;;) {
+        uint32_t flags = spin_lock_irqsave(&wait_lock);
+        if (!m->owner || m->owner == self) {
+            m->owner = self;
+            m->count++;
+            spin_unlock_irqrestore(&wait_lock, flags);
+            return;
+        }
+        uint32_t seq = m->waiters.seq;
+        spin_unlock_irqrestore(&wait_lock, flags);
+        wq_wait(&m->waiters, seq);
+    }
+}
+
+void mutex_unlock(Mutex* m) {
+    uint32_t flags = spin_lock_irqsave(&wait_lock);
+    if (m->owner == this_thread() && --m->count == 0) {
+        m->owner = NULL;
+        wq_wake_locked(&m->waiters, 0);
+    }
+    spin_unlock_irqrestore(&wait_lock, flags);
+}
+
+// ----------------- creating and ending threads -----------------
+void thread_exit(void) {
+    __asm__ volatile("cli");
+    this_thread()->state = THREAD_DEAD;
+    schedule(); // never comes back, jobs_reap frees what's left
+    for (;;) __asm__ volatile("hlt");
+}
+
+static void thread_entry(void) {
+    schedule_tail();
+    __asm__ volatile("sti");
+    Thread* self = this_thread();
+    self->fn(self->arg);
+    thread_exit();
+}
+
+// gives `t` a stack and an FPU area, set up to start in thread_entry
+static int thread_setup(Thread* t, char* name, void (*fn)(void*), void* arg) {
+    memset(t, 0, sizeof(Thread));
+    t->stack = pmm_alloc_aligned(KSTACK_SIZE / FRAME_SIZE);
+    if (!t->stack || !fpu_alloc(t)) {
+        if (t->stack) pmm_free_pages(t->stack, KSTACK_SIZE / FRAME_SIZE);
+        return 0;
+    }
+    memcpy(t->fpu, fpu_initial, cpu_xsave_size);
+
+    StackHead* head = (StackHead*)t->stack;
+    head->thread = t;
+    head->irq_depth = 0;
+    head->console = stack_head()->console; // prints where its creator does
+    t->name = name;
+    t->fn = fn;
+    t->arg = arg;
+    t->scopes.depth = 1; // just the global scope
+
+    // what switch_context pops: eflags, edi, esi, ebx, ebp, then it returns
+    // into thread_entry (interrupts stay off until schedule_tail is done)
+    uint32_t* sp = (uint32_t*)(t->stack + KSTACK_SIZE);
+    *--sp = 0;                        // thread_entry's return address, never used
+    *--sp = (uint32_t)thread_entry;
+    *--sp = 0;                        // ebp
+    *--sp = 0;                        // ebx
+    *--sp = 0;                        // esi
+    *--sp = 0;                        // edi
+    *--sp = 0x002;                    // eflags
+    t->esp = (uint32_t)sp;
+    return 1;
+}
+
+// the boot thread becomes thread 0 and the BSP gets its idle thread
+void threads_init(void) {
+    fpu_initial = kmalloc(cpu_xsave_size + 64);
+    if (!fpu_initial) return;
+    fpu_initial = (uint8_t*)(((uint32_t)fpu_initial + 63) & ~63u);
+    memset(fpu_initial, 0, cpu_xsave_size);
+    __asm__ volatile("fninit");
+    fpu_save(fpu_initial);
+
+    Cpu* cpu = &cpus[0];
+    cpu->online = 1;
+    cpu->running = &boot_thread;
+    if (!fpu_alloc(&boot_thread)) return;
+    if (!thread_setup(&idle_threads[0], "idle", (void (*)(void*))cpu_idle_loop, NULL)) return;
+    idle_threads[0].cpu = cpu;
+    cpu->idle = &idle_threads[0];
+    threads_ready = 1;
+}
+
+// starts `fn(arg)` in a new thread; `name` is copied
+Thread* thread_create(const char* name, void (*fn)(void*), void* arg) {
+    if (!threads_ready) return NULL;
+    Thread* t = kmalloc(sizeof(Thread));
+    char* copy = kstrdup(name);
+    if (!t || !copy || !thread_setup(t, copy, fn, arg)) {
+        kfree(copy);
+        kfree(t);
+        return NULL;
+    }
+
+    uint32_t flags = spin_lock_irqsave(&threads_lock);
+    t->id = next_thread_id++;
+    t->all_next = all_threads;
+    all_threads = t;
+    spin_unlock(&threads_lock);
+    thread_ready(t); // on the least busy CPU
+    irq_restore(flags);
+    return t;
+}
+
+// threads_lock held
+Thread* thread_find(int id) {
+    for (Thread* t = all_threads; t; t = t->all_next)
+        if (t->id == id) return t;
+    return NULL;
+}
+
+// Asks thread `t` to stop. It does so at its next safe point (between zscript
+// statements, or out of sleep_ms and beep -wait); a blocked thread is woken
+// for it, and whatever it waited on just waits again if it doesn't care.
+void thread_kill(Thread* t) {
+    t->killed = 1;
+    uint32_t flags = spin_lock_irqsave(&wait_lock);
+    if (t->state == THREAD_BLOCKED) {
+        WaitQueue* q = t->waiting_on;
+        Thread** p = &q->head;
+        Thread* prev = NULL;
+        while (*p && *p != t) { prev = *p; p = &(*p)->next; }
+        if (*p) {
+            *p = t->next;
+            if (q->tail == t) q->tail = prev;
+        }
+        t->waiting_on = NULL;
+        thread_ready(t);
+    }
+    spin_unlock_irqrestore(&wait_lock, flags);
+}
+
+static inline int thread_killed(void) {
+    return this_thread()->killed;
+}
+
+static inline int thread_console(Thread* t) {
+    return t->stack ? ((StackHead*)t->stack)->console : 0;
+}
+
+// frees threads that have ended; returns how many, `report` prints them (only
+// the ones started on the calling thread's console, the others are left for
+// their own shell)
+int jobs_reap(int report) {
+    int n = 0;
+    int con = stack_head()->console;
+    for (;;) {
+        uint32_t flags = spin_lock_irqsave(&threads_lock);
+        Thread** p = &all_threads;
+        while (*p && !((*p)->state == THREAD_DEAD && !(*p)->on_cpu && (!report || thread_console(*p) == con)))
+            p = &(*p)->all_next;
+        Thread* t = *p;
+        if (t) *p = t->all_next;
+        spin_unlock_irqrestore(&threads_lock, flags);
+        if (!t) return n;
+
+        if (report) {
+            kput_char('[', os_color);
+            kprint_dec(t->id, os_color);
+            kprint(t->killed ? "] killed  " : "] done    ", os_color);
+            kprint(t->name, os_color);
+            kput_char('\n', os_color);
+        }
+        arena_reset(&t->arena);
+        kfree(t->arena.first);
+        pmm_free_pages(t->stack, KSTACK_SIZE / FRAME_SIZE);
+        kfree(t->fpu_alloc);
+        kfree(t->name);
+        kfree(t);
+        n++;
+    }
+}
+
+// ================== PS/2 keyboard input ==================
+// some weird shit I don't understand
+static inline uint8_t inb(uint16_t port) {
+    uint8_t ret;
+    __asm__ volatile ("inb %1, %0" : "=a"(ret) : "Nd"(port));
+    return ret;
+}
+
+// outb: write 8-bit value (byte)
+static inline void outb(uint16_t port, uint8_t value) {
+    __asm__ volatile ("outb %0, %1" : : "a"(value), "Nd"(port));
+}
+
+// IRQ1 pushes scancodes, kread_line pops them. Every console has its own
+// buffer and a key goes to the one on screen when it's pressed, so what's
+// typed ahead stays where it was typed. One producer, one consumer per
+// console, so the two indexes are enough and neither side ever takes a lock.
+// Shift and Ctrl aren't queued: they're tracked here as they go up and down and
+// every key carries a copy of them, so a key is read with the modifiers it was
+// typed with however late it's read, and one released on another console (or
+// while this one was busy) can't stay stuck.
+#define KBD_BUFFER_SIZE 256 // power of two
+
+volatile uint8_t kbd_buffer[NUM_CONSOLES][KBD_BUFFER_SIZE];
+volatile uint8_t kbd_mods[NUM_CONSOLES][KBD_BUFFER_SIZE]; // KBD_SHIFT/KBD_CTRL with each key
+volatile uint32_t kbd_head[NUM_CONSOLES]; // only the IRQ handler writes these
+volatile uint32_t kbd_tail[NUM_CONSOLES]; // only the readers write these
+uint32_t kbd_dropped = 0;
+WaitQueue kbd_waiters;
+int kbd_alt = 0;                // Alt held down
+int kbd_e0 = 0;                 // an E0 prefix waiting for the key it belongs to
+int kbd_shift = 0;              // bit 0 left Shift, bit 1 right Shift
+int kbd_ctrl = 0;               // bit 0 left Ctrl, bit 1 right Ctrl (E0 1D)
+
+static inline int kbd_empty(int con) {
+    return kbd_head[con] == kbd_tail[con];
+}
+
+// Alt+F1..F4. Text mode: each console is already in its own page of VGA memory,
+// so only the CRTC start address changes. A framebuffer has just the one page:
+// the new console's rows are marked dirty and redrawn where they differ.
+void console_switch(int n) {
+    if (n < 0 || n >= NUM_CONSOLES || n == con_visible) return;
+    uint32_t flags = console_acquire();
+    con_visible = n;
+    if (fb_active) {
+        for (int y = 0; y < con_rows; y++)
+            consoles[n].dirty[y] = 1;
+        con_any_dirty = 1;
+    } else {
+        uint16_t start = n * VGA_PAGE_CELLS;
+        outb(0x3D4, 0x0C);      // start address high
+        outb(0x3D5, start >> 8);
+        outb(0x3D4, 0x0D);      // start address low
+        outb(0x3D5, start & 0xFF);
+    }
+    console_flush_locked();
+    console_release(flags);
+}
+
+// IRQ1, and IRQ4 when COM1 types for us (headless). Both are delivered to the
+// boot CPU with interrupts off, so there's still one producer at a time.
+static void kbd_push(uint8_t sc) {
+    if (sc == 0xE0) {
+        kbd_e0 = 1;
+        return;
+    }
+    int e0 = kbd_e0;
+    kbd_e0 = 0;
+    // Alt (right Alt is E0 38) isn't queued, the readers would type a space
+    if (sc == 0x38 || sc == 0xB8) {
+        kbd_alt = sc == 0x38;
+        return;
+    }
+    if ((sc & 0x7F) == 0x1D) {
+        int bit = e0 ? 2 : 1;
+        kbd_ctrl = sc & 0x80 ? kbd_ctrl & ~bit : kbd_ctrl | bit;
+        return;
+    }
+    if ((sc & 0x7F) == 0x2A || (sc & 0x7F) == 0x36) {
+        if (e0) return; // the fake Shift some keyboards wrap around arrows
+        int bit = (sc & 0x7F) == 0x36 ? 2 : 1;
+        kbd_shift = sc & 0x80 ? kbd_shift & ~bit : kbd_shift | bit;
+        return;
+    }
+    if (kbd_alt && !e0 && (sc & 0x7F) >= 0x3B && (sc & 0x7F) < 0x3B + NUM_CONSOLES) {
+        if (!(sc & 0x80)) console_switch((sc & 0x7F) - 0x3B);
+        return;
+    }
+
+    int con = con_visible;
+    uint32_t head = kbd_head[con];
+    if (head - kbd_tail[con] + e0 >= KBD_BUFFER_SIZE) { // full, drop the key
+        kbd_dropped++;
+        return;
+    }
+    uint8_t mods = (kbd_shift ? KBD_SHIFT : 0) | (kbd_ctrl ? KBD_CTRL : 0);
+    if (e0) {
+        kbd_mods[con][head % KBD_BUFFER_SIZE] = mods;
+        kbd_buffer[con][head++ % KBD_BUFFER_SIZE] = 0xE0;
+    }
+    kbd_mods[con][head % KBD_BUFFER_SIZE] = mods;
+    kbd_buffer[con][head % KBD_BUFFER_SIZE] = sc;
+    __asm__ volatile("" ::: "memory"); // data before the new head
+    kbd_head[con] = head + 1;
+    wq_wake_all(&kbd_waiters);
+}
+
+void keyboard_irq(void) {
+    kbd_push(inb(0x60));
+}
+
+// sleeps with hlt until a key arrives on the calling thread's console; the
+// Shift/Ctrl state it was typed with becomes shift_pressed/ctrl_pressed
+uint8_t read_scancode(void) {
+    int con = stack_head()->console;
+    if (kbd_empty(con)) console_flush(); // about to wait, show what's been printed
+    for (;;) {
+        uint32_t seq = wq_prepare(&kbd_waiters); // a key after this ends the wait
+        if (!kbd_empty(con)) break;
+        wq_wait(&kbd_waiters, seq);
+    }
+
+    uint32_t tail = kbd_tail[con];
+    uint8_t sc = kbd_buffer[con][tail % KBD_BUFFER_SIZE];
+    consoles[con].mods = kbd_mods[con][tail % KBD_BUFFER_SIZE];
+    __asm__ volatile("" ::: "memory"); // read the data before freeing the slot
+    kbd_tail[con] = tail + 1;
+    return sc;
+}
+
+// just a keyboard keys map (the serial console reads it backwards)
+static const char kbd_map[128] = {
+    0,27,'1','2','3','4','5','6','7','8','9','0','-','=','\b',
+    '\t','q','w','e','r','t','y','u','i','o','p','[',']','\n',
+    0,'a','s','d','f','g','h','j','k','l',';','\'','`',
+    0,'\\','z','x','c','v','b','n','m',',','.','/',
+    0,' ',' ',' ',' ',' ',' ',' ',' ',' ',' ',' ',' ',' ',' ',' '
+};
+
+static const char kbd_map_shift[128] = {
+    0,27,'!','@','#','$','%','^','&','*','(',')','_','+','\b',
+    '\t','Q','W','E','R','T','Y','U','I','O','P','{','}','\n',
+    0,'A','S','D','F','G','H','J','K','L',':','"','~',
+    0,'|','Z','X','C','V','B','N','M','<','>','?',
+    0,' ',' ',' ',' ',' ',' ',' ',' ',' ',' ',' ',' ',' ',' ',' '
+};
+
+char scancode_to_ascii(uint8_t sc) {
+    if (sc < 128) {
+        return shift_pressed ? kbd_map_shift[sc] : kbd_map[sc];
+    }
+    return 0;
+}
+
+// ================== Read a line ==================
+// cooooooakjhvdsgkhnlvjsfkjsghlhskgjfhjgvsdfhjkskhjlgfsfpol function :3
+#define MAX_CMD_LEN 256
+#define HISTORY_ARENA_SIZE (64 * 1024)
+#define HISTORY_MAX 4096 // power of two
+
+// Shell history is a ring of (offset, length) entries pointing into one byte
+// arena that is also used as a ring, so adding a command is a single copy no
+// matter how many are stored. Entries never wrap around the end of the arena;
+// when one doesn't fit, writing restarts at 0 and the oldest entries in the
+// way are dropped. All the consoles' shells share it, so everything below
+// (and the append to history.txt) happens under history_lock.
+typedef struct {
+    uint32_t off;
+    uint32_t len; // without the NUL
+} HistoryEntry;
+
+Mutex history_lock;
+
+char* history_arena = NULL;          // kmalloc'd on first use
+HistoryEntry history_ring[HISTORY_MAX];
+uint32_t history_first = 0;          // absolute index of the oldest entry
+uint32_t history_next = 0;           // absolute index the next entry gets
+uint32_t history_write = 0;          // arena offset for the next entry
+// entry shown while browsing with arrows; the history is shared, but every
+// console browses it on its own
+#define history_index (con_here->history_index)
+int history_loaded = 0;              // history.txt read back yet?
+
+#define SHELL_PROMPT "~/[ZurOS >:3]$ "
+#define SHELL_PROMPT_COLOR ((os_color & 0xF0) | 0x09)
+
+void history_log(const char* line, uint32_t len);
+void history_load(void);
+void shell_complete(char* buffer, int* pos, int maxlen, int list);
+
+static inline const char* history_get(uint32_t i) {
+    return history_arena + history_ring[i % HISTORY_MAX].off;
+}
+
+// another shell may have dropped entries or reloaded the ring since this
+// console last looked; keeps its history_index in [first, next]
+static void history_clamp(void) {
+    if (history_index < history_first) history_index = history_first;
+    if (history_index > history_next) history_index = history_next;
+}
+
+// adds a line, returns 0 if it wasn't stored (empty, repeated or no memory)
+int history_push(const char* line, uint32_t len) {
+    if (len == 0) return 0;
+    if (len > MAX_CMD_LEN - 1) len = MAX_CMD_LEN - 1;
+    mutex_lock(&history_lock);
+    if (!history_arena) history_arena = kmalloc(HISTORY_ARENA_SIZE);
+    if (!history_arena) {
+        mutex_unlock(&history_lock);
+        return 0;
+    }
+
+    // same as the last one, don't store it twice
+    if (history_next != history_first) {
+        HistoryEntry* last = &history_ring[(history_next - 1) % HISTORY_MAX];
+        if (last->len == len && memcmp(history_arena + last->off, line, len) == 0) {
+            mutex_unlock(&history_lock);
+            return 0;
+        }
+    }
+
+    uint32_t w = history_write;
+    int wrapped = 0;
+    if (w + len + 1 > HISTORY_ARENA_SIZE) {
+        wrapped = 1;
+        w = 0;
+    }
+
+    while (history_next != history_first) {
+        HistoryEntry* old = &history_ring[history_first % HISTORY_MAX];
+        int drop = history_next - history_first >= HISTORY_MAX
+            || (wrapped && old->off >= history_write)          // left behind at the end
+            || (old->off < w + len + 1 && old->off + old->len + 1 > w);
+        if (!drop) break;
+        history_first++;
+    }
+
+    memcpy(history_arena + w, line, len);
+    history_arena[w + len] = '\0';
+    history_ring[history_next % HISTORY_MAX].off = w;
+    history_ring[history_next % HISTORY_MAX].len = len;
+    history_next++;
+    history_write = w + len + 1;
+    mutex_unlock(&history_lock);
+    return 1;
+}
+
+// drops everything, used before reading the log back in (history_lock held)
+void history_clear(void) {
+    history_first = history_next = 0;
+    history_write = 0;
+}
+
+// newest entry at or before `from` containing `query`, -1 if none
+// (history_lock held)
+static int32_t history_search(const char* query, int32_t from) {
+    uint32_t qlen = strlen(query);
+    if (from >= (int32_t)history_next) from = (int32_t)history_next - 1;
+    for (int32_t i = from; i >= (int32_t)history_first; i--) {
+        const char* s = history_get(i);
+        uint32_t len = history_ring[i % HISTORY_MAX].len;
+        for (uint32_t k = 0; k + qlen <= len; k++) {
+            if (memcmp(s + k, query, qlen) == 0) return i;
+        }
+    }
+    return -1;
+}
+
+// rubs out the last `n` characters printed on screen
+static void erase_chars(int n) {
+    while (n-- > 0) {
+        cursor_x--;
+        if (cursor_x < 0) {
+            cursor_x = con_cols - 1;
+            if (cursor_y > 0) cursor_y--;
+        }
+        console_put(cursor_x, cursor_y, ' ', os_color);
+        serial_putc('\b'); serial_putc(' '); serial_putc('\b');
+    }
+}
+
+// replaces the `*shown` characters after the prompt with `text`
+static void show_line(const char* text, int* shown) {
+    erase_chars(*shown);
+    kprint(text, os_color);
+    *shown = strlen(text);
+}
+
+#define SEARCH_MAX 64
+
+// Ctrl-R: (reverse-i-search)`query': match
+// Returns 1 if the line should be run right away (Enter), 0 to keep editing it.
+static int history_reverse_search(char* buffer, int maxlen, int* pos, int* shown) {
+    char query[SEARCH_MAX];
+    int qlen = 0;
+    query[0] = '\0';
+    int32_t match = (int32_t)history_next - 1;
+    int32_t found = -1;
+    int extended = 0;
+    int run = 0;
+
+    for (;;) {
+        erase_chars(*shown);
+        kprint("(reverse-i-search)`", os_color);
+        kprint(query, os_color);
+        kprint("': ", os_color);
+        int n = 22 + qlen;
+        mutex_lock(&history_lock);
+        if (found >= 0 && (found < (int32_t)history_first || found >= (int32_t)history_next))
+            found = -1; // dropped by another shell meanwhile
+        if (found >= 0) {
+            kprint(history_get(found), os_color);
+            n += history_ring[found % HISTORY_MAX].len;
+        }
+        mutex_unlock(&history_lock);
+        *shown = n;
+
+        uint8_t sc = read_scancode();
+        if (sc == 0xE0) { extended = 1; continue; }
+        if (extended) {
+            extended = 0;
+            if (sc & 0x80) continue;
+            break; // arrows etc. leave the search with the match on the line
+        }
+
+        if (ctrl_pressed && sc == 0x13) { // Ctrl-R again: older match
+            if (found >= 0) {
+                mutex_lock(&history_lock);
+                int32_t older = history_search(query, found - 1);
+                mutex_unlock(&history_lock);
+                if (older >= 0) found = older;
+            }
+            continue;
+        }
+
+        char c = scancode_to_ascii(sc);
+        if (!c) continue;
+
+        if (c == 27) { // Esc: back to an empty line
+            erase_chars(*shown);
+            *shown = 0;
+            *pos = 0;
+            buffer[0] = '\0';
+            return 0;
+        }
+        if (c == '\n') {
+            run = 1;
+            break;
+        }
+        if (c == '\b') {
+            if (qlen > 0) query[--qlen] = '\0';
+            match = (int32_t)history_next - 1;
+        } else if (qlen < SEARCH_MAX - 1) {
+            query[qlen++] = c;
+            query[qlen] = '\0';
+            if (found >= 0) match = found;
+        }
+        mutex_lock(&history_lock);
+        found = qlen ? history_search(query, match) : -1;
+        mutex_unlock(&history_lock);
+    }
+
+    mutex_lock(&history_lock);
+    if (found >= 0 && found >= (int32_t)history_first && found < (int32_t)history_next) {
+        strncpy(buffer, history_get(found), maxlen);
+        buffer[maxlen-1] = '\0';
+    } else {
+        buffer[0] = '\0';
+    }
+    mutex_unlock(&history_lock);
+    *pos = strlen(buffer);
+    show_line(buffer, shown);
+    history_index = history_next;
+    return run;
+}
+
+// reads a line with echo; for the `shell` the arrows and Ctrl-R browse the
+// history, Tab completes and the line gets added to the history
+static void read_line(char* buffer, int maxlen, int shell) {
+    int pos = 0;
+    int extended = 0;      // for detecting arrow keys
+    int tabs = 0;          // Tabs pressed in a row
+    history_index = history_next; // start at “newest” position
+
+    while (1) {
+        uint8_t sc = read_scancode();
+        
+        // Check for extended code prefix
+        if (sc == 0xE0) {
+            extended = 1;
+            continue; // next scancode will be arrow
+        }
+
+        // Handle extended codes (arrows)
+        if (extended) {
+            extended = 0;
+            if (!shell) continue;
+            if (sc == 0x48) { // Up arrow
+                mutex_lock(&history_lock);
+                if (!history_loaded) {
+                    history_load();
+                    history_index = history_next;
+                }
+                history_clamp();
+                int moved = history_index > history_first;
+                if (moved) {
+                    history_index--;
+                    // Load command from history
+                    strncpy(buffer, history_get(history_index), maxlen);
+                    buffer[maxlen-1] = '\0';
+                }
+                mutex_unlock(&history_lock);
+                if (moved) show_line(buffer, &pos);
+                continue;
+            }
+            else if (sc == 0x50) { // Down arrow
+                mutex_lock(&history_lock);
+                history_clamp();
+                int moved = history_index + 1 <= history_next;
+                if (history_index + 1 < history_next) {
+                    history_index++;
+                    strncpy(buffer, history_get(history_index), maxlen);
+                    buffer[maxlen-1] = '\0';
+                } else if (history_index + 1 == history_next) {
+                    // Clear to empty line if at the newest
+                    buffer[0] = '\0';
+                    history_index = history_next;
+                }
+                mutex_unlock(&history_lock);
+                if (moved) show_line(buffer, &pos);
+                continue;
+            }
+            continue; // ignore left/right arrows for now
+        }
+
+        // Ctrl-R: search backwards through history
+        if (shell && ctrl_pressed && sc == 0x13) {
+            mutex_lock(&history_lock);
+            if (!history_loaded) history_load();
+            mutex_unlock(&history_lock);
+            int shown = pos;
+            int run = history_reverse_search(buffer, maxlen, &pos, &shown);
+            if (!run) continue;
+            sc = 0x1C; // behave as if Enter was pressed
+        }
+
+        char c = scancode_to_ascii(sc);
+        if (!c) continue;
+
+        // Tab: complete, a second Tab lists what would fit
+        if (c == '\t') {
+            if (shell) shell_complete(buffer, &pos, maxlen, ++tabs > 1);
+            continue;
+        }
+        tabs = 0;
+
+        // Enter
+        if (c == '\n') {
+            kput_char('\n', os_color);
+            buffer[pos] = '\0';
+
+            // Save to history; logged under the same lock so history.txt
+            // gets the lines in the order the ring did
+            if (shell) {
+                mutex_lock(&history_lock);
+                if (history_push(buffer, pos))
+                    history_log(buffer, pos);
+                mutex_unlock(&history_lock);
+            }
+            history_index = history_next;
+            return;
+        }
+
+        // Backspace
+        if (c == '\b') {
+            if (pos > 0) {
+                pos--;
+                erase_chars(1);
+            }
+            continue;
+        }
+
+        // Normal character
+        if (pos < maxlen - 1) {
+            buffer[pos++] = c;
+            kput_char(c, os_color);
+        }
+    }
+}
+
+void kread_line(char* buffer, int maxlen) {
+    read_line(buffer, maxlen, 0);
+}
+
+// the shell prompt's line reader
+void kread_command(char* buffer, int maxlen) {
+    read_line(buffer, maxlen, 1);
+}
+
+
+// the same as strcmp but checks if the string1 starts with string2
+int starts_with(const char* str, const char* prefix) {
+    int i = 0;
+    while (prefix[i]) {
+        if (str[i] != prefix[i]) return 0;
+        i++;
+    }
+    return 1;
+}
+
+char* strncpy(char* dest, const char* src, size_t n) {
+    size_t i = 0;
+    for (; i < n && src[i]; i++) dest[i] = src[i];
+    for (; i < n; i++) dest[i] = '\0';
+    return dest;
+}
+
+int strcmp(const char* a, const char* b) {
+    int i = 0;
+    while (a[i] && b[i]) {
+        if (a[i] != b[i]) return 0;  // mismatch
+        i++;
+    }
+    // both must end at the same time
+    return (a[i] == b[i]) ? 1 : 0;
+}
+static inline void outw(uint16_t port, uint16_t val) {
+    __asm__ volatile("outw %0, %1" : : "a"(val), "Nd"(port));
+}
+
+void serial_flush(void);
+
+void shutdown(void) {
+    // shutting down (I dunno if it will work on a real computer, it works in qemu for shure)
+	kprint("Shutting down...", os_color);
+    serial_flush();
+    outw(0x604, 0x2000);
+    for (;;); // hang if not powered off
+}
+
+unsigned char hex_to_nibble(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return 0; // fallback
+}
+
+// inw: read 16-bit value (word)
+static inline uint16_t inw(uint16_t port) {
+    uint16_t ret;
+    __asm__ volatile ("inw %1, %0" : "=a"(ret) : "Nd"(port));
+    return ret;
+}
+
+// outl: write 32-bit value (dword)
+static inline void outl(uint16_t port, uint32_t value) {
+    __asm__ volatile ("outl %0, %1" : : "a"(value), "Nd"(port));
+}
+
+// inl: read 32-bit value (dword)
+static inline uint32_t inl(uint16_t port) {
+    uint32_t ret;
+    __asm__ volatile ("inl %1, %0" : "=a"(ret) : "Nd"(port));
+    return ret;
+}
+
+// ================== Serial port ==================
+// COM1 (16550) gets a copy of everything kput_char puts on the screen, so a
+// host can log ZurOS with qemu -serial stdio/file. Text goes into a ring and
+// the transmit interrupt drains it a FIFO at a time: printing never waits for
+// the line, and when the ring is full the text is dropped (and counted)
+// rather than stalling the kernel. Until serial_start the ring is only drained
+// when something prints. With "headless" on the kernel command line bytes
+// coming back are turned into scancodes and typed into the keyboard buffer,
+// so the shell can be driven from the host too.
+#define COM1 0x3F8
+#define SERIAL_TX_SIZE 65536 // power of two
+#define SERIAL_FIFO 16       // bytes the 16550 takes per THR-empty
+#define SERIAL_RX_BATCH 64
+
+void register_irq_handler(int irq, void (*handler)(void));
+
+int serial_present = 0;
+int serial_irq_on = 0;       // serial_start has run, IRQ4 drains the ring
+int serial_input = 0;        // headless: received bytes go to the keyboard buffer
+char serial_tx[SERIAL_TX_SIZE];
+uint32_t serial_tx_head = 0; // next byte written
+uint32_t serial_tx_tail = 0; // next byte sent
+uint32_t serial_dropped = 0;
+uint8_t serial_ier = 0;      // what's in the interrupt enable register now
+uint8_t serial_keys[128];    // ascii -> scancode, 0x80 = needs shift
+Spinlock serial_lock;
+
+void serial_init(void) {
+    outb(COM1 + 1, 0x00);    // no interrupts
+    outb(COM1 + 3, 0x80);    // DLAB on
+    outb(COM1 + 0, 0x01);    // divisor 1 = 115200 baud
+    outb(COM1 + 1, 0x00);
+    outb(COM1 + 3, 0x03);    // 8N1, DLAB off
+    outb(COM1 + 2, 0xC7);    // FIFO on, cleared, 14 byte threshold
+    outb(COM1 + 4, 0x13);    // loopback to check the chip is there
+    outb(COM1 + 0, 0xAE);
+    if (inb(COM1 + 0) != 0xAE) return;
+    outb(COM1 + 4, 0x03);    // DTR + RTS, loopback off
+    serial_present = 1;
+}
+
+// fills the transmit FIFO if it's empty and keeps the THR-empty interrupt on
+// only while there's more waiting
+static void serial_kick_locked(void) {
+    if (inb(COM1 + 5) & 0x20) {
+        for (int i = 0; i < SERIAL_FIFO && serial_tx_tail != serial_tx_head; i++)
+            outb(COM1, serial_tx[serial_tx_tail++ % SERIAL_TX_SIZE]);
+    }
+    if (!serial_irq_on) return;
+    uint8_t ier = serial_tx_tail != serial_tx_head ? serial_ier | 0x02 : serial_ier & ~0x02;
+    if (ier != serial_ier) {
+        serial_ier = ier;
+        outb(COM1 + 1, ier);
+    }
+}
+
+static inline void serial_queue(char c) {
+    if (serial_tx_head - serial_tx_tail >= SERIAL_TX_SIZE) {
+        serial_dropped++;
+        return;
+    }
+    serial_tx[serial_tx_head++ % SERIAL_TX_SIZE] = c;
+}
+
+void serial_putc(char c) {
+    if (!serial_present) return;
+    uint32_t flags = spin_lock_irqsave(&serial_lock);
+    if (c == '\n') serial_queue('\r');
+    serial_queue(c);
+    // with the interrupt armed the IRQ picks it up, no need to touch the chip
+    if (!(serial_ier & 0x02)) serial_kick_locked();
+    spin_unlock_irqrestore(&serial_lock, flags);
+}
+
+void serial_write(const char* s) {
+    for (; *s; s++) serial_putc(*s);
+}
+
+// sends whatever is still queued by polling (panics, shutdown)
+void serial_flush(void) {
+    if (!serial_present) return;
+    uint32_t flags = spin_lock_irqsave(&serial_lock);
+    while (serial_tx_tail != serial_tx_head) {
+        while (!(inb(COM1 + 5) & 0x20)) { }
+        for (int i = 0; i < SERIAL_FIFO && serial_tx_tail != serial_tx_head; i++)
+            outb(COM1, serial_tx[serial_tx_tail++ % SERIAL_TX_SIZE]);
+    }
+    spin_unlock_irqrestore(&serial_lock, flags);
+}
+
+static void serial_key(uint8_t sc) {
+    kbd_push(sc);
+    kbd_push(sc | 0x80);
+}
+
+// a terminal sends characters, the shell and zw want keys
+static void serial_type(const uint8_t* rx, int n) {
+    for (int i = 0; i < n; i++) {
+        uint8_t c = rx[i];
+        if (c == 27 && i + 2 < n && rx[i + 1] == '[') { // arrows, Home, End
+            static const char codes[] = "ABCDHF";
+            static const uint8_t keys[] = {0x48, 0x50, 0x4D, 0x4B, 0x47, 0x4F};
+            for (int k = 0; k < 6; k++) {
+                if (rx[i + 2] != (uint8_t)codes[k]) continue;
+                kbd_push(0xE0); kbd_push(keys[k]);
+                kbd_push(0xE0); kbd_push(keys[k] | 0x80);
+            }
+            i += 2;
+        } else if (c == '\r' || c == '\n') {
+            serial_key(0x1C);
+        } else if (c == 0x7F || c == '\b') {
+            serial_key(0x0E);
+        } else if (c == '\t' || c == 27) {
+            serial_key(c == '\t' ? 0x0F : 0x01);
+        } else if (c >= 1 && c <= 26) {   // Ctrl-A .. Ctrl-Z
+            kbd_push(0x1D);
+            serial_key(serial_keys['a' + c - 1]);
+            kbd_push(0x9D);
+        } else if (c < 128 && serial_keys[c]) {
+            uint8_t sc = serial_keys[c];
+            if (sc & 0x80) kbd_push(0x2A);
+            serial_key(sc & 0x7F);
+            if (sc & 0x80) kbd_push(0xAA);
+        }
+    }
+}
+
+// IRQ4, on the boot CPU with interrupts off. An escape sequence is expected to
+// arrive in one burst; a lone ESC at the end of one is the Esc key.
+static void serial_irq(void) {
+    uint8_t rx[SERIAL_RX_BATCH];
+    int n = 0;
+    spin_lock(&serial_lock);
+    for (int guard = 0; guard < 16; guard++) {
+        uint8_t iir = inb(COM1 + 2);
+        if (iir & 0x01) break;                 // nothing pending
+        switch (iir & 0x0E) {
+        case 0x02:                             // THR empty
+            serial_kick_locked();
+            break;
+        case 0x04: case 0x0C:                  // data, FIFO timeout
+            while (inb(COM1 + 5) & 0x01) {
+                uint8_t c = inb(COM1);
+                if (n < SERIAL_RX_BATCH) rx[n++] = c;
+            }
+            break;
+        case 0x06:                             // line status
+            inb(COM1 + 5);
+            break;
+        default:                               // modem status
+            inb(COM1 + 6);
+            break;
+        }
+    }
+    spin_unlock(&serial_lock);
+    if (serial_input) serial_type(rx, n);
+}
+
+// switches COM1 over to interrupts once the PIC/timer are up
+void serial_start(int headless) {
+    if (!serial_present) return;
+    for (int sc = 0x39; sc > 0; sc--) { // high to low so space is 0x39, not keypad *
+        uint8_t c = (uint8_t)kbd_map[sc], s = (uint8_t)kbd_map_shift[sc];
+        if (c && c < 128 && !serial_keys[c]) serial_keys[c] = sc;
+        if (s && s < 128 && s != c && !serial_keys[s]) serial_keys[s] = sc | 0x80;
+    }
+
+    register_irq_handler(4, serial_irq);
+    uint32_t flags = spin_lock_irqsave(&serial_lock);
+    serial_input = headless;
+    serial_irq_on = 1;
+    serial_ier = headless ? 0x01 : 0x00; // received data
+    outb(COM1 + 1, serial_ier);
+    outb(COM1 + 4, 0x0B);                // DTR + RTS + OUT2, which gates the IRQ line
+    serial_kick_locked();
+    spin_unlock_irqrestore(&serial_lock, flags);
+}
+
+// whole-sector PIO transfers in one instruction instead of 256 inw/outw calls
+static inline void ata_insw(uint8_t* buffer) {
+    uint32_t count = 256;
+    __asm__ volatile("rep insw" : "+D"(buffer), "+c"(count) : "d"(0x1F0) : "memory");
+}
+
+static inline void ata_outsw(const uint8_t* buffer) {
+    uint32_t count = 256;
+    __asm__ volatile("rep outsw" : "+S"(buffer), "+c"(count) : "d"(0x1F0) : "memory");
+}
+
+// Each transfer holds ata_lock (with interrupts off) so no other thread or CPU
+// can land between selecting the sector and moving its data; the page fault
+// and eviction paths reach the disk without fs_lock.
+Spinlock ata_lock;
+
+void ata_read28(uint32_t lba, uint8_t *buffer) {
+    uint32_t flags = spin_lock_irqsave(&ata_lock);
+    outb(0x1F6, 0xE0 | ((lba >> 24) & 0x0F));
+    outb(0x1F2, 1);                    // sector count
+    outb(0x1F3, (uint8_t) lba);
+    outb(0x1F4, (uint8_t)(lba >> 8));
+    outb(0x1F5, (uint8_t)(lba >> 16));
+    outb(0x1F7, 0x20);                 // READ SECTORS
+    
+    // wait for data
+    while (!(inb(0x1F7) & 0x08));
+
+    // read 256 words = 512 bytes
+    ata_insw(buffer);
+    spin_unlock_irqrestore(&ata_lock, flags);
+}
+
+void ata_write28(uint32_t lba, uint8_t *buffer) {
+    uint32_t flags = spin_lock_irqsave(&ata_lock);
+    outb(0x1F6, 0xE0 | ((lba >> 24) & 0x0F));
+    outb(0x1F2, 1);
+    outb(0x1F3, (uint8_t) lba);
+    outb(0x1F4, (uint8_t)(lba >> 8));
+    outb(0x1F5, (uint8_t)(lba >> 16));
+    outb(0x1F7, 0x30); // WRITE SECTORS
+
+    // Write 256 words immediately
+    ata_outsw(buffer);
+    spin_unlock_irqrestore(&ata_lock, flags);
+}
+
+typedef struct {
+    uint32_t fat_start;
+    uint32_t fat_size;
+    uint32_t data_start;
+    uint32_t sectors_per_cluster;
+} fat32_t;
+
+fat32_t fat;
+
+#define MAX_SECTORS 65536 // fallback when the boot sector doesn't tell us the disk size
+uint32_t sector_count = MAX_SECTORS;
+uint8_t* sector_bitmap; // 1 bit per sector: 0 = free, 1 = used (sized at mount)
+
+void fat32_mount() {
+    uint8_t sector[512];
+    ata_read28(0, sector);
+    
+	uint16_t reserved = *(uint16_t*)&sector[0x0E];
+	uint8_t fats = sector[0x10];
+	uint32_t fat_size = *(uint32_t*)&sector[0x24];
+
+	fat.fat_start = reserved;
+	fat.fat_size = fat_size;
+	fat.data_start = reserved + fats * fat_size;
+	fat.sectors_per_cluster = sector[13];
+
+    // size the sector bitmap for the whole disk instead of a fixed guess
+    uint32_t total = *(uint16_t*)&sector[0x13];
+    if (total == 0) total = *(uint32_t*)&sector[0x20];
+    if (total == 0) total = MAX_SECTORS;
+    if (total > (1u << 28)) total = 1u << 28; // all that 28-bit LBA reaches anyway
+    total = (total + 7) & ~7u;
+
+    kfree(sector_bitmap);
+    sector_bitmap = kmalloc(total / 8);
+    if (!sector_bitmap && total > MAX_SECTORS) {
+        // a garbage boot sector or a huge disk; manage the first MAX_SECTORS only
+        klog_hex(KLOG_ERR, "fs", "no memory for the sector bitmap, sectors", total);
+        kprint("Not enough memory for the whole disk, using only its start!\n", (os_color & 0xF0) | 0x0C);
+        total = MAX_SECTORS;
+        sector_bitmap = kmalloc(total / 8);
+    }
+    if (!sector_bitmap) total = 0; // no allocating at all, but nothing gets scribbled over
+    sector_count = total;
+    memset(sector_bitmap, 0, total / 8);
+}
+
+struct FileEntry {
+    char     name[16];   // "file.txt"
+    uint32_t start;      // LBA where data starts
+    uint32_t size;       // size in bytes
+    uint8_t  used;       // 1 = used, 0 = empty
+};
+
+#define MAX_FILES 128
+#define FILETABLE_LBA 4096
+#define FIRST_DATA_LBA 4104
+
+uint32_t next_free_lba = FIRST_DATA_LBA;
+
+typedef struct {
+    char name[16];
+    uint32_t start;
+    uint32_t size;
+    uint8_t used;
+    uint8_t _pad[7];
+} FileEntry;
+
+FileEntry files[MAX_FILES];
+uint32_t fs_generation = 0; // bumped whenever the file table may have changed
+
+void fs_build_bitmap();
+
+// index of file `name` in files[], -1 if there's no such file
+// The file table, sector bitmap and mappings are shared by every thread. It's
+// recursive, so fs functions calling each other just take it again.
+Mutex fs_lock;
+
+int fs_find(const char* name) {
+    for (int i = 0; i < MAX_FILES; i++) {
+        if (files[i].used && strcmp(files[i].name, name) == 1) return i;
+    }
+    return -1;
+}
+
+void fs_load() {
+    uint8_t buffer[512];
+    mutex_lock(&fs_lock);
+
+    // Clear files first so unused entries are clean
+    memset(files, 0, sizeof(files));
+
+    for (int i = 0; i < 8; i++) {               // 8 sectors = 4096 bytes
+        ata_read28(FILETABLE_LBA + i, buffer);
+        memcpy(((uint8_t*)files) + i*512, buffer, 512);
+    }
+
+    // Ensure every filename is NUL-terminated (defensive)
+    for (int i = 0; i < MAX_FILES; i++) {
+        files[i].name[15] = '\0'; // ensure last byte is NUL
+    }
+
+    // Recompute next_free_lba based on existing files so allocations never overlap
+    next_free_lba = FIRST_DATA_LBA;
+    for (int i = 0; i < MAX_FILES; i++) {
+        if (files[i].used) {
+            uint32_t file_sectors = (files[i].size + 511) / 512;
+            uint32_t end_lba = files[i].start + file_sectors;
+            if (end_lba > next_free_lba) next_free_lba = end_lba;
+        }
+    }
+
+    fs_build_bitmap();
+    fs_generation++;
+    mutex_unlock(&fs_lock);
+}
+
+void fs_save() {
+    uint8_t buffer[512];
+    mutex_lock(&fs_lock);
+    fs_generation++;
+
+    for (int i = 0; i < 8; i++) {
+        memcpy(buffer, ((uint8_t*)files) + i*512, 512);
+        ata_write28(FILETABLE_LBA + i, buffer);
+    }
+    mutex_unlock(&fs_lock);
+}
+
+uint32_t fs_allocate_sectors(uint32_t sectors) {
+    uint32_t start = next_free_lba;
+    next_free_lba += sectors;
+    return start;
+}
+
+// returns NULL on success, else what timed out (ata_lock held, so no printing here)
+static const char* ata_write_sector(uint32_t lba, uint8_t* buf) {
+    int timeout = 1000000;
+
+    // Wait for drive not busy
+    while ((inb(0x1F7) & 0x80) && timeout--) { }
+    if (timeout <= 0) return "ATA write timeout (BSY)\n";
+
+    // Select LBA and sector count
+    outb(0x1F6, 0xE0 | ((lba >> 24) & 0x0F));
+    outb(0x1F2, 1);
+    outb(0x1F3, (uint8_t) lba);
+    outb(0x1F4, (uint8_t)(lba >> 8));
+    outb(0x1F5, (uint8_t)(lba >> 16));
+    outb(0x1F7, 0x30); // WRITE SECTOR
+
+    timeout = 1000000;
+    // Wait for DRQ = ready for data
+    while (!(inb(0x1F7) & 0x08) && timeout--) { }
+    if (timeout <= 0) return "ATA write timeout (DRQ)\n";
+
+    // Write the 512-byte sector
+    ata_outsw(buf);
+
+    timeout = 1000000;
+    // Wait for drive to finish writing
+    while ((inb(0x1F7) & 0x80) && timeout--) { }
+    if (timeout <= 0) return "ATA write timeout after data!\n";
+
+    return NULL; // success
+}
+
+// only logs a failure, for callers holding locks kprint can't be called under
+static const char* ata_write_quiet(uint32_t lba, uint8_t* buf) {
+    uint32_t flags = spin_lock_irqsave(&ata_lock);
+    const char* err = ata_write_sector(lba, buf);
+    spin_unlock_irqrestore(&ata_lock, flags);
+    if (err) klog_hex(KLOG_ERR, "ata", err, lba);
+    return err;
+}
+
+static int ata_write_safe(uint32_t lba, uint8_t* buf) {
+    const char* err = ata_write_quiet(lba, buf);
+    if (err) kprint(err, (os_color & 0xF0) | 0x0C);
+    return err == NULL;
+}
+
+// ----------------- bitmap helpers -----------------
+void mark_sector(uint32_t lba, int used) {
+    if (lba >= sector_count) return;
+    uint32_t byte = lba / 8;
+    uint8_t bit = 1 << (lba % 8);
+    if (used)
+        sector_bitmap[byte] |= bit;
+    else
+        sector_bitmap[byte] &= ~bit;
 }
 
 int is_sector_free(uint32_t lba) {
+    if (lba >= sector_count) return 0;
     uint32_t byte = lba / 8;
     uint8_t bit = 1 << (lba % 8);
     return !(sector_bitmap[byte] & bit);
 }
 
-// ----------------- scan and allocate -----------------
-uint32_t fs_allocate_sectors_safe(uint32_t sectors_needed) {
-    for (uint32_t start = FIRST_DATA_LBA; start + sectors_needed < MAX_SECTORS; start++) {
-        int free = 1;
-        for (uint32_t s = 0; s < sectors_needed; s++) {
-            if (!is_sector_free(start + s)) { free = 0; break; }
-        }
-        if (free) {
-            for (uint32_t s = 0; s < sectors_needed; s++)
-                mark_sector(start + s, 1);
-            return start;
-        }
+// ----------------- scan and allocate -----------------
+uint32_t fs_allocate_sectors_safe(uint32_t sectors_needed) {
+    for (uint32_t start = FIRST_DATA_LBA; start + sectors_needed < sector_count; start++) {
+        int free = 1;
+        for (uint32_t s = 0; s < sectors_needed; s++) {
+            if (!is_sector_free(start + s)) { free = 0; break; }
+        }
+        if (free) {
+            for (uint32_t s = 0; s < sectors_needed; s++)
+                mark_sector(start + s, 1);
+            return start;
+        }
+    }
+    klog(KLOG_ERR, "fs", "No free sectors available!");
+    kprint("No free sectors available!\n", (os_color & 0xF0) | 0x0C);
+    return 0;
+}
+
+// ----------------- rebuild bitmap after loading -----------------
+void fs_build_bitmap() {
+    if (!sector_bitmap) return; // not mounted yet
+    memset(sector_bitmap, 0, sector_count / 8);
+    for (int i = 0; i < MAX_FILES; i++) {
+        if (files[i].used) {
+            uint32_t sectors = (files[i].size + 511) / 512;
+            for (uint32_t s = 0; s < sectors; s++)
+                mark_sector(files[i].start + s, 1);
+        }
+    }
+}
+
+void fs_write_data(const char* name, const char* temp, uint32_t len);
+
+void fs_write_file(const char* name, const char* text) {
+    // convert "\n" to real newlines
+    uint32_t len = 0;
+    for (const char* p = text; *p; p++) {
+        if (*p == '\\' && *(p+1) == 'n') { len++; p++; }
+        else len++;
+    }
+
+    char* temp = scratch_alloc(len + 1);
+    if (!temp) {
+        kprint("Out of memory!\n", (os_color & 0xF0) | 0x0C);
+        return;
+    }
+    uint32_t idx = 0;
+    for (const char* p = text; *p; p++) {
+        if (*p == '\\' && *(p+1) == 'n') { temp[idx++] = '\n'; p++; }
+        else temp[idx++] = *p;
+    }
+    temp[idx] = '\0';
+
+    fs_write_data(name, temp, len);
+}
+
+static void fs_write_data_nolock(const char* name, const char* temp, uint32_t len) {
+    uint32_t sectors = (len + 511) / 512;
+    uint8_t buffer[512];
+
+    // --- check if file exists ---
+    for (int i = 0; i < MAX_FILES; i++) {
+        if (files[i].used && strcmp(files[i].name, name) == 1) {
+            uint32_t old_sectors = (files[i].size + 511) / 512;
+
+            if (sectors <= old_sectors) {
+                // write in place
+                for (uint32_t s = 0; s < sectors; s++) {
+                    memset(buffer, 0, 512);
+                    uint32_t remaining = len - s*512;
+                    if (remaining > 512) remaining = 512;
+                    memcpy(buffer, temp + s*512, remaining);
+                    if (!ata_write_safe(files[i].start + s, buffer)) return;
+                }
+                // zero leftover sectors
+                for (uint32_t s = sectors; s < old_sectors; s++) {
+                    memset(buffer, 0, 512);
+                    if (!ata_write_safe(files[i].start + s, buffer)) return;
+                    mark_sector(files[i].start + s, 0); // free old sectors
+                }
+                files[i].size = len;
+                fs_save();
+                return;
+            } else {
+                // allocate new sectors safely
+                uint32_t new_lba = fs_allocate_sectors_safe(sectors);
+                if (!new_lba) return;
+                for (uint32_t s = 0; s < sectors; s++) {
+                    memset(buffer, 0, 512);
+                    uint32_t remaining = len - s*512;
+                    if (remaining > 512) remaining = 512;
+                    memcpy(buffer, temp + s*512, remaining);
+                    if (!ata_write_safe(new_lba + s, buffer)) return;
+                }
+                // free old sectors
+                for (uint32_t s = 0; s < old_sectors; s++)
+                    mark_sector(files[i].start + s, 0);
+                files[i].start = new_lba;
+                files[i].size = len;
+                fs_save();
+                return;
+            }
+        }
+    }
+
+    // --- new file ---
+    for (int i = 0; i < MAX_FILES; i++) {
+        if (!files[i].used) {
+            uint32_t lba = fs_allocate_sectors_safe(sectors);
+            if (!lba) return;
+            files[i].used = 1;
+            strcpy(files[i].name, name);
+            files[i].start = lba;
+            files[i].size = len;
+
+            for (uint32_t s = 0; s < sectors; s++) {
+                memset(buffer, 0, 512);
+                uint32_t remaining = len - s*512;
+                if (remaining > 512) remaining = 512;
+                memcpy(buffer, temp + s*512, remaining);
+                if (!ata_write_safe(lba + s, buffer)) return;
+            }
+            fs_save();
+            return;
+        }
+    }
+
+    klog(KLOG_ERR, "fs", "No free file slots!");
+    kprint("No free file slots!\n", (os_color & 0xF0) | 0x0C);
+}
+
+// writes `len` raw bytes as file `name`, replacing it if it exists
+void fs_write_data(const char* name, const char* temp, uint32_t len) {
+    mutex_lock(&fs_lock);
+    fs_write_data_nolock(name, temp, len);
+    mutex_unlock(&fs_lock);
+}
+
+// writes back only the file table sector holding entry `i`
+void fs_save_entry(int i) {
+    int sector = i * sizeof(FileEntry) / 512;
+    ata_write_safe(FILETABLE_LBA + sector, ((uint8_t*)files) + sector * 512);
+}
+
+static int fs_append_nolock(const char* name, const char* data, uint32_t len) {
+    int fi = -1;
+    for (int i = 0; i < MAX_FILES; i++) {
+        if (files[i].used && strcmp(files[i].name, name) == 1) { fi = i; break; }
+    }
+    if (fi < 0) {
+        fs_write_data(name, data, len);
+        return 1;
+    }
+
+    FileEntry* f = &files[fi];
+    uint32_t old_sectors = (f->size + 511) / 512;
+    uint32_t new_sectors = (f->size + len + 511) / 512;
+    uint8_t buffer[512];
+
+    int fits = 1;
+    for (uint32_t s = old_sectors; s < new_sectors; s++)
+        if (!is_sector_free(f->start + s)) { fits = 0; break; }
+
+    if (!fits) {
+        // move the file somewhere with room for it plus the same again
+        uint32_t want = new_sectors * 2;
+        uint32_t lba = fs_allocate_sectors_safe(want);
+        if (!lba) return 0;
+        for (uint32_t s = 0; s < old_sectors; s++) {
+            ata_read28(f->start + s, buffer);
+            if (!ata_write_safe(lba + s, buffer)) return 0;
+            mark_sector(f->start + s, 0);
+        }
+        for (uint32_t s = new_sectors; s < want; s++)
+            mark_sector(lba + s, 0); // the slack stays free until we grow into it
+        f->start = lba;
+    }
+
+    uint32_t off = f->size;
+    uint32_t done = 0;
+    while (done < len) {
+        uint32_t sector = off / 512;
+        uint32_t in_sector = off % 512;
+        uint32_t chunk = 512 - in_sector;
+        if (chunk > len - done) chunk = len - done;
+
+        if (in_sector) ata_read28(f->start + sector, buffer);
+        else memset(buffer, 0, 512);
+        memcpy(buffer + in_sector, data + done, chunk);
+        if (!ata_write_safe(f->start + sector, buffer)) return 0;
+        mark_sector(f->start + sector, 1);
+
+        off += chunk;
+        done += chunk;
+    }
+
+    f->size = off;
+    if (fits) fs_save_entry(fi);
+    else fs_save();
+    return 1;
+}
+
+// Appends `len` bytes to file `name` (creating it if needed). Only the last
+// partial sector and the new ones are written; the file moves only when the
+// sectors right after it are taken.
+int fs_append_file(const char* name, const char* data, uint32_t len) {
+    mutex_lock(&fs_lock);
+    int ok = fs_append_nolock(name, data, len);
+    mutex_unlock(&fs_lock);
+    return ok;
+}
+
+static int fs_write_range_nolock(const char* name, uint32_t size, uint32_t off, const char* data, uint32_t len) {
+    int fi = fs_find(name);
+    if (fi < 0) {
+        if (off != 0 || len != size) return 0;
+        fs_write_data_nolock(name, data, len);
+        return fs_find(name) >= 0;
+    }
+
+    FileEntry* f = &files[fi];
+    uint32_t old_sectors = (f->size + 511) / 512;
+    uint32_t new_sectors = (size + 511) / 512;
+    uint32_t first = off / 512;
+    uint8_t buffer[512];
+
+    int fits = 1;
+    for (uint32_t s = old_sectors; s < new_sectors; s++)
+        if (!is_sector_free(f->start + s)) { fits = 0; break; }
+
+    if (!fits) {
+        // the sectors before the range move along with it
+        uint32_t lba = fs_allocate_sectors_safe(new_sectors);
+        if (!lba) return 0;
+        for (uint32_t s = 0; s < first; s++) {
+            ata_read28(f->start + s, buffer);
+            if (!ata_write_safe(lba + s, buffer)) return 0;
+        }
+        for (uint32_t s = 0; s < old_sectors; s++)
+            mark_sector(f->start + s, 0);
+        f->start = lba;
+    } else {
+        for (uint32_t s = old_sectors; s < new_sectors; s++)
+            mark_sector(f->start + s, 1);
+        for (uint32_t s = new_sectors; s < old_sectors; s++)
+            mark_sector(f->start + s, 0);
+    }
+
+    for (uint32_t done = 0; done < len; done += 512) {
+        uint32_t chunk = len - done < 512 ? len - done : 512;
+        memset(buffer, 0, 512);
+        memcpy(buffer, data + done, chunk);
+        if (!ata_write_safe(f->start + first + done / 512, buffer)) return 0;
+    }
+
+    f->size = size;
+    fs_save_entry(fi);
+    fs_generation++;
+    return 1;
+}
+
+// Rewrites bytes [off, off + len) of file `name` and sets its size to `size`,
+// leaving every other sector alone; `off` is sector aligned and the range ends
+// on a sector boundary or at `size`. The file only moves when it grows into
+// sectors that are taken. Creates the file if the range is all of it.
+int fs_write_range(const char* name, uint32_t size, uint32_t off, const char* data, uint32_t len) {
+    mutex_lock(&fs_lock);
+    int ok = fs_write_range_nolock(name, size, off, data, len);
+    mutex_unlock(&fs_lock);
+    return ok;
+}
+
+void fs_dir() {
+    mutex_lock(&fs_lock);
+    for (int i = 0; i < MAX_FILES; i++) {
+        if (files[i].used) {
+            kprint(files[i].name, os_color);
+            kput_char(' ', os_color);
+            char size_str[12];
+            int sz = files[i].size;
+            int pos = 0;
+            do {
+                size_str[pos++] = '0' + sz % 10;
+                sz /= 10;
+            } while (sz > 0);
+            // reverse
+            for (int j = pos-1; j >= 0; j--) kput_char(size_str[j], os_color);
+            kput_char('\n', os_color);
+        }
+    }
+    mutex_unlock(&fs_lock);
+}
+
+#define MAX_FILE_PRINT 4096
+
+static void fs_read_nolock(const char* name) {
+    for (int i = 0; i < MAX_FILES; i++) {
+        if (files[i].used && strcmp(files[i].name, name) == 1) {
+            uint32_t len = files[i].size;
+            uint32_t sectors = (len + 511) / 512;
+            // one spare byte so a full sector can still be NUL-terminated
+            uint8_t* buffer = scratch_alloc(513);
+            if (!buffer) return;
+
+            for (uint32_t s = 0; s < sectors; s++) {
+                ata_read28(files[i].start + s, buffer);
+                uint32_t remaining = len - s*512;
+                if (remaining > 512) remaining = 512;
+                buffer[remaining] = '\0';
+                kprint((char*)buffer, os_color);
+            }
+            kput_char('\n', os_color);
+            return;
+        }
+    }
+    kprint("File not found!\n", (os_color & 0xF0) | 0x0C);
+}
+
+void fs_read_file(const char* name) {
+    mutex_lock(&fs_lock);
+    fs_read_nolock(name);
+    mutex_unlock(&fs_lock);
+}
+
+static void fs_delete_nolock(const char* name) {
+    for (int i = 0; i < MAX_FILES; i++) {
+        if (files[i].used && strcmp(files[i].name, name) == 1) {
+            files[i].used = 0;  // mark as unused
+            files[i].name[0] = '\0';
+            files[i].size = 0;
+            fs_save();          // save the updated file table
+            kprint("File deleted successfully!\n", (os_color & 0xF0) | 0x0A);
+            return;
+        }
+    }
+    kprint("File not found!\n", (os_color & 0xF0) | 0x0C);
+}
+
+void fs_delete_file(const char* name) {
+    mutex_lock(&fs_lock);
+    fs_delete_nolock(name);
+    mutex_unlock(&fs_lock);
+}
+
+// ================== GDT / IDT ==================
+// GRUB leaves us with its own GDT somewhere in memory we don't own, so we load
+// a flat one of our own before installing any interrupt handlers. User
+// programs get flat ring 3 segments, and every CPU a TSS that tells it which
+// kernel stack to switch to when ring 3 is interrupted.
+#define KERNEL_CS 0x08
+#define KERNEL_DS 0x10
+#define USER_CS   0x1B        // gdt[3], RPL 3
+#define USER_DS   0x23        // gdt[4], RPL 3
+#define GDT_TSS   5           // gdt[5 + cpu]
+
+typedef struct {
+    uint16_t limit;
+    uint32_t base;
+} __attribute__((packed)) DescriptorPointer;
+
+typedef struct {
+    uint16_t offset_low;
+    uint16_t selector;
+    uint8_t  zero;
+    uint8_t  flags;
+    uint16_t offset_high;
+} __attribute__((packed)) IdtEntry;
+
+// layout pushed by isr_common in kernel.asm (keep in sync!)
+typedef struct {
+    uint32_t gs, fs, es, ds;
+    uint32_t edi, esi, ebp, esp_dummy, ebx, edx, ecx, eax;
+    uint32_t int_no, err_code;
+    uint32_t eip, cs, eflags, useresp, ss;
+} InterruptFrame;
+
+typedef void (*interrupt_handler_t)(InterruptFrame*);
+typedef void (*irq_handler_t)(void);
+
+#define SYSCALL_VECTOR 0x80
+
+typedef struct {
+    uint32_t prev, esp0, ss0, esp1, ss1, esp2, ss2;
+    uint32_t cr3, eip, eflags, eax, ecx, edx, ebx, esp, ebp, esi, edi;
+    uint32_t es, cs, ss, ds, fs, gs, ldt;
+    uint16_t trap, iomap_base;
+} Tss;                        // 104 bytes, no padding anywhere
+
+uint64_t gdt[GDT_TSS + MAX_CPUS];
+Tss tss[MAX_CPUS];
+IdtEntry idt[256];
+interrupt_handler_t interrupt_handlers[256];
+
+extern uint32_t isr_stub_table[];
+
+static uint64_t gdt_entry(uint32_t base, uint32_t limit, uint8_t access, uint8_t flags) {
+    uint64_t e = 0;
+    e |= limit & 0xFFFF;
+    e |= (uint64_t)(base & 0xFFFFFF) << 16;
+    e |= (uint64_t)access << 40;
+    e |= (uint64_t)((limit >> 16) & 0x0F) << 48;
+    e |= (uint64_t)(flags & 0x0F) << 52;
+    e |= (uint64_t)((base >> 24) & 0xFF) << 56;
+    return e;
+}
+
+// loads gdt[] on this CPU and reloads every segment register from it
+void gdt_load(void) {
+    DescriptorPointer gdtr = { sizeof(gdt) - 1, (uint32_t)gdt };
+    __asm__ volatile(
+        "lgdt %0\n\t"
+        "ljmp $0x08, $1f\n\t"
+        "1:\n\t"
+        "mov $0x10, %%ax\n\t"
+        "mov %%ax, %%ds\n\t"
+        "mov %%ax, %%es\n\t"
+        "mov %%ax, %%fs\n\t"
+        "mov %%ax, %%gs\n\t"
+        "mov %%ax, %%ss\n\t"
+        : : "m"(gdtr) : "eax", "memory");
+}
+
+// this CPU's TSS; with no I/O bitmap (iomap_base past the end) ring 3 gets no ports
+void tss_load(int cpu) {
+    uint16_t sel = (GDT_TSS + cpu) * 8;
+    __asm__ volatile("ltr %0" : : "r"(sel));
+}
+
+void tss_set_stack(int cpu, uint32_t esp0) {
+    tss[cpu].esp0 = esp0;
+}
+
+void gdt_init(void) {
+    gdt[0] = 0;
+    gdt[1] = gdt_entry(0, 0xFFFFF, 0x9A, 0x0C); // kernel code, 4GB flat
+    gdt[2] = gdt_entry(0, 0xFFFFF, 0x92, 0x0C); // kernel data, 4GB flat
+    gdt[3] = gdt_entry(0, 0xFFFFF, 0xFA, 0x0C); // user code, 4GB flat
+    gdt[4] = gdt_entry(0, 0xFFFFF, 0xF2, 0x0C); // user data, 4GB flat
+    for (int i = 0; i < MAX_CPUS; i++) {
+        tss[i].ss0 = KERNEL_DS;
+        tss[i].iomap_base = sizeof(Tss);
+        gdt[GDT_TSS + i] = gdt_entry((uint32_t)&tss[i], sizeof(Tss) - 1, 0x89, 0x00);
+    }
+    gdt_load();
+    tss_load(0);
+}
+
+void idt_set_gate(int n, uint32_t handler, uint8_t flags) {
+    idt[n].offset_low = handler & 0xFFFF;
+    idt[n].selector = KERNEL_CS;
+    idt[n].zero = 0;
+    idt[n].flags = flags;
+    idt[n].offset_high = (handler >> 16) & 0xFFFF;
+}
+
+// every CPU shares the one IDT
+void idt_load(void) {
+    DescriptorPointer idtr = { sizeof(idt) - 1, (uint32_t)idt };
+    __asm__ volatile("lidt %0" : : "m"(idtr));
+}
+
+extern void isr128(void);
+
+void idt_init(void) {
+    memset(idt, 0, sizeof(idt));
+    for (int i = 0; i < 64; i++)
+        idt_set_gate(i, isr_stub_table[i], 0x8E); // present, ring 0, interrupt gate
+    // int 0x80 from ring 3; a trap gate, so syscalls run with interrupts on
+    idt_set_gate(SYSCALL_VECTOR, (uint32_t)isr128, 0xEF);
+    idt_load();
+}
+
+void register_interrupt_handler(int n, interrupt_handler_t handler) {
+    interrupt_handlers[n] = handler;
+}
+
+// ----------------- 8259 PIC -----------------
+#define IRQ_BASE 32
+#define PIC1_CMD  0x20
+#define PIC1_DATA 0x21
+#define PIC2_CMD  0xA0
+#define PIC2_DATA 0xA1
+
+irq_handler_t irq_handlers[16];
+
+// moves IRQ 0-15 to vectors 32-47 (the BIOS default collides with CPU exceptions)
+void pic_init(void) {
+    outb(PIC1_CMD, 0x11);        // ICW1: init, expect ICW4
+    outb(PIC2_CMD, 0x11);
+    outb(PIC1_DATA, IRQ_BASE);   // ICW2: vector offsets
+    outb(PIC2_DATA, IRQ_BASE + 8);
+    outb(PIC1_DATA, 0x04);       // ICW3: slave on IRQ2
+    outb(PIC2_DATA, 0x02);
+    outb(PIC1_DATA, 0x01);       // ICW4: 8086 mode
+    outb(PIC2_DATA, 0x01);
+
+    outb(PIC1_DATA, 0xFB);       // everything masked except the cascade
+    outb(PIC2_DATA, 0xFF);
+}
+
+// ----------------- local APIC and IOAPIC -----------------
+// With more than one CPU (or just an APIC) smp_init switches the PIC off and
+// the IOAPIC delivers the same IRQs on the same vectors, all to the BSP. Each
+// CPU's local APIC adds its own timer and takes IPIs from the others.
+#define LAPIC_ID        0x020
+#define LAPIC_TPR       0x080
+#define LAPIC_EOI       0x0B0
+#define LAPIC_SVR       0x0F0
+#define LAPIC_ICR_LO    0x300
+#define LAPIC_ICR_HI    0x310
+#define LAPIC_LVT_TIMER 0x320
+#define LAPIC_LVT_LINT0 0x350
+#define LAPIC_TIMER_INIT 0x380
+#define LAPIC_TIMER_CUR 0x390
+#define LAPIC_TIMER_DIV 0x3E0
+
+#define VEC_LAPIC_TIMER 48
+#define VEC_IPI_WAKE    49    // "your run queue has something", see smp_kick
+#define VEC_IPI_TLB     50    // see tlb_shootdown
+#define VEC_SPURIOUS    63
+
+volatile uint8_t* lapic = NULL;
+volatile uint32_t* ioapic = NULL;
+uint32_t ioapic_gsi_base = 0;
+uint8_t irq_gsi[16];           // ISA IRQ -> IOAPIC input, from the MADT overrides
+uint16_t irq_gsi_flags[16];    // MADT polarity/trigger bits for it
+int apic_active = 0;           // the IOAPIC delivers IRQs, EOIs go to the local APIC
+Spinlock ioapic_lock;
+
+static inline uint32_t lapic_read(uint32_t reg) {
+    return *(volatile uint32_t*)(lapic + reg);
+}
+
+static inline void lapic_write(uint32_t reg, uint32_t value) {
+    *(volatile uint32_t*)(lapic + reg) = value;
+}
+
+static inline void lapic_eoi(void) {
+    lapic_write(LAPIC_EOI, 0);
+}
+
+static uint32_t ioapic_read(uint32_t reg) {
+    ioapic[0] = reg;
+    return ioapic[4];
+}
+
+static void ioapic_write(uint32_t reg, uint32_t value) {
+    ioapic[0] = reg;
+    ioapic[4] = value;
+}
+
+// points ISA IRQ `irq` at vector IRQ_BASE + irq on the BSP
+static void ioapic_route(int irq, int masked) {
+    uint32_t pin = irq_gsi[irq] - ioapic_gsi_base;
+    uint32_t lo = IRQ_BASE + irq;
+    if ((irq_gsi_flags[irq] & 0x3) == 0x3) lo |= 1u << 13;        // active low
+    if (((irq_gsi_flags[irq] >> 2) & 0x3) == 0x3) lo |= 1u << 15; // level triggered
+    if (masked) lo |= 1u << 16;
+
+    uint32_t flags = spin_lock_irqsave(&ioapic_lock);
+    ioapic_write(0x10 + pin * 2 + 1, (uint32_t)cpus[0].apic_id << 24);
+    ioapic_write(0x10 + pin * 2, lo);
+    spin_unlock_irqrestore(&ioapic_lock, flags);
+}
+
+void irq_unmask(int irq) {
+    if (apic_active) {
+        ioapic_route(irq, 0);
+        return;
+    }
+    uint16_t port = irq < 8 ? PIC1_DATA : PIC2_DATA;
+    outb(port, inb(port) & ~(1 << (irq % 8)));
+}
+
+void irq_mask(int irq) {
+    if (apic_active) {
+        ioapic_route(irq, 1);
+        return;
+    }
+    uint16_t port = irq < 8 ? PIC1_DATA : PIC2_DATA;
+    outb(port, inb(port) | (1 << (irq % 8)));
+}
+
+void register_irq_handler(int irq, irq_handler_t handler) {
+    irq_handlers[irq] = handler;
+    irq_unmask(irq);
+}
+
+static void irq_dispatch(InterruptFrame* f) {
+    int irq = f->int_no - IRQ_BASE;
+
+    if (apic_active) {
+        if (irq_handlers[irq]) irq_handlers[irq]();
+        lapic_eoi();
+        return;
+    }
+
+    // spurious IRQ7/15: the PIC's in-service bit isn't set, so no handler and no EOI
+    if (irq == 7 || irq == 15) {
+        outb(irq == 7 ? PIC1_CMD : PIC2_CMD, 0x0B); // read ISR
+        if (!(inb(irq == 7 ? PIC1_CMD : PIC2_CMD) & 0x80)) {
+            if (irq == 15) outb(PIC1_CMD, 0x20); // the master still saw IRQ2
+            return;
+        }
+    }
+
+    if (irq_handlers[irq]) irq_handlers[irq]();
+
+    if (irq >= 8) outb(PIC2_CMD, 0x20);
+    outb(PIC1_CMD, 0x20);
+}
+
+// ================== Timers ==================
+// PIT channel 0 ticks at TIMER_HZ and drives the timer wheel; the clock itself
+// is the TSC, calibrated against PIT channel 2 at boot, so ktime_ns() has
+// cycle resolution and costs one rdtsc.
+#define PIT_HZ 1193182
+#define TIMER_HZ 1000 // one tick per millisecond, timer_add relies on it
+#define TIMER_WHEEL_SLOTS 256 // power of two
+
+typedef struct Timer {
+    uint64_t expires;          // tick the callback is due at
+    void (*fn)(void* arg);     // runs in IRQ context on the BSP, keep it short
+    void* arg;
+    struct Timer* next;
+    int active;
+} Timer;
+
+volatile uint64_t timer_ticks = 0;
+Timer* timer_wheel[TIMER_WHEEL_SLOTS];
+Spinlock timer_lock;           // the wheel and every Timer's next/active
+Timer* volatile timer_running; // whose callback timer_irq is in right now
+
+uint32_t tsc_khz = 0;          // 0 = no usable TSC, fall back to ticks
+uint32_t tsc_ns_mult = 0;      // ns per cycle, 32.32 fixed point
+uint64_t tsc_boot = 0;
+
+// 64/32 division without libgcc (only used at calibration time)
+static uint64_t div64_32(uint64_t n, uint32_t d) {
+    uint32_t hi = n >> 32, lo = (uint32_t)n, q_hi, q_lo, r;
+    q_hi = hi / d;
+    r = hi % d;
+    __asm__("divl %4" : "=a"(q_lo), "=d"(r) : "a"(lo), "d"(r), "rm"(d));
+    return ((uint64_t)q_hi << 32) | q_lo;
+}
+
+// counts TSC cycles during 50ms of PIT channel 2 (one-shot, gated via port 0x61)
+static void tsc_calibrate(void) {
+    if (!(cpu_features & CPU_TSC)) return;
+
+    const uint32_t latch = PIT_HZ / 20;
+    outb(0x61, (inb(0x61) & ~0x02) | 0x01); // gate on, speaker off
+    outb(0x43, 0xB0);                        // channel 2, lo/hi, mode 0
+    outb(0x42, latch & 0xFF);
+    outb(0x42, latch >> 8);
+
+    uint64_t start = rdtsc();
+    while (!(inb(0x61) & 0x20)) { }          // OUT2 goes high at terminal count
+    uint64_t cycles = rdtsc() - start;
+    outb(0x61, inb(0x61) & ~0x01);
+
+    if (cycles == 0 || cycles > 0xFFFFFFFFull) return;
+    tsc_khz = (uint32_t)cycles / 50;
+    if (tsc_khz == 0) return;
+    tsc_ns_mult = (uint32_t)div64_32(1000000ull << 32, tsc_khz);
+    tsc_boot = rdtsc();
+}
+
+// nanoseconds since the timer was set up
+uint64_t ktime_ns(void) {
+    if (!tsc_khz) return timer_ticks * (1000000000 / TIMER_HZ);
+    uint64_t c = rdtsc() - tsc_boot;
+    uint32_t lo = (uint32_t)c, hi = c >> 32;
+    return (((uint64_t)lo * tsc_ns_mult) >> 32) + (uint64_t)hi * tsc_ns_mult;
+}
+
+uint64_t ktime_ms(void) {
+    return div64_32(ktime_ns(), 1000000);
+}
+
+static void timer_insert(Timer* t) {
+    Timer** slot = &timer_wheel[t->expires % TIMER_WHEEL_SLOTS];
+    t->next = *slot;
+    *slot = t;
+}
+
+// takes `t` off the wheel if it's on it (timer_lock held)
+static void timer_unlink(Timer* t) {
+    if (!t->active) return;
+    Timer** p = &timer_wheel[t->expires % TIMER_WHEEL_SLOTS];
+    while (*p && *p != t) p = &(*p)->next;
+    if (*p) *p = t->next;
+    t->active = 0;
+}
+
+// runs `fn(arg)` from the timer interrupt `ms` milliseconds from now; a timer
+// that's still armed is moved, not linked in a second time
+void timer_add(Timer* t, uint32_t ms, void (*fn)(void*), void* arg) {
+    uint32_t flags = spin_lock_irqsave(&timer_lock);
+    timer_unlink(t);
+    t->fn = fn;
+    t->arg = arg;
+    t->expires = timer_ticks + ms + 1; // +1: the current tick is already partly over
+    t->active = 1;
+    timer_insert(t);
+    spin_unlock_irqrestore(&timer_lock, flags);
+}
+
+// once this returns `t`'s callback isn't running anywhere either, so `t` (and
+// whatever it points at) can go away; a callback that re-arms itself has to
+// check on its own that it was cancelled (see seq_step)
+void timer_cancel(Timer* t) {
+    uint32_t flags = spin_lock_irqsave(&timer_lock);
+    timer_unlink(t);
+    spin_unlock_irqrestore(&timer_lock, flags);
+    while (timer_running == t) spin_wait_hint();
+}
+
+void timer_irq(void) {
+    uint64_t now = ++timer_ticks;
+    if ((uint32_t)now % CONSOLE_FLUSH_MS == 0) console_flush_idle();
+    if (!apic_active && cpus[0].rq_len && (uint32_t)now % (THREAD_SLICE_MS * TIMER_HZ / 1000) == 0)
+        cpus[0].need_resched = 1; // someone else is waiting, take turns
+
+    // only this slot can hold due timers; the others in it are later rounds.
+    // Callbacks run without the lock (they may add timers or wake threads),
+    // so the walk starts over after each one.
+    Timer** slot = &timer_wheel[(uint32_t)now % TIMER_WHEEL_SLOTS];
+    spin_lock(&timer_lock);
+    Timer** p = slot;
+    while (*p) {
+        Timer* t = *p;
+        if (t->expires <= now) {
+            *p = t->next;
+            t->active = 0;
+            timer_running = t;
+            spin_unlock(&timer_lock);
+            t->fn(t->arg);
+            spin_lock(&timer_lock);
+            timer_running = NULL;
+            p = slot;
+        } else {
+            p = &t->next;
+        }
+    }
+    spin_unlock(&timer_lock);
+}
+
+void timer_init(void) {
+    tsc_calibrate();
+
+    uint32_t divisor = PIT_HZ / TIMER_HZ;
+    outb(0x43, 0x34);                  // channel 0, lo/hi, rate generator
+    outb(0x40, divisor & 0xFF);
+    outb(0x40, divisor >> 8);
+    register_irq_handler(0, timer_irq);
+}
+
+static void sleep_wakeup(void* arg) {
+    wq_wake_all((WaitQueue*)arg);
+}
+
+// blocks the thread until `ms` milliseconds have passed (or it gets killed)
+void sleep_ms(uint32_t ms) {
+    if (ms == 0) return;
+    uint64_t until = timer_ticks + ms;
+    WaitQueue q = {0};
+    Timer t;
+    for (;;) {
+        uint64_t now = timer_ticks;
+        if (now >= until || thread_killed()) break;
+        uint32_t seq = wq_prepare(&q);
+        timer_add(&t, (uint32_t)(until - now), sleep_wakeup, &q);
+        wq_wait(&q, seq);
+        timer_cancel(&t); // q lives on this stack
+    }
+}
+
+// ================== SMP ==================
+// smp_detect() reads the CPUs and the IOAPIC out of the ACPI MADT before
+// paging is on; smp_init() moves interrupts over to the APICs and starts
+// every other CPU with INIT-SIPI-SIPI. The APs come up in real mode at
+// AP_TRAMPOLINE (code in kernel.asm), switch to our GDT and page directory
+// and end up idling in ap_main, ready to take threads off the run queues.
+#define AP_TRAMPOLINE 0x8000 // below 1MB and page aligned, the PMM never hands it out
+
+typedef struct {
+    char signature[8];
+    uint8_t checksum;
+    char oem[6];
+    uint8_t revision;
+    uint32_t rsdt;
+    uint32_t length;           // revision 2+ from here on
+    uint64_t xsdt;
+    uint8_t ext_checksum;
+    uint8_t reserved[3];
+} __attribute__((packed)) AcpiRsdp;
+
+typedef struct {
+    char signature[4];
+    uint32_t length;
+    uint8_t revision;
+    uint8_t checksum;
+    char oem[6];
+    char oem_table[8];
+    uint32_t oem_revision;
+    uint32_t creator;
+    uint32_t creator_revision;
+} __attribute__((packed)) AcpiHeader;
+
+extern uint8_t ap_trampoline[], ap_trampoline_end[];
+extern uint32_t ap_tramp_data[]; // cr3, cr4, stack top; patched in the copy
+
+uint32_t lapic_phys = 0;
+uint32_t ioapic_phys = 0;
+uint32_t lapic_ticks_per_ms = 0;
+volatile uint32_t tlb_flush_mask = 0; // CPUs that still have to reload cr3
+
+static inline uint64_t rdmsr(uint32_t msr) {
+    uint32_t lo, hi;
+    __asm__ volatile("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static inline void wrmsr(uint32_t msr, uint64_t value) {
+    __asm__ volatile("wrmsr" : : "c"(msr), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)));
+}
+
+static void udelay(uint32_t us) {
+    uint64_t end = ktime_ns() + (uint64_t)us * 1000;
+    while (ktime_ns() < end) cpu_relax();
+}
+
+// ----------------- ACPI tables -----------------
+static int acpi_checksum_ok(const void* p, uint32_t len) {
+    uint8_t sum = 0;
+    for (uint32_t i = 0; i < len; i++) sum += ((const uint8_t*)p)[i];
+    return sum == 0;
+}
+
+static AcpiRsdp* acpi_scan(uint32_t start, uint32_t end) {
+    for (uint32_t a = start; a + sizeof(AcpiRsdp) <= end; a += 16) {
+        AcpiRsdp* r = (AcpiRsdp*)a;
+        if (strncmp(r->signature, "RSD PTR ", 8) == 0 && acpi_checksum_ok(r, 20)) return r;
+    }
+    return NULL;
+}
+
+static AcpiHeader* acpi_find(const char* sig) {
+    uint32_t bda = 0x400;
+    __asm__("" : "+r"(bda)); // gcc takes pointers into the first page for NULL + offset
+    uint32_t ebda = (uint32_t)*(volatile uint16_t*)(bda + 0x0E) << 4;
+    AcpiRsdp* rsdp = ebda ? acpi_scan(ebda, ebda + 1024) : NULL;
+    if (!rsdp) rsdp = acpi_scan(0xE0000, 0x100000);
+    if (!rsdp) return NULL;
+
+    // the XSDT only if everything it points at is reachable from 32 bits
+    int wide = rsdp->revision >= 2 && rsdp->xsdt && !(rsdp->xsdt >> 32);
+    AcpiHeader* root = (AcpiHeader*)(wide ? (uint32_t)rsdp->xsdt : rsdp->rsdt);
+    if (!root || !acpi_checksum_ok(root, root->length)) return NULL;
+
+    uint32_t entry_size = wide ? 8 : 4;
+    uint32_t n = (root->length - sizeof(AcpiHeader)) / entry_size;
+    uint8_t* entries = (uint8_t*)(root + 1);
+    for (uint32_t i = 0; i < n; i++) {
+        uint64_t addr = wide ? *(uint64_t*)(entries + i * 8) : *(uint32_t*)(entries + i * 4);
+        if (addr >> 32) continue;
+        AcpiHeader* h = (AcpiHeader*)(uint32_t)addr;
+        if (strncmp(h->signature, sig, 4) == 0 && acpi_checksum_ok(h, h->length)) return h;
+    }
+    return NULL;
+}
+
+// fills cpus[] (the BSP first), the APIC addresses and the ISA IRQ overrides;
+// paging has to be off still, the tables can be anywhere in RAM
+void smp_detect(void) {
+    for (int i = 0; i < 16; i++) irq_gsi[i] = i;
+
+    uint32_t a, b, c, d;
+    cpuid(1, 0, &a, &b, &c, &d);
+    if (!(d & (1 << 9))) return;          // no local APIC
+    uint8_t bsp_id = b >> 24;
+    cpus[0].apic_id = bsp_id;
+
+    AcpiHeader* madt = acpi_find("APIC");
+    if (!madt) return;
+    lapic_phys = *(uint32_t*)(madt + 1);
+
+    uint8_t* p = (uint8_t*)madt + sizeof(AcpiHeader) + 8;
+    uint8_t* end = (uint8_t*)madt + madt->length;
+    while (p + 2 <= end && p[1] >= 2) {
+        switch (p[0]) {
+        case 0: // processor local APIC: acpi id, apic id, flags (enabled or can be)
+            if ((*(uint32_t*)(p + 4) & 3) && p[3] != bsp_id && cpu_count < MAX_CPUS) {
+                cpus[cpu_count].id = cpu_count;
+                cpus[cpu_count].apic_id = p[3];
+                cpu_count++;
+            }
+            break;
+        case 1: // IOAPIC; only the first one, the ISA IRQs are on it
+            if (!ioapic_phys) {
+                ioapic_phys = *(uint32_t*)(p + 4);
+                ioapic_gsi_base = *(uint32_t*)(p + 8);
+            }
+            break;
+        case 2: // interrupt source override: bus, irq, gsi, flags
+            if (p[2] == 0 && p[3] < 16) {
+                irq_gsi[p[3]] = *(uint32_t*)(p + 4);
+                irq_gsi_flags[p[3]] = *(uint16_t*)(p + 8);
+            }
+            break;
+        case 5: // 64-bit local APIC address
+            if (!(*(uint64_t*)(p + 4) >> 32)) lapic_phys = *(uint32_t*)(p + 4);
+            break;
+        }
+        p += p[1];
+    }
+}
+
+// ----------------- local APIC -----------------
+static void lapic_ipi(uint8_t apic_id, uint32_t icr) {
+    uint32_t flags = irq_save();
+    while (lapic_read(LAPIC_ICR_LO) & (1 << 12)) cpu_relax(); // previous one still going out
+    lapic_write(LAPIC_ICR_HI, (uint32_t)apic_id << 24);
+    lapic_write(LAPIC_ICR_LO, icr);
+    irq_restore(flags);
+}
+
+// wakes `c` out of hlt so it looks at its run queue
+void smp_kick(Cpu* c) {
+    if (!apic_active || c == this_cpu()) return;
+    lapic_ipi(c->apic_id, VEC_IPI_WAKE);
+}
+
+// counts the local APIC timer over 10ms of TSC (divide by 16)
+static void lapic_calibrate(void) {
+    lapic_write(LAPIC_TIMER_DIV, 0x3);
+    lapic_write(LAPIC_LVT_TIMER, 1 << 16);   // masked one-shot
+    lapic_write(LAPIC_TIMER_INIT, 0xFFFFFFFF);
+    udelay(10000);
+    uint32_t left = lapic_read(LAPIC_TIMER_CUR);
+    lapic_write(LAPIC_TIMER_INIT, 0);
+    lapic_ticks_per_ms = (0xFFFFFFFF - left) / 10;
+}
+
+// this CPU's local APIC: on, no ExtINT, a tick every THREAD_SLICE_MS
+static void lapic_init_cpu(void) {
+    lapic_write(LAPIC_SVR, VEC_SPURIOUS | 0x100);
+    lapic_write(LAPIC_TPR, 0);
+    lapic_write(LAPIC_LVT_LINT0, 1 << 16);
+    if (lapic_ticks_per_ms) {
+        lapic_write(LAPIC_TIMER_DIV, 0x3);
+        lapic_write(LAPIC_LVT_TIMER, VEC_LAPIC_TIMER | (1 << 17)); // periodic
+        lapic_write(LAPIC_TIMER_INIT, lapic_ticks_per_ms * THREAD_SLICE_MS);
+    }
+}
+
+static void lapic_timer_irq(InterruptFrame* f) {
+    (void)f;
+    Cpu* c = this_cpu();
+    // an idle CPU looks for work to steal, a busy one takes turns if others wait
+    if (c->rq_len || c->running == c->idle) c->need_resched = 1;
+    lapic_eoi();
+}
+
+static void ipi_wake_irq(InterruptFrame* f) {
+    (void)f;
+    this_cpu()->need_resched = 1;
+    lapic_eoi();
+}
+
+static void ipi_tlb_irq(InterruptFrame* f) {
+    (void)f;
+    tlb_flush_service();
+    lapic_eoi();
+}
+
+static void spurious_irq(InterruptFrame* f) {
+    (void)f; // no EOI for these
+}
+
+// ----------------- TLB shootdown -----------------
+// reloads cr3 if another CPU asked this one to; also called by spinning CPUs
+void tlb_flush_service(void) {
+    uint32_t flags = irq_save();
+    uint32_t bit = 1u << this_cpu()->id;
+    if (tlb_flush_mask & bit) {
+        uint32_t cr3;
+        __asm__ volatile("mov %%cr3, %0; mov %0, %%cr3" : "=r"(cr3) : : "memory");
+        __atomic_and_fetch(&tlb_flush_mask, ~bit, __ATOMIC_RELEASE);
+    }
+    irq_restore(flags);
+}
+
+// Makes every other CPU drop its TLB (the window is small, a full flush is
+// cheaper than a list of pages) and waits until they all have. The caller
+// already did invlpg on its own CPU.
+void tlb_shootdown(void) {
+    if (!apic_active) return;
+    uint32_t flags = irq_save();
+    uint32_t others = cpus_online_mask & ~(1u << this_cpu()->id);
+    if (others) {
+        __atomic_or_fetch(&tlb_flush_mask, others, __ATOMIC_ACQ_REL);
+        lapic_ipi(0, VEC_IPI_TLB | (3 << 18)); // all but self
+        while (tlb_flush_mask & others) spin_wait_hint();
+    }
+    irq_restore(flags);
+}
+
+// ----------------- bringing up the APs -----------------
+// where the trampoline jumps to, on the AP's idle thread stack
+void ap_main(void) {
+    Cpu* c = this_cpu();
+    gdt_load();
+    tss_load(c->id);
+    idt_load();
+    cpu_enable_fpu();
+    lapic_init_cpu();
+    c->running = c->idle;
+    __atomic_or_fetch(&cpus_online_mask, 1u << c->id, __ATOMIC_RELEASE);
+    c->online = 1;
+    cpu_idle_loop();
+}
+
+static int ap_start(Cpu* c) {
+    Thread* idle = &idle_threads[c->id];
+    if (!thread_setup(idle, "idle", (void (*)(void*))cpu_idle_loop, NULL)) return 0;
+    idle->state = THREAD_RUNNING;
+    idle->on_cpu = 1;
+    idle->cpu = c;
+    c->idle = idle;
+
+    uint32_t* data = (uint32_t*)(AP_TRAMPOLINE + ((uint8_t*)ap_tramp_data - ap_trampoline));
+    __asm__ volatile("mov %%cr3, %0" : "=r"(data[0]));
+    __asm__ volatile("mov %%cr4, %0" : "=r"(data[1]));
+    data[2] = (uint32_t)idle->stack + KSTACK_SIZE;
+
+    lapic_ipi(c->apic_id, 0x4500);       // INIT, assert
+    udelay(10000);
+    for (int i = 0; i < 2 && !c->online; i++) {
+        lapic_ipi(c->apic_id, 0x4600 | (AP_TRAMPOLINE >> 12)); // STARTUP
+        udelay(200);
+    }
+    for (int ms = 0; ms < 100 && !c->online; ms++) udelay(1000);
+    return c->online;
+}
+
+// Switches from the PIC to the APICs and (unless `allow_aps` is 0) starts the
+// other CPUs. Without a MADT nothing changes: one CPU, PIT time slices.
+void smp_init(int allow_aps) {
+    if (!lapic_phys || !ioapic_phys || !tsc_khz || !threads_ready) return;
+    lapic = (volatile uint8_t*)lapic_phys;
+    ioapic = (volatile uint32_t*)ioapic_phys;
+    wrmsr(0x1B, rdmsr(0x1B) | (1 << 11)); // IA32_APIC_BASE: global enable
+
+    register_interrupt_handler(VEC_LAPIC_TIMER, lapic_timer_irq);
+    register_interrupt_handler(VEC_IPI_WAKE, ipi_wake_irq);
+    register_interrupt_handler(VEC_IPI_TLB, ipi_tlb_irq);
+    register_interrupt_handler(VEC_SPURIOUS, spurious_irq);
+
+    // every IOAPIC input masked, then the PIC off and our IRQs over to the IOAPIC
+    uint32_t flags = irq_save();
+    uint32_t pins = ((ioapic_read(1) >> 16) & 0xFF) + 1;
+    for (uint32_t pin = 0; pin < pins; pin++) ioapic_write(0x10 + pin * 2, 1u << 16);
+    outb(PIC1_DATA, 0xFF);
+    outb(PIC2_DATA, 0xFF);
+    apic_active = 1;
+    for (int irq = 0; irq < 16; irq++)
+        if (irq_handlers[irq]) ioapic_route(irq, 0);
+    irq_restore(flags);
+
+    lapic_calibrate();
+    lapic_init_cpu();
+    if (!allow_aps) {
+        cpu_count = 1;
+        return;
+    }
+
+    memcpy((void*)AP_TRAMPOLINE, ap_trampoline, ap_trampoline_end - ap_trampoline);
+    for (int i = 1; i < cpu_count; i++) {
+        if (!ap_start(&cpus[i])) {
+            klog_hex(KLOG_WARN, "smp", "CPU didn't start, APIC id", cpus[i].apic_id);
+            kprint("smp: CPU with APIC id ", (os_color & 0xF0) | 0x0C);
+            kprint_dec(cpus[i].apic_id, (os_color & 0xF0) | 0x0C);
+            kprint(" didn't start\n", (os_color & 0xF0) | 0x0C);
+        }
+    }
+}
+
+// ================== Boot trace ==================
+// boot_mark() stamps the end of each boot phase with the TSC; kernel.asm stamps
+// the multiboot entry. Cycles only become milliseconds once the TSC has been
+// calibrated, so they are converted when the trace is printed.
+#define BOOT_MAX_PHASES 24
+
+typedef struct {
+    const char* name;
+    uint64_t tsc;
+} BootPhase;
+
+extern uint64_t boot_tsc_entry;       // set by start in kernel.asm
+BootPhase boot_phases[BOOT_MAX_PHASES];
+int boot_phase_count = 0;
+int boot_fast = 0;                    // "fastboot" on the kernel command line
+
+void boot_mark(const char* name) {
+    if (boot_phase_count == BOOT_MAX_PHASES) return;
+    boot_phases[boot_phase_count].name = name;
+    boot_phases[boot_phase_count].tsc = rdtsc();
+    boot_phase_count++;
+}
+
+// microseconds since the multiboot entry at `tsc`
+static uint32_t boot_us(uint64_t tsc) {
+    return (uint32_t)div64_32((tsc - boot_tsc_entry) * 1000, tsc_khz);
+}
+
+// "12.345"
+static void format_ms(uint32_t us, char* out) {
+    char tmp[16];
+    int n = 0;
+    uint32_t ms = us / 1000;
+    do { tmp[n++] = '0' + ms % 10; ms /= 10; } while (ms);
+    while (n) *out++ = tmp[--n];
+    *out++ = '.';
+    *out++ = '0' + us / 100 % 10;
+    *out++ = '0' + us / 10 % 10;
+    *out++ = '0' + us % 10;
+    *out = '\0';
+}
+
+// one line per phase: time since entry and how long the phase took
+void boot_trace_print(void (*out)(const char*)) {
+    if (!tsc_khz) {
+        out("no usable TSC, no boot trace\n");
+        return;
+    }
+    char num[16];
+    uint32_t prev = 0;
+    for (int i = 0; i < boot_phase_count; i++) {
+        uint32_t us = boot_us(boot_phases[i].tsc);
+        out(boot_phases[i].name);
+        for (int pad = strlen(boot_phases[i].name); pad < 14; pad++) out(" ");
+        format_ms(us, num);
+        out(num);
+        out(" ms  (+");
+        format_ms(us - prev, num);
+        out(num);
+        out(" ms)\n");
+        prev = us;
+    }
+}
+
+// looks for `word` in the multiboot command line
+int boot_cmdline_has(MultibootInfo* mbi, const char* word) {
+    if (!(mbi->flags & MB_INFO_CMDLINE) || !mbi->cmdline) return 0;
+    const char* s = (const char*)mbi->cmdline;
+    uint32_t len = strlen(word);
+    while (*s) {
+        while (*s == ' ') s++;
+        const char* w = s;
+        while (*s && *s != ' ') s++;
+        if ((uint32_t)(s - w) == len && strncmp(w, word, len) == 0) return 1;
+    }
+    return 0;
+}
+
+static const char* exception_names[32] = {
+    "divide error", "debug", "NMI", "breakpoint", "overflow", "bound range",
+    "invalid opcode", "device not available", "double fault", "coprocessor overrun",
+    "invalid TSS", "segment not present", "stack fault", "general protection",
+    "page fault", "reserved", "x87 error", "alignment check", "machine check",
+    "SIMD error", "virtualization", "control protection", "reserved", "reserved",
+    "reserved", "reserved", "reserved", "reserved", "hypervisor injection",
+    "VMM communication", "security", "reserved"
+};
+
+// called from isr_common for every vector
+// the EOI is out by now, so it's fine to switch threads from here
+static inline void irq_preempt(void) {
+    Cpu* cpu = this_cpu();
+    if (cpu->need_resched && !cpu->in_schedule && interrupt_depth == 0)
+        thread_yield();
+}
+
+void syscall_dispatch(InterruptFrame* f);
+void user_fault(InterruptFrame* f, const char* what);
+void user_exit(int code);
+
+// a user program that was asked to stop ends on its way back to ring 3
+static inline void user_return_check(InterruptFrame* f) {
+    if ((f->cs & 3) && thread_killed()) user_exit(-1);
+}
+
+void isr_handler(InterruptFrame* f) {
+    if (f->int_no >= IRQ_BASE && f->int_no < IRQ_BASE + 16) {
+        interrupt_depth++;
+        irq_dispatch(f);
+        interrupt_depth--;
+        irq_preempt();
+        user_return_check(f);
+        return;
+    }
+    if (f->int_no == SYSCALL_VECTOR) { // thread context, not an interrupt handler
+        syscall_dispatch(f);
+        user_return_check(f);
+        return;
+    }
+    if (interrupt_handlers[f->int_no]) {
+        interrupt_depth++;
+        interrupt_handlers[f->int_no](f);
+        interrupt_depth--;
+        if (f->int_no >= IRQ_BASE) irq_preempt(); // local APIC timer and IPIs
+        user_return_check(f);
+        return;
+    }
+    if (f->cs & 3) user_fault(f, f->int_no < 32 ? exception_names[f->int_no] : "unexpected interrupt");
+
+    panicking = 1; // a fault in a pipeline stage would print into its pipe otherwise
+    console_switch(stack_head()->console); // on screen, and so on COM1
+    uint8_t red = (os_color & 0xF0) | 0x0C;
+    klog_hex(KLOG_ERR, "panic", f->int_no < 32 ? exception_names[f->int_no] : "unexpected interrupt", f->eip);
+    kprint("\nKernel panic: ", red);
+    kprint(f->int_no < 32 ? exception_names[f->int_no] : "unexpected interrupt", red);
+    kprint(" at eip=", red);
+    kprint_hex(f->eip, red);
+    kprint(" err=", red);
+    kprint_hex(f->err_code, red);
+    kput_char('\n', red);
+    console_flush();
+    serial_flush();
+    for (;;) __asm__ volatile("cli; hlt");
+}
+
+// ================== Paging and memory-mapped files ==================
+// Memory layout (4MB PSE pages unless noted):
+//   0x00000000 - 0x3FFFFFFF  identity mapped RAM (kernel, buffers)
+//   0x40000000 - 0x7FFFFFFF  user programs, 4KB pages, one address space each
+//   0xC0000000 - 0xCFFFFFFF  MMIO that isn't above MMIO_BASE (mmio_map)
+//   0xD0000000 - 0xDFFFFFFF  fs_mmap window, 4KB pages filled on page fault
+//   0xE0000000 - 0xFFFFFFFF  identity mapped for MMIO (framebuffers, APICs)
+#define PAGE_SIZE 4096
+#define PAGE_PRESENT  0x001
+#define PAGE_WRITE    0x002
+#define PAGE_USER     0x004
+#define PAGE_ACCESSED 0x020
+#define PAGE_DIRTY    0x040
+#define PAGE_LARGE    0x080
+#define PAGE_WB       0x200         // software bit: msync is writing this page back
+#define PAGE_BUSY     0x400         // software bit, not present: being read in or evicted
+
+#define IDENTITY_LIMIT 0x40000000u
+#define MMIO_BASE      0xE0000000u
+#define MMIO_REMAP     0xC0000000u
+#define MMIO_REMAP_END 0xD0000000u
+#define MMAP_BASE      0xD0000000u
+#define MMAP_PAGES     65536        // 256MB window
+#define SECTORS_PER_PAGE (PAGE_SIZE / 512)
+
+#define MAX_MAPPINGS 16
+
+#define FS_MAP_PRIVATE  0x0         // changes are never written back
+#define FS_MAP_SHARED   0x1         // dirty pages go back to disk on msync/munmap
+#define FS_MAP_POPULATE 0x2         // read everything now and pin it in memory
+
+uint32_t page_directory[1024] __attribute__((aligned(4096)));
+
+uint8_t mmap_vbitmap[MMAP_PAGES / 8];     // 1 bit per window page: 0 = free, 1 = reserved
+uint32_t mmap_clock = 0;                  // eviction hand (window page index)
+
+typedef struct {
+    uint32_t vaddr;      // start of the mapping inside the window
+    uint32_t pages;      // pages reserved in the window
+    uint32_t lba;        // first sector of the file
+    uint32_t sectors;    // sectors owned by the file
+    uint32_t size;       // file size in bytes
+    int      flags;
+    uint8_t  used;
+} FileMapping;
+
+FileMapping mappings[MAX_MAPPINGS];
+
+// The window's page tables, mmap_clock and mmap_resident. Nobody holds it
+// across disk I/O: a page being read in or written back by eviction is marked
+// PAGE_BUSY (and not present) and whoever faults on it waits. The one doing
+// that I/O keeps interrupts off for that single page, so it can't be preempted
+// while others wait on it. msync writes pages that stay mapped with PAGE_WB
+// set, which eviction leaves alone. A PTE that gets cleared is shot down on
+// every CPU before its frame is reused.
+Spinlock mmap_lock;
+
+void tlb_shootdown(void);
+
+static inline void invlpg(uint32_t addr) {
+    __asm__ volatile("invlpg (%0)" : : "r"(addr) : "memory");
+}
+
+static inline uint32_t read_cr2(void) {
+    uint32_t v;
+    __asm__ volatile("mov %%cr2, %0" : "=r"(v));
+    return v;
+}
+
+void paging_init(void) {
+    for (uint32_t i = 0; i < 1024; i++) {
+        uint32_t addr = i << 22;
+        if (addr < IDENTITY_LIMIT || addr >= MMIO_BASE)
+            page_directory[i] = addr | PAGE_PRESENT | PAGE_WRITE | PAGE_LARGE;
+        else
+            page_directory[i] = 0; // mmap window page tables get created on demand
+    }
+
+    uint32_t cr0, cr4;
+    __asm__ volatile("mov %%cr4, %0" : "=r"(cr4));
+    cr4 |= 0x10; // PSE (4MB pages)
+    __asm__ volatile("mov %0, %%cr4" : : "r"(cr4));
+    __asm__ volatile("mov %0, %%cr3" : : "r"((uint32_t)page_directory) : "memory");
+    __asm__ volatile("mov %%cr0, %0" : "=r"(cr0));
+    cr0 |= 0x80000000; // PG
+    __asm__ volatile("mov %0, %%cr0" : : "r"(cr0) : "memory");
+}
+
+uint32_t mmio_remap_next = MMIO_REMAP;
+
+// Where device memory at `phys` can be reached: itself when it's identity
+// mapped, else a spot in the MMIO_REMAP window. NULL when that's full.
+// Call it before any user program's address space is made, they copy ours.
+void* mmio_map(uint32_t phys, uint32_t size) {
+    if (phys >= MMIO_BASE || (phys < IDENTITY_LIMIT && size <= IDENTITY_LIMIT - phys))
+        return (void*)phys;
+
+    uint32_t first = phys & ~0x3FFFFFu;
+    uint32_t bytes = ((phys + size - first) + 0x3FFFFFu) & ~0x3FFFFFu;
+    if (bytes > MMIO_REMAP_END - mmio_remap_next) return NULL;
+
+    uint32_t virt = mmio_remap_next;
+    for (uint32_t off = 0; off < bytes; off += 1u << 22) {
+        page_directory[(virt + off) >> 22] = (first + off) | PAGE_PRESENT | PAGE_WRITE | PAGE_LARGE;
+        invlpg(virt + off);
+    }
+    mmio_remap_next += bytes;
+    return (void*)(virt + (phys - first));
+}
+
+uint32_t mmap_resident = 0;                // file pages currently in RAM
+
+static int mmap_evict_locked(void);
+
+// file pages (and the window's page tables) come straight from the PMM; when
+// RAM runs out we evict our own. mmap_lock held, interrupts off; eviction may
+// drop the lock for a while to write a page back.
+static void* frame_alloc(void) {
+    void* frame = pmm_alloc_page();
+    while (!frame && mmap_evict_locked())
+        frame = pmm_alloc_page();
+    return frame;
+}
+
+static void frame_free(void* frame) {
+    mmap_resident--;
+    pmm_free_page(frame);
+}
+
+// mmap_lock held
+static uint32_t* mmap_pte(uint32_t vaddr, int create) {
+    uint32_t pdi = vaddr >> 22;
+    if (!(page_directory[pdi] & PAGE_PRESENT)) {
+        if (!create) return NULL;
+        uint32_t* table = frame_alloc();
+        if (!table) return NULL;
+        if (page_directory[pdi] & PAGE_PRESENT) { // made while eviction had the lock dropped
+            pmm_free_page(table);
+        } else {
+            memset(table, 0, PAGE_SIZE);
+            page_directory[pdi] = (uint32_t)table | PAGE_PRESENT | PAGE_WRITE;
+        }
+    }
+    uint32_t* table = (uint32_t*)(page_directory[pdi] & ~0xFFFu);
+    return &table[(vaddr >> 12) & 0x3FF];
+}
+
+static FileMapping* mmap_find(uint32_t addr) {
+    for (int i = 0; i < MAX_MAPPINGS; i++) {
+        FileMapping* m = &mappings[i];
+        if (m->used && addr >= m->vaddr && addr < m->vaddr + m->pages * PAGE_SIZE)
+            return m;
+    }
+    return NULL;
+}
+
+// writes one resident page back to the file's sectors (never past the file's end);
+// errors only go to klog, eviction runs this with interrupts off
+static int mmap_write_page(FileMapping* m, uint32_t page, uint8_t* frame) {
+    for (uint32_t s = 0; s < SECTORS_PER_PAGE; s++) {
+        uint32_t sector = page * SECTORS_PER_PAGE + s;
+        if (sector >= m->sectors) break;
+        if (ata_write_quiet(m->lba + sector, frame + s * 512)) return 0;
+    }
+    return 1;
+}
+
+// mmap_lock held: lets go of it (interrupts stay off) until another CPU is
+// done with its PAGE_BUSY page
+static void mmap_wait_busy(void) {
+    spin_unlock(&mmap_lock);
+    spin_wait_hint();
+    spin_lock(&mmap_lock);
+}
+
+// second-chance clock over the window: drops a clean page (or a written back
+// shared one) so its frame can be reused; pinned and dirty private pages stay,
+// and so do pages msync is writing. mmap_lock held, interrupts off.
+static int mmap_evict_locked(void) {
+    for (uint32_t tries = 0; tries < 2 * MMAP_PAGES; tries++) {
+        uint32_t vaddr = MMAP_BASE + mmap_clock * PAGE_SIZE;
+        mmap_clock = (mmap_clock + 1) % MMAP_PAGES;
+
+        uint32_t* pte = mmap_pte(vaddr, 0);
+        if (!pte || !(*pte & PAGE_PRESENT) || (*pte & PAGE_WB)) continue;
+
+        FileMapping* m = mmap_find(vaddr);
+        if (!m || (m->flags & FS_MAP_POPULATE)) continue;
+
+        if (*pte & PAGE_ACCESSED) {
+            *pte &= ~PAGE_ACCESSED; // other CPUs may keep a stale entry, it only delays the next mark
+            invlpg(vaddr);
+            continue;
+        }
+        if ((*pte & PAGE_DIRTY) && !(m->flags & FS_MAP_SHARED)) continue;
+
+        // unmap everywhere first, so no CPU can still write it while it goes to disk
+        uint32_t old = *pte;
+        uint8_t* frame = (uint8_t*)(old & ~0xFFFu);
+        *pte = old & PAGE_DIRTY ? (uint32_t)frame | PAGE_BUSY : 0;
+        invlpg(vaddr);
+        tlb_shootdown();
+        if (old & PAGE_DIRTY) {
+            spin_unlock(&mmap_lock);
+            int ok = mmap_write_page(m, (vaddr - m->vaddr) / PAGE_SIZE, frame);
+            spin_lock(&mmap_lock);
+            if (!ok) {
+                *pte = old;
+                continue;
+            }
+            *pte = 0;
+        }
+        frame_free(frame);
+        return 1;
+    }
+    return 0;
+}
+
+int mmap_evict_one(void) {
+    uint32_t flags = spin_lock_irqsave(&mmap_lock);
+    int ok = mmap_evict_locked();
+    spin_unlock_irqrestore(&mmap_lock, flags);
+    return ok;
+}
+
+// loads one page of a mapping from disk and maps it; the read happens with
+// mmap_lock released and the page marked PAGE_BUSY
+static int mmap_fault_in(FileMapping* m, uint32_t vaddr) {
+    vaddr &= ~0xFFFu;
+    uint32_t flags = spin_lock_irqsave(&mmap_lock);
+    uint32_t* pte;
+    for (;;) {
+        pte = m->used ? mmap_pte(vaddr, 1) : NULL; // unmapped while we waited for the lock?
+        if (!pte || (*pte & PAGE_PRESENT)) { // or another CPU faulted it in meanwhile
+            spin_unlock_irqrestore(&mmap_lock, flags);
+            return pte != NULL;
+        }
+        if (!(*pte & PAGE_BUSY)) break;
+        mmap_wait_busy();
+    }
+
+    *pte = PAGE_BUSY; // ours now, even if frame_alloc lets go of the lock
+    uint8_t* frame = frame_alloc();
+    if (!frame) {
+        *pte = 0;
+        spin_unlock_irqrestore(&mmap_lock, flags);
+        return 0;
+    }
+    mmap_resident++;
+    spin_unlock(&mmap_lock);
+
+    uint32_t page = (vaddr - m->vaddr) / PAGE_SIZE;
+    for (uint32_t s = 0; s < SECTORS_PER_PAGE; s++) {
+        uint32_t sector = page * SECTORS_PER_PAGE + s;
+        if (sector < m->sectors)
+            ata_read28(m->lba + sector, frame + s * 512);
+        else
+            memset(frame + s * 512, 0, 512);
+    }
+
+    // everything past EOF reads as zero, so a mapping is always a valid C string
+    uint32_t page_start = page * PAGE_SIZE;
+    if (m->size < page_start + PAGE_SIZE) {
+        uint32_t keep = m->size > page_start ? m->size - page_start : 0;
+        memset(frame + keep, 0, PAGE_SIZE - keep);
+    }
+
+    spin_lock(&mmap_lock);
+    *pte = (uint32_t)frame | PAGE_PRESENT | PAGE_WRITE;
+    invlpg(vaddr);
+    spin_unlock_irqrestore(&mmap_lock, flags);
+    return 1;
+}
+
+void page_fault_handler(InterruptFrame* f) {
+    uint32_t addr = read_cr2();
+
+    // a user address space copies the kernel's page directory when it's made;
+    // mmap window page tables created since then are picked up here
+    uint32_t* pd;
+    __asm__ volatile("mov %%cr3, %0" : "=r"(pd));
+    uint32_t pdi = addr >> 22;
+    if (pd != page_directory && !(pd[pdi] & PAGE_PRESENT) && (page_directory[pdi] & PAGE_PRESENT)) {
+        pd[pdi] = page_directory[pdi];
+        return;
+    }
+    if (f->err_code & 4) user_fault(f, "page fault"); // from ring 3, never ours to fix
+
+    // only not-present faults inside a live mapping are ours to fix
+    if (!(f->err_code & 1)) {
+        FileMapping* m = mmap_find(addr);
+        if (m && mmap_fault_in(m, addr)) return;
+    }
+
+    uint8_t red = (os_color & 0xF0) | 0x0C;
+    panicking = 1;
+    console_switch(stack_head()->console);
+    klog_hex(KLOG_ERR, "panic", "page fault at", addr);
+    kprint("\nKernel panic: page fault at ", red);
+    kprint_hex(addr, red);
+    kprint(" eip=", red);
+    kprint_hex(f->eip, red);
+    kprint(" err=", red);
+    kprint_hex(f->err_code, red);
+    kput_char('\n', red);
+    console_flush();
+    serial_flush();
+    for (;;) __asm__ volatile("cli; hlt");
+}
+
+void fs_munmap(void* addr);
+
+static int mmap_vrange_free(uint32_t first, uint32_t count) {
+    for (uint32_t p = first; p < first + count; p++)
+        if (mmap_vbitmap[p / 8] & (1 << (p % 8))) return 0;
+    return 1;
+}
+
+static void mmap_vrange_mark(uint32_t first, uint32_t count, int used) {
+    for (uint32_t p = first; p < first + count; p++) {
+        if (used) mmap_vbitmap[p / 8] |= 1 << (p % 8);
+        else      mmap_vbitmap[p / 8] &= ~(1 << (p % 8));
+    }
+}
+
+static void* fs_mmap_nolock(const char* name, uint32_t* size_out, int flags) {
+    int fi = -1;
+    for (int i = 0; i < MAX_FILES; i++) {
+        if (files[i].used && strcmp(files[i].name, name) == 1) { fi = i; break; }
+    }
+    if (fi < 0) return NULL;
+
+    FileMapping* m = NULL;
+    for (int i = 0; i < MAX_MAPPINGS; i++) {
+        if (!mappings[i].used) { m = &mappings[i]; break; }
+    }
+    if (!m) {
+        klog(KLOG_WARN, "mmap", "too many mappings!");
+        kprint("fs_mmap: too many mappings!\n", (os_color & 0xF0) | 0x0C);
+        return NULL;
+    }
+
+    uint32_t pages = (files[fi].size + 1 + PAGE_SIZE - 1) / PAGE_SIZE;
+    uint32_t first = 0;
+    while (first + pages <= MMAP_PAGES && !mmap_vrange_free(first, pages)) first++;
+    if (first + pages > MMAP_PAGES) {
+        klog(KLOG_WARN, "mmap", "address space exhausted!");
+        kprint("fs_mmap: address space exhausted!\n", (os_color & 0xF0) | 0x0C);
+        return NULL;
+    }
+    mmap_vrange_mark(first, pages, 1);
+
+    m->vaddr = MMAP_BASE + first * PAGE_SIZE;
+    m->pages = pages;
+    m->lba = files[fi].start;
+    m->size = files[fi].size;
+    m->sectors = (files[fi].size + 511) / 512;
+    m->flags = flags;
+    m->used = 1; // last: page faults of other threads may look at it right away
+
+    if (flags & FS_MAP_POPULATE) {
+        for (uint32_t p = 0; p < pages; p++) {
+            if (!mmap_fault_in(m, m->vaddr + p * PAGE_SIZE)) {
+                klog(KLOG_WARN, "mmap", "out of memory!");
+                kprint("fs_mmap: out of memory!\n", (os_color & 0xF0) | 0x0C);
+                fs_munmap((void*)m->vaddr);
+                return NULL;
+            }
+        }
+    }
+
+    if (size_out) *size_out = m->size;
+    return (void*)m->vaddr;
+}
+
+// Maps file `name` into the mmap window. Nothing is read until a page is touched
+// (unless FS_MAP_POPULATE is set). The mapping always ends with at least one zero
+// byte past the file data, so text files can be used as C strings in place.
+void* fs_mmap(const char* name, uint32_t* size_out, int flags) {
+    mutex_lock(&fs_lock);
+    void* p = fs_mmap_nolock(name, size_out, flags);
+    mutex_unlock(&fs_lock);
+    return p;
+}
+
+// Dirty bits are cleared (and flushed from every CPU's TLB, once) before the
+// pages are written, so a store that lands during the write marks the page
+// dirty again instead of getting lost. The writes run with mmap_lock released
+// and interrupts on: a PAGE_WB page stays mapped, eviction skips it and
+// fs_lock keeps fs_munmap away.
+static int fs_msync_nolock(void* addr) {
+    FileMapping* m = mmap_find((uint32_t)addr);
+    if (!m) return 0;
+    if (!(m->flags & FS_MAP_SHARED)) return 1;
+
+    uint32_t flags = spin_lock_irqsave(&mmap_lock);
+    int any = 0;
+    for (uint32_t p = 0; p < m->pages; p++) {
+        uint32_t vaddr = m->vaddr + p * PAGE_SIZE;
+        uint32_t* pte = mmap_pte(vaddr, 0);
+        if (!pte || (*pte & (PAGE_PRESENT | PAGE_DIRTY)) != (PAGE_PRESENT | PAGE_DIRTY)) continue;
+        *pte = (*pte & ~PAGE_DIRTY) | PAGE_WB;
+        invlpg(vaddr);
+        any = 1;
+    }
+    if (any) tlb_shootdown();
+    spin_unlock_irqrestore(&mmap_lock, flags);
+
+    int ok = 1;
+    for (uint32_t p = 0; any && p < m->pages; p++) {
+        flags = spin_lock_irqsave(&mmap_lock);
+        uint32_t* pte = mmap_pte(m->vaddr + p * PAGE_SIZE, 0);
+        int wb = pte && (*pte & PAGE_WB);
+        uint8_t* frame = wb ? (uint8_t*)(*pte & ~0xFFFu) : NULL;
+        spin_unlock_irqrestore(&mmap_lock, flags);
+        if (!wb) continue;
+
+        int written = ok && mmap_write_page(m, p, frame);
+        flags = spin_lock_irqsave(&mmap_lock);
+        *pte &= ~PAGE_WB;
+        if (!written) {
+            *pte |= PAGE_DIRTY; // try again next time
+            ok = 0;
+        }
+        spin_unlock_irqrestore(&mmap_lock, flags);
+    }
+    if (!ok) kprint("fs_msync: write failed, pages kept dirty!\n", (os_color & 0xF0) | 0x0C);
+    return ok;
+}
+
+// writes every dirty page of a shared mapping back to disk
+int fs_msync(void* addr) {
+    mutex_lock(&fs_lock);
+    int ok = fs_msync_nolock(addr);
+    mutex_unlock(&fs_lock);
+    return ok;
+}
+
+// writes back every shared mapping of file `fi`, for readers that go to the
+// disk directly; fs_lock held
+static void fs_msync_file_nolock(int fi) {
+    for (int i = 0; i < MAX_MAPPINGS; i++) {
+        FileMapping* m = &mappings[i];
+        if (m->used && (m->flags & FS_MAP_SHARED) && m->lba == files[fi].start)
+            fs_msync_nolock((void*)m->vaddr);
+    }
+}
+
+void fs_munmap(void* addr) {
+    mutex_lock(&fs_lock);
+    FileMapping* m = mmap_find((uint32_t)addr);
+    if (!m) {
+        mutex_unlock(&fs_lock);
+        return;
+    }
+    fs_msync_nolock(addr);
+
+    // unmap every page (keeping the frame address in the not-present PTE),
+    // flush all CPUs once, and only then give the frames back
+    uint32_t flags = spin_lock_irqsave(&mmap_lock);
+    m->used = 0;
+    for (uint32_t p = 0; p < m->pages; p++) { // let faults and evictions under way finish
+        uint32_t* pte = mmap_pte(m->vaddr + p * PAGE_SIZE, 0);
+        while (pte && (*pte & PAGE_BUSY)) mmap_wait_busy();
+    }
+    for (uint32_t p = 0; p < m->pages; p++) {
+        uint32_t vaddr = m->vaddr + p * PAGE_SIZE;
+        uint32_t* pte = mmap_pte(vaddr, 0);
+        if (!pte || !(*pte & PAGE_PRESENT)) continue;
+        *pte &= ~PAGE_PRESENT;
+        invlpg(vaddr);
+    }
+    tlb_shootdown();
+    for (uint32_t p = 0; p < m->pages; p++) {
+        uint32_t* pte = mmap_pte(m->vaddr + p * PAGE_SIZE, 0);
+        if (!pte || !*pte) continue;
+        frame_free((void*)(*pte & ~0xFFFu));
+        *pte = 0;
+    }
+    spin_unlock_irqrestore(&mmap_lock, flags);
+    mmap_vrange_mark((m->vaddr - MMAP_BASE) / PAGE_SIZE, m->pages, 0);
+    mutex_unlock(&fs_lock);
+}
+
+// ----------------- persistent shell history -----------------
+// Every command that makes it into the history ring is appended to
+// history.txt, one per line. The file is only read back the first time the
+// user actually browses history (Up or Ctrl-R), which also picks up whatever
+// this session has appended so far.
+#define HISTORY_FILE "history.txt"
+#define HISTORY_LOG_MAX (4 * HISTORY_ARENA_SIZE) // rewrite the file past this
+
+int history_persist = 1;
+
+void history_log(const char* line, uint32_t len) {
+    if (!history_persist || !sector_bitmap) return;
+    char tmp[MAX_CMD_LEN + 1];
+    memcpy(tmp, line, len);
+    tmp[len] = '\n';
+    if (!fs_append_file(HISTORY_FILE, tmp, len + 1)) {
+        // keep the disk out of it from now on, the in-memory ring still works
+        history_persist = 0;
+        klog(KLOG_WARN, "history", "can't write " HISTORY_FILE);
+        kprint("history: can't write " HISTORY_FILE "!\n", (os_color & 0xF0) | 0x0C);
+    }
+}
+
+// rewrites the log with just what's in the ring
+static void history_compact(void) {
+    ArenaMark mark = scratch_mark();
+    char* out = scratch_alloc(HISTORY_ARENA_SIZE + HISTORY_MAX);
+    if (out) {
+        uint32_t n = 0;
+        for (uint32_t i = history_first; i != history_next; i++) {
+            uint32_t len = history_ring[i % HISTORY_MAX].len;
+            memcpy(out + n, history_get(i), len);
+            n += len;
+            out[n++] = '\n';
+        }
+        fs_write_data(HISTORY_FILE, out, n);
+    }
+    scratch_release(mark);
+}
+
+// history_lock held, so no other shell pushes or browses while the ring is
+// cleared and refilled
+void history_load(void) {
+    history_loaded = 1;
+    if (!history_persist) return;
+
+    uint32_t size;
+    char* text = fs_mmap(HISTORY_FILE, &size, FS_MAP_PRIVATE);
+    if (!text) return; // nothing saved yet, keep what this session has
+
+    history_clear();
+    char* line = text;
+    for (char* p = text; p < text + size; p++) {
+        if (*p != '\n') continue;
+        history_push(line, p - line);
+        line = p + 1;
+    }
+    fs_munmap(text);
+
+    if (size > HISTORY_LOG_MAX) history_compact();
+}
+
+// ----------------- kernel log on disk -----------------
+// klogd wakes up every KLOG_FLUSH_MS and appends whatever was logged since its
+// last round to dmesg.txt in one fs_append_file, so code that logs never waits
+// for the disk (or for fs_lock, which would order it against ata_lock and the
+// console). An ATA error during the append is just one more record for the
+// next round; if the append itself fails klogd stops writing, like history.
+#define KLOG_FILE "dmesg.txt"
+#define KLOG_FLUSH_MS 2000
+#define KLOG_FILE_MAX (256 * 1024)  // cut down to the newest half at boot past this
+#define KLOG_LINE 160               // longest line klog_format makes
+
+uint32_t klog_saved = 0;            // records before this are in the file (or lost)
+int klog_persist = 1;
+Mutex klog_lock;                    // klogd and exit both flush
+
+// "[   12.345678] warn smp: ..." with a newline, returns the length
+static uint32_t klog_format(const KlogRecord* r, char* out) {
+    char* p = out;
+    *p++ = '[';
+    if (tsc_khz && r->tsc) {
+        uint64_t us = div64_32((r->tsc - boot_tsc_entry) * 1000, tsc_khz);
+        uint32_t sec = (uint32_t)div64_32(us, 1000000);
+        uint32_t frac = (uint32_t)(us - (uint64_t)sec * 1000000);
+        char tmp[12];
+        int n = 0;
+        do { tmp[n++] = '0' + sec % 10; sec /= 10; } while (sec);
+        for (int pad = n; pad < 5; pad++) *p++ = ' ';
+        while (n) *p++ = tmp[--n];
+        *p++ = '.';
+        for (uint32_t d = 100000; d; d /= 10) *p++ = '0' + frac / d % 10;
+    } else {
+        memcpy(p, "    ?.??????", 12); // before the TSC was calibrated, or none
+        p += 12;
+    }
+    *p++ = ']';
+    *p++ = ' ';
+    memcpy(p, r->level <= KLOG_ERR ? "err  " : r->level == KLOG_WARN ? "warn " : "info ", 5);
+    p += 5;
+    uint32_t n = strlen(r->tag);
+    memcpy(p, r->tag, n);
+    p += n;
+    *p++ = ':';
+    *p++ = ' ';
+    memcpy(p, r->text, r->len);
+    p += r->len;
+    *p++ = '\n';
+    return p - out;
+}
+
+// appends the records logged since the last call to dmesg.txt
+void klog_flush(void) {
+    if (!klog_persist || !sector_bitmap) return;
+    mutex_lock(&klog_lock);
+    ArenaMark mark = scratch_mark();
+    char* out = scratch_alloc(KLOG_RECORDS * KLOG_LINE + 64);
+    uint32_t end = klog_next, i = klog_saved, n = 0;
+    if (out) {
+        if (end - i > KLOG_RECORDS) { // logged faster than klogd wrote
+            i = end - KLOG_RECORDS;
+            memcpy(out, "[ some records were lost ]\n", 27);
+            n = 27;
+        }
+        for (; i != end; i++) {
+            KlogRecord r;
+            int got = klog_read(i, &r);
+            if (got < 0) break;       // still being written, next round
+            if (got) n += klog_format(&r, out + n);
+        }
+        klog_saved = i;
+        if (n && !fs_append_file(KLOG_FILE, out, n)) {
+            klog_persist = 0;
+            klog(KLOG_WARN, "dmesg", "can't write " KLOG_FILE);
+            kprint("dmesg: can't write " KLOG_FILE "!\n", (os_color & 0xF0) | 0x0C);
+        }
+    }
+    scratch_release(mark);
+    mutex_unlock(&klog_lock);
+}
+
+// keeps dmesg.txt from growing forever: past KLOG_FILE_MAX only the newest
+// half (from a line start) is kept
+static void klog_trim(void) {
+    uint32_t size;
+    char* text = fs_mmap(KLOG_FILE, &size, FS_MAP_PRIVATE);
+    if (!text) return;
+    if (size <= KLOG_FILE_MAX) {
+        fs_munmap(text);
+        return;
+    }
+    ArenaMark mark = scratch_mark();
+    const char* from = text + size - KLOG_FILE_MAX / 2;
+    const char* nl = memchr(from, '\n', text + size - from);
+    uint32_t len = nl ? text + size - nl - 1 : 0;
+    char* keep = scratch_alloc(len + 1);
+    if (keep && nl) memcpy(keep, nl + 1, len);
+    fs_munmap(text); // before the file moves under the mapping
+    if (keep && nl) fs_write_data(KLOG_FILE, keep, len);
+    scratch_release(mark);
+}
+
+static void klogd_main(void* arg) {
+    (void)arg;
+    this_thread()->service = 1;
+    klog_trim();
+    for (;;) {
+        sleep_ms(KLOG_FLUSH_MS);
+        klog_flush();
+    }
+}
+
+// ----------------- ZurOS writer -----------------
+// The document is a gap buffer: the text before the cursor sits at the start
+// of zw_buf, the text after it at the end and the gap in between, so typing is
+// one store and moving the cursor moves only the bytes it passes. The file is
+// fs_mmap'd and copied into the buffer a chunk at a time as the cursor gets
+// there; what it hasn't reached yet is read from the mapping, which only
+// faults in the pages that are shown.
+//
+// Only rows an edit, a cursor move or a scroll touched get redrawn. Saving
+// writes the sectors between the first and the last changed byte, or from the
+// first one to the end when the length changed, since everything after moved.
+#define ZW_ROWS ((uint32_t)con_rows - 2) // then a status row and a message row
+#define ZW_COLS ((uint32_t)con_cols)
+#define ZW_CHUNK (16 * 1024)        // loaded from the file at a time
+
+char* zw_buf = NULL;
+uint32_t zw_cap = 0;
+uint32_t zw_gap_start = 0;          // also the cursor
+uint32_t zw_gap_end = 0;
+char* zw_file = NULL;               // the mapping, NULL once it's all in zw_buf
+uint32_t zw_file_len = 0;
+uint32_t zw_loaded = 0;             // bytes of the mapping copied into zw_buf
+
+uint32_t zw_top = 0;                // offset of the first row on screen
+uint32_t zw_top_line = 0;
+uint32_t zw_line = 0;               // where the cursor is
+uint32_t zw_col = 0;
+uint32_t zw_want_col = 0;           // up and down stay in this column if they can
+uint32_t zw_left = 0;               // first column on screen
+uint8_t zw_dirty[CON_MAX_ROWS];
+
+uint32_t zw_disk_len = 0;           // size of the file as saved
+uint32_t zw_edit_lo = 0;            // bytes [zw_edit_lo, len - zw_keep_tail) differ from disk
+uint32_t zw_keep_tail = 0;
+int zw_modified = 0;
+
+static inline uint32_t zw_buf_len(void) {
+    return zw_cap - (zw_gap_end - zw_gap_start);
+}
+
+static inline uint32_t zw_len(void) {
+    return zw_buf_len() + (zw_file_len - zw_loaded);
+}
+
+static char zw_at(uint32_t i) {
+    if (i < zw_gap_start) return zw_buf[i];
+    uint32_t n = zw_buf_len();
+    if (i < n) return zw_buf[i + zw_gap_end - zw_gap_start];
+    return zw_file[zw_loaded + i - n];
+}
+
+// makes the gap at least `n` bytes
+static int zw_reserve(uint32_t n) {
+    if (zw_gap_end - zw_gap_start >= n) return 1;
+    uint32_t len = zw_buf_len();
+    uint32_t cap = zw_cap ? zw_cap * 2 : 4096;
+    while (cap - len < n) cap *= 2;
+    char* buf = kmalloc(cap);
+    if (!buf) return 0;
+
+    uint32_t tail = zw_cap - zw_gap_end;
+    memcpy(buf, zw_buf, zw_gap_start);
+    memcpy(buf + cap - tail, zw_buf + zw_gap_end, tail);
+    kfree(zw_buf);
+    zw_buf = buf;
+    zw_gap_end = cap - tail;
+    zw_cap = cap;
+    return 1;
+}
+
+// puts the gap at `pos`, which has to be loaded already
+static void zw_move_gap(uint32_t pos) {
+    if (pos < zw_gap_start) {
+        uint32_t n = zw_gap_start - pos;
+        memmove(zw_buf + zw_gap_end - n, zw_buf + pos, n);
+        zw_gap_start -= n;
+        zw_gap_end -= n;
+    } else if (pos > zw_gap_start) {
+        uint32_t n = pos - zw_gap_start;
+        memmove(zw_buf + zw_gap_start, zw_buf + zw_gap_end, n);
+        zw_gap_start += n;
+        zw_gap_end += n;
+    }
+}
+
+// copies the file into the buffer until at least `upto` bytes are there
+static int zw_load(uint32_t upto) {
+    while (zw_file && zw_buf_len() < upto) {
+        uint32_t chunk = zw_file_len - zw_loaded;
+        if (chunk > ZW_CHUNK) chunk = ZW_CHUNK;
+        if (!zw_reserve(chunk)) return 0;
+
+        uint32_t cursor = zw_gap_start;
+        zw_move_gap(zw_buf_len());
+        memcpy(zw_buf + zw_gap_start, zw_file + zw_loaded, chunk);
+        zw_gap_start += chunk;
+        zw_loaded += chunk;
+        zw_move_gap(cursor);
+
+        if (zw_loaded == zw_file_len) {
+            fs_munmap(zw_file);
+            zw_file = NULL;
+        }
+    }
+    return 1;
+}
+
+// offset of the first '\n' at or after `from`, zw_len() if there's none
+static uint32_t zw_find_nl(uint32_t from) {
+    uint32_t n = zw_buf_len();
+    uint32_t gap = zw_gap_end - zw_gap_start;
+    const char* p;
+    if (from < zw_gap_start) {
+        p = memchr(zw_buf + from, '\n', zw_gap_start - from);
+        if (p) return p - zw_buf;
+        from = zw_gap_start;
+    }
+    if (from < n) {
+        p = memchr(zw_buf + gap + from, '\n', n - from);
+        if (p) return p - zw_buf - gap;
+        from = n;
+    }
+    if (zw_file && from - n < zw_file_len - zw_loaded) {
+        const char* rest = zw_file + zw_loaded;
+        p = memchr(rest + (from - n), '\n', zw_file_len - zw_loaded - (from - n));
+        if (p) return n + (p - rest);
+    }
+    return zw_len();
+}
+
+static uint32_t zw_line_start(uint32_t pos) {
+    while (pos > 0 && zw_at(pos - 1) != '\n') pos--;
+    return pos;
+}
+
+static void zw_dirty_from(uint32_t line) {
+    for (uint32_t r = line < zw_top_line ? 0 : line - zw_top_line; r < ZW_ROWS; r++)
+        zw_dirty[r] = 1;
+}
+
+static void zw_dirty_line(uint32_t line) {
+    if (line >= zw_top_line && line - zw_top_line < ZW_ROWS)
+        zw_dirty[line - zw_top_line] = 1;
+}
+
+// moves the cursor to `pos` on line `line`, then scrolls it into view
+static void zw_goto(uint32_t pos, uint32_t line) {
+    if (!zw_load(pos)) return;
+    zw_dirty_line(zw_line);
+    zw_move_gap(pos);
+    zw_line = line;
+    zw_col = pos - zw_line_start(pos);
+
+    while (zw_line < zw_top_line) {
+        zw_top = zw_line_start(zw_top - 1);
+        zw_top_line--;
+        zw_dirty_from(0);
+    }
+    while (zw_line >= zw_top_line + ZW_ROWS) {
+        zw_top = zw_find_nl(zw_top) + 1;
+        zw_top_line++;
+        zw_dirty_from(0);
+    }
+    if (zw_col < zw_left || zw_col >= zw_left + ZW_COLS) {
+        zw_left = zw_col < ZW_COLS ? 0 : zw_col - ZW_COLS / 2;
+        zw_dirty_from(0);
+    }
+    zw_dirty_line(zw_line);
+}
+
+// bytes [pos, pos + inserted) changed, the text is now `len` long
+static void zw_edited(uint32_t pos, uint32_t inserted) {
+    uint32_t len = zw_len();
+    if (pos < zw_edit_lo) zw_edit_lo = pos;
+    if (len - pos - inserted < zw_keep_tail) zw_keep_tail = len - pos - inserted;
+    zw_modified = 1;
+}
+
+static void zw_insert(char c) {
+    if (!zw_reserve(1)) return;
+    uint32_t pos = zw_gap_start;
+    zw_buf[zw_gap_start++] = c;
+    zw_edited(pos, 1);
+    if (c == '\n') {
+        zw_dirty_from(zw_line);
+        zw_goto(pos + 1, zw_line + 1);
+    } else {
+        zw_goto(pos + 1, zw_line);
+    }
+}
+
+// deletes the character after the cursor
+static void zw_delete(void) {
+    uint32_t pos = zw_gap_start;
+    if (pos >= zw_len() || !zw_load(pos + 1)) return;
+    if (zw_buf[zw_gap_end] == '\n') zw_dirty_from(zw_line);
+    zw_gap_end++;
+    zw_edited(pos, 0);
+    zw_goto(pos, zw_line);
+}
+
+static void zw_backspace(void) {
+    uint32_t pos = zw_gap_start;
+    if (pos == 0) return;
+    int newline = zw_buf[pos - 1] == '\n';
+    zw_goto(pos - 1, newline ? zw_line - 1 : zw_line);
+    zw_delete();
+}
+
+static void zw_up(void) {
+    if (zw_line == 0) return;
+    uint32_t start = zw_line_start(zw_line_start(zw_gap_start) - 1);
+    uint32_t end = zw_find_nl(start);
+    uint32_t col = end - start < zw_want_col ? end - start : zw_want_col;
+    zw_goto(start + col, zw_line - 1);
+}
+
+static void zw_down(void) {
+    uint32_t eol = zw_find_nl(zw_gap_start);
+    if (eol >= zw_len()) return;
+    uint32_t start = eol + 1;
+    uint32_t end = zw_find_nl(start);
+    uint32_t col = end - start < zw_want_col ? end - start : zw_want_col;
+    zw_goto(start + col, zw_line + 1);
+}
+
+static void zw_draw(void) {
+    uint32_t flags = console_acquire();
+    uint32_t len = zw_len();
+    uint32_t pos = zw_top;
+    uint32_t cursor_row = zw_line - zw_top_line;
+    for (uint32_t r = 0; r < ZW_ROWS; r++) {
+        int past_end = pos > len;
+        uint32_t eol = past_end ? len : zw_find_nl(pos);
+        if (zw_dirty[r]) {
+            uint16_t* row = con_row(r);
+            con_touch(r);
+            for (uint32_t x = 0; x < ZW_COLS; x++) {
+                uint32_t i = pos + zw_left + x;
+                uint8_t c = !past_end && i < eol ? (uint8_t)zw_at(i) : ' ';
+                if (c < ' ') c = ' ';
+                row[x] = (os_color << 8) | c;
+            }
+            if (r == cursor_row) {
+                uint32_t x = zw_col - zw_left;
+                uint8_t swapped = (os_color << 4) | (os_color >> 4);
+                row[x] = (swapped << 8) | (row[x] & 0xFF);
+            }
+            zw_dirty[r] = 0;
+        }
+        pos = eol + 1;
+    }
+    console_release(flags);
+}
+
+// the status row, and `msg` (or nothing) under it
+static void zw_status(const char* filename, const char* msg, uint8_t msg_color) {
+    char s[CON_MAX_COLS + 1];
+    char num[11];
+    int n = 0;
+    const char* parts[] = { "## ", filename, zw_modified ? " *" : "", "  line ", NULL, "  col ", NULL,
+                            "  ## Esc: save and leave, Ctrl-S: save, Ctrl-Q: leave without saving" };
+    for (uint32_t i = 0; i < sizeof(parts) / sizeof(parts[0]); i++) {
+        const char* p = parts[i];
+        if (!p) {
+            uint32_t v = i == 4 ? zw_line + 1 : zw_col + 1;
+            int k = 10;
+            num[k] = '\0';
+            do num[--k] = '0' + v % 10; while ((v /= 10) && k);
+            p = num + k;
+        }
+        while (*p && n < con_cols) s[n++] = *p++;
+    }
+    while (n < con_cols) s[n++] = ' ';
+    s[n] = '\0';
+    kprintnf(s, (os_color & 0xF0) | 0x09, ZW_ROWS);
+
+    char blank[CON_MAX_COLS + 1];
+    memset(blank, ' ', con_cols);
+    blank[con_cols] = '\0';
+    kprintnf(blank, os_color, ZW_ROWS + 1);
+    if (msg) kprintnf(msg, msg_color, ZW_ROWS + 1);
+}
+
+// writes the changed sectors, returns 0 if the disk or memory said no
+static int zw_save(const char* filename) {
+    uint32_t len = zw_len();
+    uint32_t lo = zw_edit_lo, hi = len - zw_keep_tail;
+    mutex_lock(&fs_lock);
+    int exists = fs_find(filename) >= 0;
+    mutex_unlock(&fs_lock);
+    if (!exists) {
+        lo = 0;                     // new file, all of it
+        hi = len;
+    } else if (len != zw_disk_len) {
+        hi = len;                   // everything after the edit moved
+    } else if (lo >= hi) {
+        zw_modified = 0;
+        return 1;                   // changed back to what's on disk
+    }
+    lo &= ~511u;
+    hi = (hi + 511) & ~511u;
+    if (hi > len) hi = len;
+
+    // the rest of the file is about to move (maybe to other sectors), so
+    // nothing may come from the mapping after this
+    if (len != zw_disk_len && !zw_load(len)) return 0;
+
+    char* data = kmalloc(hi - lo + 1);
+    if (!data) return 0;
+    for (uint32_t i = lo; i < hi; i++)
+        data[i - lo] = zw_at(i);
+    int ok = fs_write_range(filename, len, lo, data, hi - lo);
+    kfree(data);
+
+    if (ok) {
+        zw_disk_len = len;
+        zw_edit_lo = len;
+        zw_keep_tail = len;
+        zw_modified = 0;
+    }
+    return ok;
+}
+
+static int zw_open(const char* filename) {
+    zw_buf = NULL;
+    zw_cap = zw_gap_start = zw_gap_end = 0;
+    zw_file = fs_mmap(filename, &zw_file_len, FS_MAP_PRIVATE);
+    if (!zw_file) zw_file_len = 0;
+    zw_loaded = 0;
+    if (zw_file_len == 0 && zw_file) {
+        fs_munmap(zw_file);
+        zw_file = NULL;
+    }
+
+    zw_top = zw_top_line = zw_line = zw_col = zw_want_col = zw_left = 0;
+    zw_disk_len = zw_edit_lo = zw_keep_tail = zw_file_len;
+    zw_modified = 0;
+    return zw_reserve(ZW_CHUNK) && zw_load(1);
+}
+
+static void zw_close(void) {
+    if (zw_file) fs_munmap(zw_file);
+    zw_file = NULL;
+    kfree(zw_buf);
+    zw_buf = NULL;
+    zw_cap = zw_gap_start = zw_gap_end = 0;
+}
+
+// zw takes over the whole console; what the shell had on it is kept here and
+// put back when it's done instead of leaving a cleared screen behind
+typedef struct {
+    int x, y;                       // the cursor
+    uint16_t rows[CON_MAX_ROWS][CON_MAX_COLS];
+} ZwScreen;
+
+int zw_running = 0;                 // the editor state above is global, one zw at a time
+
+static ZwScreen* zw_screen_keep(void) {
+    ZwScreen* s = kmalloc(sizeof(ZwScreen));
+    if (!s) return NULL;
+    uint32_t flags = console_acquire();
+    for (int y = 0; y < con_rows; y++)
+        memcpy(s->rows[y], con_row(y), con_cols * 2);
+    s->x = cursor_x;
+    s->y = cursor_y;
+    console_release(flags);
+    return s;
+}
+
+static void zw_screen_restore(ZwScreen* s) {
+    if (!s) {
+        kclear();
+        return;
+    }
+    uint32_t flags = console_acquire();
+    for (int y = 0; y < con_rows; y++) {
+        memcpy(con_row(y), s->rows[y], con_cols * 2);
+        con_touch(y);
+    }
+    cursor_x = s->x;
+    cursor_y = s->y;
+    console_release(flags);
+    kfree(s);
+}
+
+void zuros_writer(const char* filename) {
+    if (__atomic_exchange_n(&zw_running, 1, __ATOMIC_ACQUIRE)) {
+        kprint("zw is already open on another console!\n", (os_color & 0xF0) | 0x0C);
+        return;
+    }
+    if (!zw_open(filename)) {
+        zw_close();
+        __atomic_store_n(&zw_running, 0, __ATOMIC_RELEASE);
+        kprint("Out of memory!\n", (os_color & 0xF0) | 0x0C);
+        return;
+    }
+
+    ZwScreen* screen = zw_screen_keep();
+    kclear();
+    zw_dirty_from(0);
+    const char* msg = NULL;
+    uint8_t msg_color = os_color;
+    int extended = 0;
+
+    for (;;) {
+        zw_draw();
+        zw_status(filename, msg, msg_color);
+        msg = NULL;
+
+        uint8_t sc = read_scancode();
+        if (sc == 0xE0) {
+            extended = 1;
+            continue;
+        }
+        if (extended) {
+            extended = 0;
+            uint32_t pos = zw_gap_start;
+            switch (sc) {
+            case 0x48: zw_up(); break;                                  // Up
+            case 0x50: zw_down(); break;                                // Down
+            case 0x4B:                                                  // Left
+                if (pos > 0) zw_goto(pos - 1, zw_at(pos - 1) == '\n' ? zw_line - 1 : zw_line);
+                zw_want_col = zw_col;
+                break;
+            case 0x4D:                                                  // Right
+                if (pos < zw_len()) zw_goto(pos + 1, zw_at(pos) == '\n' ? zw_line + 1 : zw_line);
+                zw_want_col = zw_col;
+                break;
+            case 0x47:                                                  // Home
+                zw_goto(zw_line_start(pos), zw_line);
+                zw_want_col = 0;
+                break;
+            case 0x4F:                                                  // End
+                zw_goto(zw_find_nl(pos), zw_line);
+                zw_want_col = zw_col;
+                break;
+            case 0x49:                                                  // Page Up
+                for (uint32_t i = 0; i < ZW_ROWS - 1; i++) zw_up();
+                break;
+            case 0x51:                                                  // Page Down
+                for (uint32_t i = 0; i < ZW_ROWS - 1; i++) zw_down();
+                break;
+            case 0x53:                                                  // Delete
+                zw_delete();
+                break;
+            }
+            continue;
+        }
+
+        if (ctrl_pressed && (sc == 0x1F || sc == 0x10)) {               // Ctrl-S, Ctrl-Q
+            if (sc == 0x10) break;
+            int ok = zw_save(filename);
+            msg = ok ? "Saved." : "Can't save the file!";
+            msg_color = ok ? (os_color & 0xF0) | 0x0A : (os_color & 0xF0) | 0x0C;
+            continue;
+        }
+
+        char c = scancode_to_ascii(sc);
+        if (!c || ctrl_pressed) continue;
+        if (c == 27) {                                                  // Esc
+            if (!zw_modified || zw_save(filename)) break;
+            msg = "Can't save the file! Ctrl-Q leaves without saving.";
+            msg_color = (os_color & 0xF0) | 0x0C;
+            continue;
+        }
+        if (c == '\b') zw_backspace();
+        else if (c == '\t') for (int i = 0; i < 4; i++) zw_insert(' ');
+        else zw_insert(c);
+        zw_want_col = zw_col;
+    }
+
+    zw_close();
+    __atomic_store_n(&zw_running, 0, __ATOMIC_RELEASE);
+    zw_screen_restore(screen);
+}
+
+typedef void (*command_func_t)(const char*);
+
+typedef struct {
+    const char* name;
+    command_func_t func;
+} Commands;
+
+typedef struct {
+    char name[16];
+    char* content;       // pinned private mapping of the old file
+} SavedFile;
+
+SavedFile* saved_files;
+int saved_count = 0;
+
+// Save all files into memory and delete them
+void backup_and_delete_all_files() {
+    fs_load();
+    saved_count = 0;
+
+    int used = 0;
+    for (int i = 0; i < MAX_FILES; i++)
+        if (files[i].used) used++;
+    kfree(saved_files);
+    saved_files = kmalloc(used * sizeof(SavedFile));
+    if (!saved_files) return;
+
+    for (int i = 0; i < MAX_FILES; i++) {
+        if (files[i].used) {
+            // Store name
+            strncpy(saved_files[saved_count].name, files[i].name, 16);
+
+            // Map the whole file and pin it, its sectors are about to be reused
+            saved_files[saved_count].content = fs_mmap(files[i].name, NULL, FS_MAP_PRIVATE | FS_MAP_POPULATE);
+            if (!saved_files[saved_count].content) continue;
+
+            saved_count++;
+
+            // Delete the file from FS
+            fs_delete_file(files[i].name);
+        }
+    }
+}
+
+// Restore all files from memory
+void restore_all_files() {
+    for (int i = 0; i < saved_count; i++) {
+        fs_write_file(saved_files[i].name, saved_files[i].content);
+        fs_munmap(saved_files[i].content);
+    }
+    kfree(saved_files);
+    saved_files = NULL;
+    saved_count = 0;
+}
+
+void handle_command(char* buffer);
+
+// ----------------- Shell variables adsgfadgad -----------------
+
+#define MAX_VAR_NAME 32
+#define MAX_VAR_VALUE 256
+
+typedef enum { VAR_INT, VAR_STR } VarType;
+
+typedef struct {
+    const char* name;    // interned, so names compare by pointer
+    uint16_t scope;      // 0 = global, nested zscripts get 1, 2, ...
+    uint8_t type;        // VarType
+    int int_value;
+    char* str_value;     // kmalloc'd, exactly as long as the value
+} Variable;
+
+// ----------------- interned names -----------------
+// Every distinct name is stored once, in chunks that are never freed, and
+// found again through an open-addressing set of pointers.
+#define INTERN_CHUNK 4096
+
+const char** intern_set = NULL;
+uint32_t intern_cap = 0;         // power of two
+uint32_t intern_count = 0;
+char* intern_chunk = NULL;
+uint32_t intern_chunk_used = INTERN_CHUNK;
+
+static uint32_t name_hash(const char* s, uint32_t len) {
+    uint32_t h = 2166136261u; // FNV-1a
+    for (uint32_t i = 0; i < len; i++) {
+        h ^= (uint8_t)s[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static int intern_grow(void) {
+    uint32_t cap = intern_cap ? intern_cap * 2 : 64;
+    const char** set = kmalloc(cap * sizeof(char*));
+    if (!set) return 0;
+    memset(set, 0, cap * sizeof(char*));
+    for (uint32_t i = 0; i < intern_cap; i++) {
+        const char* s = intern_set[i];
+        if (!s) continue;
+        uint32_t h = name_hash(s, strlen(s)) & (cap - 1);
+        while (set[h]) h = (h + 1) & (cap - 1);
+        set[h] = s;
+    }
+    kfree(intern_set);
+    intern_set = set;
+    intern_cap = cap;
+    return 1;
+}
+
+// the one stored copy of `name`, with `add` it gets stored if it's new
+const char* intern(const char* name, int add) {
+    uint32_t len = strlen(name);
+    if (intern_cap) {
+        uint32_t h = name_hash(name, len) & (intern_cap - 1);
+        while (intern_set[h]) {
+            if (strcmp(intern_set[h], name) == 1) return intern_set[h];
+            h = (h + 1) & (intern_cap - 1);
+        }
+    }
+    if (!add) return NULL;
+
+    if ((intern_count + 1) * 4 > intern_cap * 3 && !intern_grow()) return NULL;
+    if (intern_chunk_used + len + 1 > INTERN_CHUNK) {
+        intern_chunk = kmalloc(INTERN_CHUNK);
+        if (!intern_chunk) return NULL;
+        intern_chunk_used = 0;
+    }
+    char* s = intern_chunk + intern_chunk_used;
+    memcpy(s, name, len + 1);
+    intern_chunk_used += len + 1;
+
+    uint32_t h = name_hash(name, len) & (intern_cap - 1);
+    while (intern_set[h]) h = (h + 1) & (intern_cap - 1);
+    intern_set[h] = s;
+    intern_count++;
+    return s;
+}
+
+// ----------------- variable table -----------------
+// Open addressing keyed by (name, scope). Slots hold pointers so a Variable
+// never moves when the table grows, which lets the zscript VM keep them.
+#define VAR_TOMBSTONE ((Variable*)1)
+
+Variable** var_table = NULL;
+uint32_t var_cap = 0;            // power of two
+uint32_t var_count = 0;          // live entries
+uint32_t var_filled = 0;         // live entries + tombstones
+uint16_t var_scope_next = 1;     // scope ids are never reused while live, 0 is global
+Mutex var_lock;                  // the table is shared by every thread
+// each thread sees the global scope plus the scopes of the scripts it is
+// running, kept in its Thread (this_thread()->scopes)
+
+static inline uint32_t var_slot(const char* name, uint16_t scope) {
+    uint32_t h = (uint32_t)name * 2654435761u ^ scope * 40503u;
+    return (h ^ (h >> 16)) & (var_cap - 1);
+}
+
+static int var_grow(void) {
+    uint32_t cap = var_cap;
+    if (var_count * 2 >= var_cap) cap = var_cap ? var_cap * 2 : 64; // else just drop tombstones
+    Variable** table = kmalloc(cap * sizeof(Variable*));
+    if (!table) return 0;
+    memset(table, 0, cap * sizeof(Variable*));
+
+    Variable** old = var_table;
+    uint32_t old_cap = var_cap;
+    var_table = table;
+    var_cap = cap;
+    for (uint32_t i = 0; i < old_cap; i++) {
+        Variable* v = old[i];
+        if (!v || v == VAR_TOMBSTONE) continue;
+        uint32_t h = var_slot(v->name, v->scope);
+        while (var_table[h]) h = (h + 1) & (var_cap - 1);
+        var_table[h] = v;
+    }
+    kfree(old);
+    var_filled = var_count;
+    return 1;
+}
+
+static Variable* var_lookup(const char* name, uint16_t scope) {
+    if (!var_cap) return NULL;
+    uint32_t h = var_slot(name, scope);
+    for (Variable* v; (v = var_table[h]); h = (h + 1) & (var_cap - 1)) {
+        if (v != VAR_TOMBSTONE && v->name == name && v->scope == scope) return v;
+    }
+    return NULL;
+}
+
+// the innermost visible variable called `name`
+Variable* find_var(const char* name) {
+    mutex_lock(&var_lock);
+    Variable* v = NULL;
+    const char* n = intern(name, 0); // NULL: never seen, so no such variable
+    VarScopes* s = &this_thread()->scopes;
+    for (int i = s->depth - 1; n && i >= 0 && !v; i--)
+        v = var_lookup(n, s->ids[i]);
+    mutex_unlock(&var_lock);
+    return v;
+}
+
+// finds `name`, or adds it to the current scope
+static Variable* var_add(const char* name) {
+    Variable* v = find_var(name);
+    if (v) return v;
+
+    const char* n = intern(name, 1);
+    if (!n) return NULL;
+    if ((var_filled + 1) * 4 > var_cap * 3 && !var_grow()) return NULL;
+    v = kmalloc(sizeof(Variable));
+    if (!v) return NULL;
+    VarScopes* s = &this_thread()->scopes;
+    uint16_t scope = s->ids[s->depth - 1];
+    v->name = n;
+    v->scope = scope;
+    v->type = VAR_INT;
+    v->int_value = 0;
+    v->str_value = NULL;
+
+    uint32_t h = var_slot(n, scope);
+    while (var_table[h] && var_table[h] != VAR_TOMBSTONE) h = (h + 1) & (var_cap - 1);
+    if (!var_table[h]) var_filled++;
+    var_table[h] = v;
+    var_count++;
+    return v;
+}
+
+Variable* get_or_add_var(const char* name) {
+    mutex_lock(&var_lock);
+    Variable* v = var_add(name);
+    mutex_unlock(&var_lock);
+    return v;
+}
+
+// variables this thread creates from now on go away with var_scope_pop
+void var_scope_push(void) {
+    VarScopes* s = &this_thread()->scopes;
+    if (s->depth == VAR_MAX_NESTING) {
+        s->overflow++;
+        return;
+    }
+    mutex_lock(&var_lock);
+    uint16_t id = var_scope_next++;
+    if (var_scope_next == 0) var_scope_next = 1;
+    mutex_unlock(&var_lock);
+    s->ids[s->depth++] = id;
+}
+
+void var_scope_pop(void) {
+    VarScopes* s = &this_thread()->scopes;
+    if (s->overflow) {
+        s->overflow--;
+        return;
+    }
+    if (s->depth <= 1) return;
+    uint16_t id = s->ids[--s->depth];
+
+    mutex_lock(&var_lock);
+    for (uint32_t i = 0; i < var_cap; i++) {
+        Variable* v = var_table[i];
+        if (!v || v == VAR_TOMBSTONE || v->scope != id) continue;
+        kfree(v->str_value);
+        kfree(v);
+        var_table[i] = VAR_TOMBSTONE;
+        var_count--;
+    }
+    mutex_unlock(&var_lock);
+}
+
+void var_store_int(Variable* v, int value) {
+    kfree(v->str_value);
+    v->str_value = NULL;
+    v->type = VAR_INT;
+    v->int_value = value;
+}
+
+int var_store_str(Variable* v, const char* value) {
+    char* copy = kstrdup(value);
+    if (!copy) return 0;
+    kfree(v->str_value);
+    v->type = VAR_STR;
+    v->str_value = copy;
+    return 1;
+}
+
+Variable* set_var_int(const char* name, int value) {
+    mutex_lock(&var_lock);
+    Variable* v = var_add(name);
+    if (v) var_store_int(v, value);
+    mutex_unlock(&var_lock);
+    return v;
+}
+
+Variable* set_var_str(const char* name, const char* value) {
+    mutex_lock(&var_lock);
+    Variable* v = var_add(name);
+    if (v && !var_store_str(v, value)) v = NULL;
+    mutex_unlock(&var_lock);
+    return v;
+}
+
+// str, int and kprint go through the zscript compiler, typed or not
+enum { ZS_STMT_INT, ZS_STMT_STR, ZS_STMT_KPRINT };
+void zs_exec_single(int kind, char* text);
+
+void cmd_str(char* args) {
+    zs_exec_single(ZS_STMT_STR, args);
+}
+
+void cmd_int(char* args) {
+    zs_exec_single(ZS_STMT_INT, args);
+}
+
+// ----------------- Command functions -----------------
+void cmd_clear(char* args) {
+    (void)args;
+    kclear();
+}
+
+void cmd_help(char* args) {
+    (void)args;
+    kprint("ZurOS commands list:\n", (os_color & 0xF0) | 0x0A);
+    kprint("ascii - prints out an ascii art\n", os_color);
+    kprint("beep X Y - plays music from X notes (c-b) or pauses (x), for Yms (1000ms - 1s) separated by ':', for example: \"beep c 100: d 100: e 100: g 250: x 1000: c 100\"", os_color);
+    kprint("beep -wait X Y - the same, but waits until the music ends; beep -stop stops it\n", os_color);
+    kprint("boottime - shows how long each boot phase took\n", os_color);
+    kprint("bench libc - measures memcpy/memset/strlen/strchr/memcmp/memchr variants\n", os_color);
+    kprint("clear - clears the screen (also cls)\n", os_color);
+    kprint("color 0xXY - sets OS's color\n", os_color);
+    kprint("color -themes - shows color themes\n", os_color);
+    kprint("cpus - lists the CPUs and what each one is running\n", os_color);
+    kprint("dir - lists all files (also ls)\n", os_color);
+    kprint("dmesg - prints the kernel log (kept in dmesg.txt too)\n", os_color);
+    kprint("delete X - deletes file X (also rm)\n", os_color);
+    kprint("exit - shuts down computer\n", os_color);
+    kprint("grep [-v] [-c] X [file] - prints the lines with X in them (-v: without, -c: just count them)\n", os_color);
+    kprint("head [-n N] [file] - prints the first N (10) lines\n", os_color);
+    kprint("int X = Y - sets X integer variable to Y", os_color);
+    kprint("jobs - lists background jobs (start one by ending a command with &)\n", os_color);
+    kprint("kill N - stops background job N\n", os_color);
+    kprint("kprint \"X\", Y, Z - prints X in Z color (Z arg is optional) with Y args (for example kprint \"Hello, %s you are %i years old\", name, age, 0x0F)\n", os_color);
+    kprint("mem - shows memory usage per allocator cache\n", os_color);
+    kprint("read X - prints file X (also cat)\n", os_color);
+    kprint("run X args - runs X, an ELF program (see README for the syscalls)\n", os_color);
+    kprint("str X = \"Y\" - sets X string variable to \"Y\"", os_color);
+    kprint("test - prints test messages\n", os_color);
+    kprint("wc [-l] [file] - counts lines, words and bytes\n", os_color);
+    kprint("write X Y - writes Y to X file\n", os_color);
+    kprint("zscript X - runs X zscript file (.zs) with shell commands inside\n", os_color);
+    kprint("zscript -s X - runs X while reading it, a statement at a time\n", os_color);
+    kprint("zw X - opens ZurOS writer for file X\n", os_color);
+    kprint("Z - very funny polish joke\n", os_color);
+    kprint("a | b - b reads what a prints, for example: read notes.txt | grep todo | wc -l\n", os_color);
+}
+
+void cmd_exit(char* args) {
+	fs_dir();
+	sleep_ms(500);
+	kclear();
+	kprint("Goodbye...", os_color);
+	sleep_ms(2500);
+    (void)args;
+    klog(KLOG_INFO, "kernel", "shutting down");
+    klog_flush();
+    shutdown();
+}
+
+void cmd_test(char* args) {
+    (void)args;
+    for (int i = 0; i < 16; i++) {
+        kprint("Hello, World! - 0x", i);
+        kput_char("0123456789ABCDEF"[i], i);
+        kput_char('\n', i);
+    }
+}
+
+void cmd_mem(char* args) {
+    (void)args;
+    kprint("Physical memory: ", (os_color & 0xF0) | 0x0A);
+    kprint_dec(frames_used * 4, os_color);
+    kprint(" KB used of ", os_color);
+    kprint_dec(frames_total * 4, os_color);
+    kprint(" KB\n", os_color);
+
+    kprint("cache          obj  slabs  in use  KB\n", (os_color & 0xF0) | 0x09);
+    for (uint32_t i = 0; i < SLAB_CACHE_COUNT; i++) {
+        SlabCache* c = &slab_caches[i];
+        kprint(c->name, os_color);
+        for (int pad = strlen(c->name); pad < 15; pad++) kput_char(' ', os_color);
+        kprint_dec(c->obj_size, os_color);
+        kput_char(' ', os_color);
+        kprint_dec(c->slabs, os_color);
+        kput_char(' ', os_color);
+        kprint_dec(c->in_use, os_color);
+        kput_char(' ', os_color);
+        kprint_dec(c->slabs * 4, os_color);
+        kput_char('\n', os_color);
+    }
+    kprint("large allocations: ", os_color);
+    kprint_dec(large_allocs, os_color);
+    kprint(" (", os_color);
+    kprint_dec(large_pages * 4, os_color);
+    kprint(" KB)\n", os_color);
+    kprint("mapped file pages: ", os_color);
+    kprint_dec(mmap_resident, os_color);
+    kprint(" (", os_color);
+    kprint_dec(mmap_resident * 4, os_color);
+    kprint(" KB)\n", os_color);
+}
+
+// ----------------- libc benchmark -----------------
+#define BENCH_SIZE (64 * 1024)
+#define BENCH_ROUNDS 64
+
+enum { BENCH_MEMCPY, BENCH_MEMSET, BENCH_STRLEN, BENCH_STRCHR, BENCH_MEMCMP, BENCH_MEMCHR };
+
+typedef struct {
+    const char* name;
+    int op;
+    uint32_t needs;      // CPU_* flags, 0 = always available
+    void* fn;
+} BenchVariant;
+
+static void* memcpy_bytes(void* dest, const void* src, size_t n) {
+    volatile uint8_t* d = dest;
+    const uint8_t* s = src;
+    for (size_t i = 0; i < n; i++) d[i] = s[i];
+    return dest;
+}
+
+static const BenchVariant bench_variants[] = {
+    {"memcpy  bytes", BENCH_MEMCPY, 0, memcpy_bytes},
+    {"memcpy  rep  ", BENCH_MEMCPY, 0, memcpy_rep},
+    {"memcpy  sse2 ", BENCH_MEMCPY, CPU_SSE2, memcpy_sse2},
+    {"memcpy  avx2 ", BENCH_MEMCPY, CPU_AVX2, memcpy_avx2},
+    {"memset  rep  ", BENCH_MEMSET, 0, memset_rep},
+    {"memset  sse2 ", BENCH_MEMSET, CPU_SSE2, memset_sse2},
+    {"memset  avx2 ", BENCH_MEMSET, CPU_AVX2, memset_avx2},
+    {"strlen  bytes", BENCH_STRLEN, 0, strlen_generic},
+    {"strlen  sse2 ", BENCH_STRLEN, CPU_SSE2, strlen_sse2},
+    {"strlen  avx2 ", BENCH_STRLEN, CPU_AVX2, strlen_avx2},
+    {"strchr  bytes", BENCH_STRCHR, 0, strchr_generic},
+    {"strchr  sse2 ", BENCH_STRCHR, CPU_SSE2, strchr_sse2},
+    {"memcmp  bytes", BENCH_MEMCMP, 0, memcmp_generic},
+    {"memcmp  sse2 ", BENCH_MEMCMP, CPU_SSE2, memcmp_sse2},
+    {"memcmp  avx2 ", BENCH_MEMCMP, CPU_AVX2, memcmp_avx2},
+    {"memchr  words", BENCH_MEMCHR, 0, memchr_generic},
+    {"memchr  sse2 ", BENCH_MEMCHR, CPU_SSE2, memchr_sse2},
+};
+
+static uint64_t bench_one(const BenchVariant* v, uint8_t* a, uint8_t* b) {
+    volatile uint32_t sink = 0;
+    uint64_t start = rdtsc();
+    for (int r = 0; r < BENCH_ROUNDS; r++) {
+        switch (v->op) {
+            case BENCH_MEMCPY: ((void* (*)(void*, const void*, size_t))v->fn)(a, b, BENCH_SIZE); break;
+            case BENCH_MEMSET: ((void* (*)(void*, int, size_t))v->fn)(a, r, BENCH_SIZE); break;
+            case BENCH_STRLEN: sink += ((size_t (*)(const char*))v->fn)((const char*)b); break;
+            case BENCH_STRCHR: sink += (uint32_t)((char* (*)(const char*, int))v->fn)((const char*)b, '!'); break;
+            case BENCH_MEMCMP: sink += ((int (*)(const void*, const void*, size_t))v->fn)(a, b, BENCH_SIZE); break;
+            case BENCH_MEMCHR: sink += (uint32_t)((void* (*)(const void*, int, size_t))v->fn)(b, '!', BENCH_SIZE); break;
+        }
+    }
+    (void)sink;
+    return rdtsc() - start;
+}
+
+void cmd_bench(char* args) {
+    while (*args == ' ') args++;
+    if (!strcmp(args, "libc")) {
+        kprint("Usage: bench libc\n", (os_color & 0xF0) | 0x0C);
+        return;
+    }
+
+    uint8_t* a = kmalloc(BENCH_SIZE + 1);
+    uint8_t* b = kmalloc(BENCH_SIZE + 1);
+    if (!a || !b) {
+        kprint("Out of memory!\n", (os_color & 0xF0) | 0x0C);
+        kfree(a);
+        kfree(b);
+        return;
+    }
+
+    kprint("CPU:", (os_color & 0xF0) | 0x0A);
+    if (cpu_features & CPU_SSE2) kprint(" sse2", os_color);
+    if (cpu_features & CPU_AVX) kprint(" avx", os_color);
+    if (cpu_features & CPU_AVX2) kprint(" avx2", os_color);
+    if (cpu_features & CPU_ERMS) kprint(" erms", os_color);
+    kprint("\nfunction       cycles per KB (64KB buffers)\n", (os_color & 0xF0) | 0x09);
+
+    for (uint32_t i = 0; i < sizeof(bench_variants) / sizeof(bench_variants[0]); i++) {
+        const BenchVariant* v = &bench_variants[i];
+        if ((v->needs & cpu_features) != v->needs) continue;
+
+        // a/b equal and b a string with no '!' so every function walks all 64KB
+        memset_rep(b, 'z', BENCH_SIZE);
+        b[BENCH_SIZE] = 0;
+        memcpy_rep(a, b, BENCH_SIZE + 1);
+
+        uint64_t cycles = bench_one(v, a, b);
+        kprint(v->name, os_color);
+        kprint("  ", os_color);
+        kprint_dec((uint32_t)(cycles >> 12), os_color); // 64 rounds * 64KB = 4096KB
+        kput_char('\n', os_color);
+    }
+
+    kfree(a);
+    kfree(b);
+}
+
+void cmd_Z(char* args) {
+    (void)args;
+    kprint("Przychodzi baba do lekarza...\n", os_color);
+    kprint("A lekarz tez baba!!!\n", os_color);
+}
+
+void cmd_ascii(char* args) {
+    (void)args;
+    kprint("ASCII art output...\n", os_color); // you can put the full art here
+}
+
+void cmd_color(char* args) {
+    while (*args == ' ') args++;
+    if (*args == '-') {
+        if (strcmp(args, "-themes")) {
+            kprint("CLASSIC - 0x0F\n", 0x0F);
+            kprint("LIGHT MODE - 0xF2\n", 0xF2);
+            kprint("TEMPLE - 0xB2\n", 0xB2);
+            kprint("UNREADABLE PINK - 0xDF\n", 0xDF);
+        }
+        return;
+    }
+    if (args[0] == '0' && (args[1] == 'x' || args[1] == 'X')) {
+        args += 2;
+        if ((args[0] >= '0' && args[0] <= '9') || (args[0] >= 'A' && args[0] <= 'F') || (args[0] >= 'a' && args[0] <= 'f')) {
+            if ((args[1] >= '0' && args[1] <= '9') || (args[1] >= 'A' && args[1] <= 'F') || (args[1] >= 'a' && args[1] <= 'f')) {
+                os_color = (hex_to_nibble(args[0]) << 4) | hex_to_nibble(args[1]);
+                kclear();
+                return;
+            }
+        }
+    }
+    kprint("Invalid color format! Use color 0xXY\n", (os_color & 0xF0) | 0x0C);
+}
+
+void cmd_dir(char* args) {
+    (void)args;
+    fs_load();
+    fs_dir();
+}
+
+void cmd_read(char* args) {
+    while (*args == ' ') args++;
+    fs_load();
+    fs_read_file(args);
+}
+
+void cmd_write(char* args) {
+    while (*args == ' ') args++;
+    char* space = strchr(args, ' ');
+    if (!space) {
+        kprint("Usage: write <filename> <text>\n", (os_color & 0xF0) | 0x0C);
+        return;
+    }
+    *space = '\0';
+    char* filename = args;
+    char* text = space + 1;
+    while (*text == ' ') text++;
+    fs_delete_file(filename);
+    fs_write_file(filename, text);
+    kprint("File written successfully!\n", (os_color & 0xF0) | 0x0A);
+}
+
+void cmd_delete(char* args) {
+    while (*args == ' ') args++;
+    fs_load();
+    fs_delete_file(args);
+}
+
+void cmd_zw(char* args) {
+    while (*args == ' ') args++;
+    if (strcmp(args, "-help")) {
+        kprint("zw X opens file X (or a new one) in ZurOS writer:\n", os_color);
+        kprint("  arrows, Home, End, Page Up and Page Down move around\n", os_color);
+        kprint("  typing inserts, Backspace and Delete remove, Tab puts 4 spaces\n", os_color);
+        kprint("  Ctrl-S saves, Esc saves and leaves, Ctrl-Q leaves without saving\n", os_color);
+        return;
+    }
+    if (*args) {
+        fs_load();
+        zuros_writer(args);
+    } else {
+        kprint("Usage: zw <filename>\n", (os_color & 0xF0) | 0x0C);
+    }
+}
+
+static char* skip_leading_whitespace(char* str) {
+    while (*str == '\n' || *str == ' ' || *str == '\t') str++;
+    return str;
+}
+
+void zs_run_file(const char* name, int stream);
+
+void cmd_zscript(char* args) {
+    fs_load();
+
+    int stream = 0;
+    if (starts_with(args, "-s ")) {
+        stream = 1;
+        args = skip_leading_whitespace(args + 3);
+    }
+    zs_run_file(args, stream);
+}
+
+void cmd_kprint(char* input) {
+    zs_exec_single(ZS_STMT_KPRINT, input);
+}
+
+static void pcspk_play(uint32_t freq) {
+    uint32_t divisor = 1193180 / freq;
+
+    outb(0x43, 0xB6);
+    outb(0x42, (uint8_t)(divisor & 0xFF));
+    outb(0x42, (uint8_t)((divisor >> 8) & 0xFF));
+
+    uint8_t tmp = inb(0x61);
+    if (!(tmp & 3)) {
+        outb(0x61, tmp | 3);
     }
-    kprint("No free sectors available!\n", (os_color & 0xF0) | 0x0C);
-    return 0;
 }
 
-// ----------------- rebuild bitmap after loading -----------------
-void fs_build_bitmap() {
-    memset(sector_bitmap, 0, sizeof(sector_bitmap));
-    for (int i = 0; i < MAX_FILES; i++) {
-        if (files[i].used) {
-            uint32_t sectors = (files[i].size + 511) / 512;
-            for (uint32_t s = 0; s < sectors; s++)
-                mark_sector(files[i].start + s, 1);
+static void pcspk_stop() {
+    uint8_t tmp = inb(0x61) & 0xFC;
+    outb(0x61, tmp);
+}
+
+static uint32_t note_to_freq(char n) {
+    switch (n) {
+        case 'c': return 261;
+        case 'd': return 294;
+        case 'e': return 329;
+        case 'f': return 349;
+        case 'g': return 392;
+        case 'a': return 440;
+        case 'b': return 494;
+    	case 'h': return 494;
+        default: return 0;
+    }
+}
+
+// ----------------- text filters -----------------
+// grep, wc and head read the previous pipeline stage's output, or a file when
+// one is given. Lines are found with memchr, so long runs without a match or
+// a newline go by a word (or 16 bytes) at a time.
+typedef struct {
+    const char* data;
+    uint32_t len;
+    void* mapped;               // fs_mmap'd file to unmap, NULL when it's a pipe
+} FilterInput;
+
+static int filter_open(const char* cmd, char* file, FilterInput* in) {
+    while (*file == ' ') file++;
+    in->mapped = NULL;
+    if (*file) {
+        fs_load();
+        in->mapped = fs_mmap(file, &in->len, FS_MAP_PRIVATE);
+        if (!in->mapped) {
+            kprint("File not found!\n", (os_color & 0xF0) | 0x0C);
+            return 0;
         }
+        in->data = in->mapped;
+        return 1;
+    }
+    Pipe* p = this_thread()->pipe_in;
+    if (!p) {
+        kprint(cmd, (os_color & 0xF0) | 0x0C);
+        kprint(": nothing to read, give it a file or pipe a command into it\n", (os_color & 0xF0) | 0x0C);
+        return 0;
     }
+    in->data = p->data;
+    in->len = p->len;
+    return 1;
 }
 
-void fs_write_file(const char* name, const char* text) {
-    // convert "\n" to real newlines
-    uint32_t len = 0;
-    for (const char* p = text; *p; p++) {
-        if (*p == '\\' && *(p+1) == 'n') { len++; p++; }
-        else len++;
+static void filter_close(FilterInput* in) {
+    if (in->mapped) fs_munmap(in->mapped);
+}
+
+// the next word of args, or a "quoted string"; NULL-terminated in place
+static char* filter_word(char** args) {
+    char* s = *args;
+    while (*s == ' ') s++;
+    char* w = s;
+    char end = ' ';
+    if (*s == '"') {
+        w = ++s;
+        end = '"';
     }
+    while (*s && *s != end) s++;
+    if (*s) *s++ = '\0';
+    *args = s;
+    return w;
+}
 
-    char temp[len + 1];
-    uint32_t idx = 0;
-    for (const char* p = text; *p; p++) {
-        if (*p == '\\' && *(p+1) == 'n') { temp[idx++] = '\n'; p++; }
-        else temp[idx++] = *p;
+// first occurrence of pat in s[0..n), memchr finds the candidates
+static const char* filter_find(const char* s, uint32_t n, const char* pat, uint32_t plen) {
+    if (plen == 0) return s;
+    const char* end = s + n;
+    while ((uint32_t)(end - s) >= plen) {
+        s = memchr(s, pat[0], end - s - plen + 1);
+        if (!s) return NULL;
+        if (memcmp(s, pat, plen) == 0) return s;
+        s++;
     }
-    temp[idx] = '\0';
+    return NULL;
+}
 
-    uint32_t sectors = (len + 511) / 512;
-    uint8_t buffer[512];
+void cmd_grep(char* args) {
+    int invert = 0, count_only = 0;
+    while (*args == ' ') args++;
+    while (args[0] == '-' && (args[1] == 'v' || args[1] == 'c') && (args[2] == ' ' || !args[2])) {
+        if (args[1] == 'v') invert = 1;
+        else count_only = 1;
+        args += 2;
+        while (*args == ' ') args++;
+    }
+    if (!*args) {
+        kprint("Usage: grep [-v] [-c] PATTERN [file]\n", (os_color & 0xF0) | 0x0C);
+        return;
+    }
+    const char* pat = filter_word(&args);
+    uint32_t plen = strlen(pat);
+
+    FilterInput in;
+    if (!filter_open("grep", args, &in)) return;
+
+    const char* p = in.data;
+    const char* end = in.data + in.len;
+    uint32_t matches = 0;
+    while (p < end && !thread_killed()) {
+        const char* line = p;
+        const char* eol;
+        if (!invert) {
+            // jump straight to the next match and back up to its line
+            const char* hit = filter_find(p, end - p, pat, plen);
+            if (!hit) break;
+            line = hit;
+            while (line > p && line[-1] != '\n') line--;
+            eol = memchr(hit, '\n', end - hit);
+        } else {
+            eol = memchr(p, '\n', end - p);
+        }
+        if (!eol) eol = end;
+        p = eol + 1;
+        if (invert && filter_find(line, eol - line, pat, plen)) continue;
 
-    // --- check if file exists ---
-    for (int i = 0; i < MAX_FILES; i++) {
-        if (files[i].used && strcmp(files[i].name, name) == 1) {
-            uint32_t old_sectors = (files[i].size + 511) / 512;
+        matches++;
+        if (!count_only) {
+            kwrite(line, eol - line, os_color);
+            kput_char('\n', os_color);
+        }
+    }
+    if (count_only) {
+        kprint_dec(matches, os_color);
+        kput_char('\n', os_color);
+    }
+    filter_close(&in);
+}
 
-            if (sectors <= old_sectors) {
-                // write in place
-                for (uint32_t s = 0; s < sectors; s++) {
-                    memset(buffer, 0, 512);
-                    uint32_t remaining = len - s*512;
-                    if (remaining > 512) remaining = 512;
-                    memcpy(buffer, temp + s*512, remaining);
-                    if (!ata_write_safe(files[i].start + s, buffer)) return;
-                }
-                // zero leftover sectors
-                for (uint32_t s = sectors; s < old_sectors; s++) {
-                    memset(buffer, 0, 512);
-                    if (!ata_write_safe(files[i].start + s, buffer)) return;
-                    mark_sector(files[i].start + s, 0); // free old sectors
-                }
-                files[i].size = len;
-                fs_save();
-                return;
-            } else {
-                // allocate new sectors safely
-                uint32_t new_lba = fs_allocate_sectors_safe(sectors);
-                for (uint32_t s = 0; s < sectors; s++) {
-                    memset(buffer, 0, 512);
-                    uint32_t remaining = len - s*512;
-                    if (remaining > 512) remaining = 512;
-                    memcpy(buffer, temp + s*512, remaining);
-                    if (!ata_write_safe(new_lba + s, buffer)) return;
-                }
-                // free old sectors
-                for (uint32_t s = 0; s < old_sectors; s++)
-                    mark_sector(files[i].start + s, 0);
-                files[i].start = new_lba;
-                files[i].size = len;
-                fs_save();
-                return;
-            }
+void cmd_wc(char* args) {
+    int lines_only = 0;
+    while (*args == ' ') args++;
+    if (args[0] == '-' && args[1] == 'l' && (args[2] == ' ' || !args[2])) {
+        lines_only = 1;
+        args += 2;
+    }
+
+    FilterInput in;
+    if (!filter_open("wc", args, &in)) return;
+
+    uint32_t lines = 0, words = 0;
+    const char* end = in.data + in.len;
+    for (const char* p = in.data; (p = memchr(p, '\n', end - p)); p++)
+        lines++;
+    if (!lines_only) {
+        int in_word = 0;
+        for (const char* p = in.data; p < end; p++) {
+            int space = *p == ' ' || *p == '\n' || *p == '\t' || *p == '\r';
+            if (!space && !in_word) words++;
+            in_word = !space;
         }
     }
 
-    // --- new file ---
-    for (int i = 0; i < MAX_FILES; i++) {
-        if (!files[i].used) {
-            uint32_t lba = fs_allocate_sectors_safe(sectors);
-            files[i].used = 1;
-            strcpy(files[i].name, name);
-            files[i].start = lba;
-            files[i].size = len;
+    kprint_dec(lines, os_color);
+    if (!lines_only) {
+        kput_char(' ', os_color);
+        kprint_dec(words, os_color);
+        kput_char(' ', os_color);
+        kprint_dec(in.len, os_color);
+    }
+    kput_char('\n', os_color);
+    filter_close(&in);
+}
 
-            for (uint32_t s = 0; s < sectors; s++) {
-                memset(buffer, 0, 512);
-                uint32_t remaining = len - s*512;
-                if (remaining > 512) remaining = 512;
-                memcpy(buffer, temp + s*512, remaining);
-                if (!ata_write_safe(lba + s, buffer)) return;
-            }
-            fs_save();
+void cmd_head(char* args) {
+    uint32_t n = 10;
+    while (*args == ' ') args++;
+    if (args[0] == '-') {
+        args++;
+        if (*args == 'n') args++;
+        while (*args == ' ') args++;
+        if (*args < '0' || *args > '9') {
+            kprint("Usage: head [-n N] [file]\n", (os_color & 0xF0) | 0x0C);
             return;
         }
+        n = 0;
+        while (*args >= '0' && *args <= '9') n = n * 10 + (*args++ - '0');
     }
 
-    kprint("No free file slots!\n", (os_color & 0xF0) | 0x0C);
+    FilterInput in;
+    if (!filter_open("head", args, &in)) return;
+
+    const char* end = in.data + in.len;
+    const char* p = in.data;
+    while (n-- && p < end) {
+        const char* eol = memchr(p, '\n', end - p);
+        p = eol ? eol + 1 : end;
+    }
+    kwrite(in.data, p - in.data, os_color);
+    filter_close(&in);
 }
 
-void fs_dir() {
-    for (int i = 0; i < MAX_FILES; i++) {
-        if (files[i].used) {
-            kprint(files[i].name, os_color);
-            kput_char(' ', os_color);
-            char size_str[12];
-            int sz = files[i].size;
-            int pos = 0;
-            do {
-                size_str[pos++] = '0' + sz % 10;
-                sz /= 10;
-            } while (sz > 0);
-            // reverse
-            for (int j = pos-1; j >= 0; j--) kput_char(size_str[j], os_color);
-            kput_char('\n', os_color);
+// ----------------- Sound Blaster 16 -----------------
+// 8-bit mono PCM on ISA DMA channel 1 in auto-init mode. The DSP raises IRQ5
+// after every half of the buffer; the handler renders the next half from the
+// mixer while the DMA controller plays the other one, so the CPU only wakes
+// up every SB16_BLOCK samples.
+#define SB16_BASE 0x220
+#define SB16_IRQ 5
+#define SB16_RATE 22050
+#define SB16_BLOCK 1024                  // samples per half (~46ms)
+#define MIXER_VOICES 4
+
+// ISA DMA can only reach the first 16MB and must not cross a 64KB boundary;
+// the kernel's bss is well below 16MB and the alignment keeps it in one 64KB page
+uint8_t sb16_buffer[2 * SB16_BLOCK] __attribute__((aligned(2 * SB16_BLOCK)));
+
+int sb16_present = 0;
+uint8_t sb16_version = 0;
+volatile int sb16_half = 0;              // half the DSP is about to finish
+volatile int sb16_running = 0;
+int sb16_idle_blocks = 0;
+
+typedef struct {
+    uint32_t phase;      // 8.24 position in the wave table
+    uint32_t step;       // phase increment per sample
+    int32_t amp;         // current amplitude, 0..256 in 8.8
+    int32_t target;      // amplitude we ramp towards (avoids clicks)
+} Voice;
+
+Voice voices[MIXER_VOICES];
+int8_t sine_table[256];
+
+static int dsp_write(uint8_t v) {
+    for (int timeout = 100000; timeout; timeout--) {
+        if (!(inb(SB16_BASE + 0xC) & 0x80)) {
+            outb(SB16_BASE + 0xC, v);
+            return 1;
         }
     }
+    return 0;
 }
 
-#define MAX_FILE_PRINT 4096
+static int dsp_read(void) {
+    for (int timeout = 100000; timeout; timeout--)
+        if (inb(SB16_BASE + 0xE) & 0x80) return inb(SB16_BASE + 0xA);
+    return -1;
+}
 
-void fs_read_file(const char* name) {
-    for (int i = 0; i < MAX_FILES; i++) {
-        if (files[i].used && strcmp(files[i].name, name) == 1) {
-            uint32_t len = files[i].size;
-            uint32_t sectors = (len + 511) / 512;
-            uint8_t buffer[512];
+// Bhaskara's approximation, integer only: sin(pi*i/128) ~ 16x(N-x) / (5N^2 - 4x(N-x))
+static void sine_table_init(void) {
+    const int32_t n = 128;
+    for (int i = 0; i < 256; i++) {
+        int32_t x = i % n;
+        int32_t p = x * (n - x);
+        int32_t s = 16 * p * 127 / (5 * n * n - 4 * p);
+        sine_table[i] = i < n ? s : -s;
+    }
+}
 
-            for (uint32_t s = 0; s < sectors; s++) {
-                ata_read28(files[i].start + s, buffer);
-                uint32_t remaining = len - s*512;
-                if (remaining > 512) remaining = 512;
-                char temp[remaining + 1];
-                memcpy(temp, buffer, remaining);
-                temp[remaining] = '\0';
-                kprint(temp, os_color);
-            }
-            kput_char('\n', os_color);
-            return;
+static void mixer_render(uint8_t* out, int samples) {
+    for (int i = 0; i < samples; i++) {
+        int32_t mix = 0;
+        for (int v = 0; v < MIXER_VOICES; v++) {
+            Voice* vc = &voices[v];
+            if (vc->amp != vc->target)
+                vc->amp += vc->amp < vc->target ? 4 : -4;
+            if (!vc->amp) continue;
+            mix += (sine_table[vc->phase >> 24] * vc->amp) >> 8;
+            vc->phase += vc->step;
         }
+        if (mix > 127) mix = 127;
+        if (mix < -128) mix = -128;
+        out[i] = (uint8_t)(mix + 128);
     }
-    kprint("File not found!\n", (os_color & 0xF0) | 0x0C);
 }
 
-void fs_delete_file(const char* name) {
-    for (int i = 0; i < MAX_FILES; i++) {
-        if (files[i].used && strcmp(files[i].name, name) == 1) {
-            files[i].used = 0;  // mark as unused
-            files[i].name[0] = '\0';
-            files[i].size = 0;
-            fs_save();          // save the updated file table
-            kprint("File deleted successfully!\n", (os_color & 0xF0) | 0x0A);
-            return;
+static int mixer_silent(void) {
+    for (int v = 0; v < MIXER_VOICES; v++)
+        if (voices[v].amp || voices[v].target) return 0;
+    return 1;
+}
+
+static void sb16_irq(void) {
+    inb(SB16_BASE + 0xE); // acknowledge the 8-bit interrupt
+
+    mixer_render(sb16_buffer + sb16_half * SB16_BLOCK, SB16_BLOCK);
+    sb16_half ^= 1;
+
+    // nothing to play for a while: halt DMA so idle costs no interrupts
+    if (mixer_silent()) {
+        if (++sb16_idle_blocks >= 2) {
+            dsp_write(0xD0);
+            sb16_running = 0;
         }
+    } else {
+        sb16_idle_blocks = 0;
     }
-    kprint("File not found!\n", (os_color & 0xF0) | 0x0C);
 }
 
-#define ZW_LINES 20
-#define ZW_WIDTH 80
+static void sb16_start(void) {
+    mixer_render(sb16_buffer, 2 * SB16_BLOCK);
+    sb16_half = 0;
+    sb16_idle_blocks = 0;
+
+    uint32_t addr = (uint32_t)sb16_buffer;
+    uint32_t len = 2 * SB16_BLOCK - 1;
+    outb(0x0A, 0x05);                    // mask channel 1
+    outb(0x0C, 0x00);                    // reset the flip-flop
+    outb(0x0B, 0x59);                    // single, auto-init, memory -> device, channel 1
+    outb(0x02, addr & 0xFF);
+    outb(0x02, (addr >> 8) & 0xFF);
+    outb(0x83, (addr >> 16) & 0xFF);     // page
+    outb(0x03, len & 0xFF);
+    outb(0x03, (len >> 8) & 0xFF);
+    outb(0x0A, 0x01);                    // unmask channel 1
+
+    dsp_write(0x41);                     // output sample rate
+    dsp_write(SB16_RATE >> 8);
+    dsp_write(SB16_RATE & 0xFF);
+    dsp_write(0xC6);                     // 8-bit, auto-init, FIFO
+    dsp_write(0x00);                     // mono, unsigned
+    dsp_write((SB16_BLOCK - 1) & 0xFF);
+    dsp_write((SB16_BLOCK - 1) >> 8);
+    sb16_running = 1;
+}
 
-char zw_buffer[ZW_LINES][ZW_WIDTH + 1]; // +1 for null terminator
+int sb16_init(void) {
+    outb(SB16_BASE + 0x6, 1);
+    for (volatile int i = 0; i < 1000; i++) { } // >3us
+    outb(SB16_BASE + 0x6, 0);
+    if (dsp_read() != 0xAA) return 0;
+
+    dsp_write(0xE1);
+    int major = dsp_read();
+    dsp_read();
+    if (major < 4) return 0; // SB16 is DSP 4.x, older cards can't set the rate this way
+
+    outb(SB16_BASE + 0x4, 0x80);         // mixer: IRQ select
+    outb(SB16_BASE + 0x5, 0x02);         // IRQ5
+    outb(SB16_BASE + 0x4, 0x81);         // mixer: DMA select
+    outb(SB16_BASE + 0x5, 0x22);         // DMA1 (8-bit) + DMA5 (16-bit)
+
+    sine_table_init();
+    dsp_write(0xD1);                     // speaker on
+    register_irq_handler(SB16_IRQ, sb16_irq);
+    sb16_version = major;
+    sb16_present = 1;
+    return 1;
+}
 
-void zuros_writer(const char* filename) {
-    // Initialize buffer
-    for (int i = 0; i < ZW_LINES; i++)
-        zw_buffer[i][0] = '\0';
+// sets voice `v` to `freq` Hz (0 = fade out); safe to call from IRQ context
+void mixer_set_voice(int v, uint32_t freq) {
+    uint32_t flags = irq_save();
+    if (freq) {
+        voices[v].step = (uint32_t)div64_32((uint64_t)freq << 32, SB16_RATE);
+        voices[v].target = 128; // half of full scale, two voices can't clip
+    } else {
+        voices[v].target = 0;
+    }
+    if (freq && !sb16_running) sb16_start();
+    irq_restore(flags);
+}
 
-    int running = 1;
+// ----------------- Background sequencer -----------------
+// A melody is parsed once into note events and then played from the timer
+// interrupt: each event reprograms PIT channel 2 and arms a timer for its
+// end, so beep returns right away and the shell keeps running.
+typedef struct {
+    uint16_t freq;       // 0 = rest
+    uint16_t ms;
+} NoteEvent;
+
+NoteEvent* seq_events = NULL;
+int seq_count = 0;
+volatile int seq_pos = 0;
+volatile int seq_playing = 0;
+Timer seq_timer;
+Spinlock seq_lock;              // everything above; seq_step runs on the BSP, beep anywhere
+uint32_t seq_gen = 0;           // bumped by seq_stop and seq_start so a step already under way gives up
+WaitQueue seq_waiters;          // beep -wait
+
+static void seq_step(void* arg) {
+    uint32_t flags = spin_lock_irqsave(&seq_lock);
+    if ((uint32_t)arg != seq_gen) { // stopped (and maybe restarted) meanwhile
+        spin_unlock_irqrestore(&seq_lock, flags);
+        return;
+    }
+    if (seq_pos >= seq_count) {
+        if (sb16_present) mixer_set_voice(0, 0);
+        else pcspk_stop();
+        seq_playing = 0;
+        spin_unlock_irqrestore(&seq_lock, flags);
+        wq_wake_all(&seq_waiters);
+        return;
+    }
 
-    while (running) {
-        kclear();
-        cursor_y = 20;
+    NoteEvent* e = &seq_events[seq_pos++];
+    if (sb16_present) mixer_set_voice(0, e->freq);
+    else if (e->freq) pcspk_play(e->freq);
+    else pcspk_stop();
+    timer_add(&seq_timer, e->ms, seq_step, arg);
+    spin_unlock_irqrestore(&seq_lock, flags);
+}
 
-        // Draw all 20 lines
-        for (int i = 0; i < ZW_LINES; i++)
-            kprintnf(zw_buffer[i], os_color, i);
+void seq_stop(void) {
+    uint32_t flags = spin_lock_irqsave(&seq_lock);
+    seq_gen++;
+    spin_unlock_irqrestore(&seq_lock, flags);
+    timer_cancel(&seq_timer); // a step that re-armed before seq_gen changed
+
+    flags = spin_lock_irqsave(&seq_lock);
+    if (sb16_present) mixer_set_voice(0, 0);
+    else pcspk_stop();
+    seq_playing = 0;
+    spin_unlock_irqrestore(&seq_lock, flags);
+    wq_wake_all(&seq_waiters);
+}
 
-        kprint("######## TYPE EXIT TO SAVE AND LEAVE, DISTRACT TO LEAVE WITHOUT SAVING. ########", (os_color & 0xF0) | 0x09);
-        kprint("ZurOS writer >> ", os_color);
+// takes ownership of `events` (kmalloc'd) and starts playing them
+void seq_start(NoteEvent* events, int count) {
+    seq_stop();
+    uint32_t flags = spin_lock_irqsave(&seq_lock);
+    NoteEvent* old = seq_events;
+    seq_events = events;
+    seq_count = count;
+    seq_pos = 0;
+    seq_playing = count != 0;
+    // a new generation of its own: a beep started on another console between
+    // our seq_stop and here must not pass seq_step's check alongside this one
+    uint32_t gen = ++seq_gen;
+    spin_unlock_irqrestore(&seq_lock, flags);
+    kfree(old);
+    if (count) seq_step((void*)gen);
+}
 
-        char line_input[ZW_WIDTH + 1];
-        kread_line(line_input, ZW_WIDTH + 1);
+void seq_wait(void) {
+    for (;;) {
+        uint32_t seq = wq_prepare(&seq_waiters);
+        if (!seq_playing || thread_killed()) break;
+        wq_wait(&seq_waiters, seq);
+    }
+}
 
-        // Exit command
-        if (starts_with(line_input, "exit")) {
-            fs_delete_file(filename);
+static int parse_duration(const char* s, int* i) {
+    int duration = 0;
+    while (s[*i] >= '0' && s[*i] <= '9') {
+        duration = duration * 10 + (s[*i] - '0');
+        (*i)++;
+    }
+    return duration;
+}
 
-            // Build zw_text from buffer
-            char zw_text[ZW_LINES * (ZW_WIDTH + 1) + 1]; // +1 for null terminator
-            int idx = 0;
-            for (int i = 0; i < ZW_LINES; i++) {
-                for (int j = 0; zw_buffer[i][j]; j++)
-                    zw_text[idx++] = zw_buffer[i][j];
-                zw_text[idx++] = '\n'; // add line break in buffer only
-            }
-            zw_text[idx] = '\0';
-
-            char escaped_text[ZW_LINES * (ZW_WIDTH + 1) + 1]; // enough space
-            // Escape '\n' only
-            int j = 0;
-            for (int i = 0; zw_text[i]; i++) {
-                if (zw_text[i] == '\n') {
-                    escaped_text[j++] = '\\';
-                    escaped_text[j++] = 'n';
-                } else {
-                    escaped_text[j++] = zw_text[i];
-                }
-            }
-            escaped_text[j] = '\0';
+// "c 100: d 100: x 50" -> events; returns a kmalloc'd array or NULL
+static NoteEvent* parse_melody(const char* melody, int* count) {
+    // every note needs at least one character, so this is enough room
+    NoteEvent* events = kmalloc((strlen(melody) + 1) * sizeof(NoteEvent));
+    if (!events) return NULL;
 
-            fs_write_file(filename, escaped_text);
-            running = 0;
-            break;
-        } else if (starts_with(line_input, "distract")) {
-            running = 0;
-            break;
+    int n = 0;
+    int i = 0;
+    while (melody[i]) {
+        // Skip spaces/tabs
+        while (melody[i] == ' ' || melody[i] == '\t') i++;
+
+        char note = melody[i];
+        if (!note) break;  // end of string
+
+        // Only valid notes or 'x'
+        if ((note < 'a' || note > 'h') && note != 'x') {
+            i++;
+            continue;
         }
 
-        // Handle "<line number> <text>" input
-        int line_num = 0, offset = 0;
+        i++; // move past note
+
+        // skip spaces before duration
+        while (melody[i] == ' ' || melody[i] == '\t') i++;
+
+        int duration = parse_duration(melody, &i);
+
+        // enforce minimum duration for safety
+        if (duration == 0) duration = 100;  // default 100ms if not specified
+        if (duration > 0xFFFF) duration = 0xFFFF;
+
+        events[n].freq = note == 'x' ? 0 : note_to_freq(note);
+        events[n].ms = duration;
+        n++;
+
+        // skip until separator (optional)
+        while (melody[i] && melody[i] != ':') i++;
+        if (melody[i] == ':') i++;
+    }
+
+    *count = n;
+    return events;
+}
+
+// "c 250" (a single note, 'x' is a rest) -> one event
+static NoteEvent* parse_single_note(const char* args, int* count) {
+    *count = 0;
+    char note = args[0];
+    int i = 1;
+    while (args[i] == ' ') i++;  // skip space between note and duration
+
+    int ms = parse_duration(args, &i);
+    if (ms <= 0) return NULL;
+    if (ms > 0xFFFF) ms = 0xFFFF;
+
+    uint32_t freq = 0;
+    if (note != 'x' && note != 'X') {
+        freq = note_to_freq(note);
+        if (freq == 0) return NULL;
+    }
 
-        while (line_input[offset] >= '0' && line_input[offset] <= '9') {
-            line_num = line_num * 10 + (line_input[offset] - '0');
-            offset++;
-        }
+    NoteEvent* e = kmalloc(sizeof(NoteEvent));
+    if (!e) return NULL;
+    e->freq = freq;
+    e->ms = ms;
+    *count = 1;
+    return e;
+}
 
-        if (line_input[offset] != ' ') {
-            kprintnf("Invalid command or line number", (os_color & 0xF0) | 0x0C, ZW_LINES + 1);
-            continue;
-        }
+void cmd_boottime(char* args);
+void cmd_dmesg(char* args);
+void cmd_jobs(char* args);
+void cmd_kill(char* args);
+void cmd_cpus(char* args);
+void cmd_run(char* args);
 
-        while (line_input[offset] == ' ') offset++;
+void cmd_beep(char *args) {
+    while (*args == ' ') args++;  // skip leading spaces
 
-        if (line_num >= 1 && line_num <= ZW_LINES) {
-            int i = 0;
-            while (line_input[offset] && i < ZW_WIDTH)
-                zw_buffer[line_num - 1][i++] = line_input[offset++];
-            zw_buffer[line_num - 1][i] = '\0';
-        } else {
-            kprintnf("Invalid line number", (os_color & 0xF0) | 0x0C, ZW_LINES + 1);
-        }
+    int wait = 0;
+    if (starts_with(args, "-stop")) {
+        seq_stop();
+        return;
+    }
+    if (starts_with(args, "-wait")) {
+        wait = 1;
+        args += 5;
+        while (*args == ' ') args++;
     }
-}
 
-typedef void (*command_func_t)(const char*);
+    int count = 0;
+    NoteEvent* events;
+    if (strchr(args, ':'))
+        events = parse_melody(args, &count);
+    else
+        events = parse_single_note(args, &count);
 
-typedef struct {
-    const char* name;
-    command_func_t func;
-} Commands;
+    if (!events) return;
+    seq_start(events, count);
+    if (wait) seq_wait();
+}
 
-#define MAX_SAVED_FILES 128
-#define MAX_FILE_CONTENT 4096
+// ----------------- Command struct -----------------
+#define CMD_FULL_LINE 1   // handler gets the whole line, command name included
+#define CMD_INTERACTIVE 2 // reads the keyboard, so it can't run as a background job
 
 typedef struct {
-    char name[16];
-    char content[MAX_FILE_CONTENT];
-} SavedFile;
+    const char* name;
+    void (*func)(char*);
+    const char* alias; // second name, or NULL
+    int flags;
+} Command;
 
-SavedFile saved_files[MAX_SAVED_FILES];
-int saved_count = 0;
+Command commands[] = {
+    {"clear", cmd_clear, "cls", 0},
+    {"help", cmd_help, NULL, 0},
+    {"exit", cmd_exit, NULL, 0},
+    {"test", cmd_test, NULL, 0},
+    {"Z", cmd_Z, NULL, 0},
+    {"ascii", cmd_ascii, NULL, 0},
+    {"color", cmd_color, NULL, 0},
+    {"dir", cmd_dir, "ls", 0},
+    {"read", cmd_read, "cat", 0},
+    {"write", cmd_write, NULL, 0},
+    {"delete", cmd_delete, "rm", 0},
+    {"zw", cmd_zw, NULL, CMD_INTERACTIVE},
+    {"kprint", cmd_kprint, NULL, CMD_FULL_LINE},
+    {"zscript", cmd_zscript, NULL, 0},
+    {"beep", cmd_beep, NULL, 0},
+    {"str", cmd_str, NULL, 0},
+    {"int", cmd_int, NULL, 0},
+    {"mem", cmd_mem, NULL, 0},
+    {"bench", cmd_bench, NULL, 0},
+    {"boottime", cmd_boottime, NULL, 0},
+    {"dmesg", cmd_dmesg, NULL, 0},
+    {"jobs", cmd_jobs, NULL, 0},
+    {"kill", cmd_kill, NULL, 0},
+    {"cpus", cmd_cpus, NULL, 0},
+    {"run", cmd_run, NULL, 0},
+    {"grep", cmd_grep, NULL, 0},
+    {"wc", cmd_wc, NULL, 0},
+    {"head", cmd_head, NULL, 0}
+};
+const int command_count = sizeof(commands)/sizeof(commands[0]);
 
-// Save all files into memory and delete them
-void backup_and_delete_all_files() {
-    fs_load();
-    saved_count = 0;
+#define COMMAND_COUNT (sizeof(commands)/sizeof(commands[0]))
 
-    for (int i = 0; i < MAX_FILES; i++) {
-        if (files[i].used && saved_count < MAX_SAVED_FILES) {
-            // Store name
-            strncpy(saved_files[saved_count].name, files[i].name, 16);
+// ----------------- command lookup -----------------
+// Names and aliases go into an open table with a seed picked at boot so that
+// none of them collide. Looking a word up is then one hash and one compare,
+// however many commands there are.
+#define CMD_HASH_SLOTS 128 // power of two, a few times the number of names
+
+uint8_t cmd_hash_slot[CMD_HASH_SLOTS];      // command index + 1, 0 = empty
+const char* cmd_hash_name[CMD_HASH_SLOTS];  // the name that landed there
+uint32_t cmd_hash_seed = 0;
+
+static uint32_t cmd_hash(const char* s, uint32_t len, uint32_t seed) {
+    uint32_t h = 2166136261u ^ seed; // FNV-1a
+    for (uint32_t i = 0; i < len; i++) {
+        h ^= (uint8_t)s[i];
+        h *= 16777619u;
+    }
+    return (h ^ (h >> 15)) & (CMD_HASH_SLOTS - 1);
+}
 
-            // Read file content into memory
-            uint32_t len = files[i].size;
-            if (len >= MAX_FILE_CONTENT) len = MAX_FILE_CONTENT - 1;
+static int cmd_hash_try(uint32_t seed) {
+    memset(cmd_hash_slot, 0, sizeof(cmd_hash_slot));
+    for (int i = 0; i < command_count; i++) {
+        const char* names[2] = { commands[i].name, commands[i].alias };
+        for (int k = 0; k < 2; k++) {
+            if (!names[k]) continue;
+            uint32_t slot = cmd_hash(names[k], strlen(names[k]), seed);
+            if (cmd_hash_slot[slot]) return 0;
+            cmd_hash_slot[slot] = i + 1;
+            cmd_hash_name[slot] = names[k];
+        }
+    }
+    return 1;
+}
 
-            uint32_t sectors = (len + 511) / 512;
-            uint8_t buffer[512];
-            uint32_t offset = 0;
+// the command called `name` (first `len` chars), or NULL
+Command* command_lookup(const char* name, uint32_t len) {
+    uint32_t slot = cmd_hash(name, len, cmd_hash_seed);
+    if (!cmd_hash_slot[slot]) return NULL;
+    const char* n = cmd_hash_name[slot];
+    if (strncmp(n, name, len) != 0 || n[len] != '\0') return NULL;
+    return &commands[cmd_hash_slot[slot] - 1];
+}
 
-            for (uint32_t s = 0; s < sectors; s++) {
-                ata_read28(files[i].start + s, buffer);
-                uint32_t remaining = len - s*512;
-                if (remaining > 512) remaining = 512;
-                memcpy(saved_files[saved_count].content + offset, buffer, remaining);
-                offset += remaining;
-            }
-            saved_files[saved_count].content[offset] = '\0';
+// ----------------- Tab completion -----------------
+// Two prefix tries, one over command names and aliases (built once) and one
+// over file names (rebuilt when fs_generation moves). Nodes live in fixed
+// pools and link to their first child and next sibling.
+typedef struct {
+    char c;
+    uint8_t end;      // a name ends here
+    uint16_t child;   // 0 = none (the root is never anyone's child)
+    uint16_t next;
+} TrieNode;
 
-            saved_count++;
+typedef struct {
+    TrieNode* nodes;
+    uint16_t count;
+    uint16_t cap;
+} Trie;
+
+TrieNode command_trie_nodes[512];
+TrieNode file_trie_nodes[MAX_FILES * 16 + 1];
+Trie command_trie = { command_trie_nodes, 0, 512 };
+Trie file_trie = { file_trie_nodes, 0, MAX_FILES * 16 + 1 };
+uint32_t file_trie_generation = 0xFFFFFFFF;
+
+static void trie_clear(Trie* t) {
+    memset(&t->nodes[0], 0, sizeof(TrieNode));
+    t->count = 1;
+}
 
-            // Delete the file from FS
-            fs_delete_file(files[i].name);
+static void trie_insert(Trie* t, const char* s) {
+    uint16_t n = 0;
+    for (; *s; s++) {
+        uint16_t c = t->nodes[n].child;
+        while (c && t->nodes[c].c != *s) c = t->nodes[c].next;
+        if (!c) {
+            if (t->count >= t->cap) return;
+            c = t->count++;
+            t->nodes[c].c = *s;
+            t->nodes[c].end = 0;
+            t->nodes[c].child = 0;
+            t->nodes[c].next = t->nodes[n].child;
+            t->nodes[n].child = c;
         }
+        n = c;
     }
+    t->nodes[n].end = 1;
 }
 
-// Restore all files from memory
-void restore_all_files() {
-    for (int i = 0; i < saved_count; i++) {
-        fs_write_file(saved_files[i].name, saved_files[i].content);
+// node reached by `len` chars of `s`, -1 if no name starts like that
+static int trie_find(Trie* t, const char* s, int len) {
+    uint16_t n = 0;
+    for (int i = 0; i < len; i++) {
+        uint16_t c = t->nodes[n].child;
+        while (c && t->nodes[c].c != s[i]) c = t->nodes[c].next;
+        if (!c) return -1;
+        n = c;
     }
+    return n;
 }
 
-void delay(uint32_t milliseconds) {    volatile uint32_t count;
-    for (uint32_t ms = 0; ms < milliseconds; ms++) {
-        for (count = 0; count < 100000; count++) {
-            __asm__ volatile("nop"); // prevent compiler optimizing it away
-        }
+// prints every name below node `n`, `prefix` holds the `len` chars that led there
+static void trie_list(Trie* t, uint16_t n, char* prefix, int len) {
+    if (t->nodes[n].end) {
+        prefix[len] = '\0';
+        kprint(prefix, os_color);
+        kprint("  ", os_color);
+    }
+    for (uint16_t c = t->nodes[n].child; c; c = t->nodes[c].next) {
+        if (len >= MAX_CMD_LEN - 1) break;
+        prefix[len] = t->nodes[c].c;
+        trie_list(t, c, prefix, len + 1);
     }
 }
 
-void handle_command(char* buffer);
+void command_trie_init(void) {
+    trie_clear(&command_trie);
+    for (int i = 0; i < command_count; i++) {
+        trie_insert(&command_trie, commands[i].name);
+        if (commands[i].alias) trie_insert(&command_trie, commands[i].alias);
+    }
+}
 
-// ----------------- Shell variables adsgfadgad -----------------
+// sets up lookup and completion for commands[], once at boot
+void command_table_init(void) {
+    uint32_t seed = 0;
+    while (!cmd_hash_try(seed)) seed++;
+    cmd_hash_seed = seed;
+    command_trie_init();
+}
 
-#define MAX_VARS 64
-#define MAX_VAR_NAME 32
-#define MAX_VAR_VALUE 256
+static void file_trie_refresh(void) {
+    if (file_trie_generation == fs_generation) return;
+    trie_clear(&file_trie);
+    for (int i = 0; i < MAX_FILES; i++)
+        if (files[i].used) trie_insert(&file_trie, files[i].name);
+    file_trie_generation = fs_generation;
+}
 
-typedef enum { VAR_INT, VAR_STR } VarType;
+// Completes the word before the cursor: the first word against commands, the
+// others against file names. Fills in as much as all matches share; with
+// `list` and nothing left to fill in it prints the candidates.
+void shell_complete(char* buffer, int* pos, int maxlen, int list) {
+    int start = *pos;
+    while (start > 0 && buffer[start - 1] != ' ') start--;
+    int first_word = 1;
+    for (int i = 0; i < start; i++)
+        if (buffer[i] != ' ') { first_word = 0; break; }
+
+    Trie* t = &command_trie;
+    if (!first_word) {
+        file_trie_refresh();
+        t = &file_trie;
+    }
 
-typedef struct {
-    char name[MAX_VAR_NAME];
-    VarType type;
-    int int_value;
-    char str_value[MAX_VAR_VALUE];
-    uint8_t used;
-} Variable;
+    int n = trie_find(t, buffer + start, *pos - start);
+    if (n < 0) return;
 
-Variable vars[MAX_VARS];
+    int added = 0;
+    while (!t->nodes[n].end && t->nodes[n].child && !t->nodes[t->nodes[n].child].next) {
+        if (*pos >= maxlen - 1) return;
+        n = t->nodes[n].child;
+        buffer[(*pos)++] = t->nodes[n].c;
+        kput_char(t->nodes[n].c, os_color);
+        added++;
+    }
 
-Variable* find_var(const char* name) {
-    for (int i = 0; i < MAX_VARS; i++) {
-        if (vars[i].used && strcmp(vars[i].name, name)) {
-            return &vars[i];
+    if (t->nodes[n].end && !t->nodes[n].child) {
+        // exactly one match and it's complete
+        if (*pos < maxlen - 1) {
+            buffer[(*pos)++] = ' ';
+            kput_char(' ', os_color);
         }
+        return;
     }
-    return NULL;
+
+    if (added || !list) return;
+
+    char prefix[MAX_CMD_LEN];
+    int len = *pos - start;
+    memcpy(prefix, buffer + start, len);
+    kput_char('\n', os_color);
+    trie_list(t, n, prefix, len);
+    kput_char('\n', os_color);
+    kprint(SHELL_PROMPT, SHELL_PROMPT_COLOR);
+    buffer[*pos] = '\0';
+    kprint(buffer, os_color);
 }
 
-Variable* set_var_int(const char* name, int value) {
-    Variable* v = find_var(name);
-    if (!v) {
-        for (int i = 0; i < MAX_VARS; i++) {
-            if (!vars[i].used) {
-                v = &vars[i];
-                v->used = 1;
-                strncpy(v->name, name, MAX_VAR_NAME);
-                break;
-            }
-        }
+// interactive commands only make sense in the shell's own thread
+static int command_allowed(Command* cmd, int background) {
+    if (!(cmd->flags & CMD_INTERACTIVE)) return 1;
+    if (!background && this_thread()->shell) return 1;
+    kprint(cmd->name, (os_color & 0xF0) | 0x0C);
+    kprint(" can't run in the background!\n", (os_color & 0xF0) | 0x0C);
+    return 0;
+}
+
+void handle_command(char* buffer);
+
+static void job_main(void* arg) {
+    handle_command(arg);
+    kfree(arg);
+}
+
+// "cmd &": runs cmd in a thread of its own and returns to the prompt
+static void job_start(char* line) {
+    char* copy = kstrdup(line);
+    Thread* t = copy ? thread_create(line, job_main, copy) : NULL;
+    if (!t) {
+        kfree(copy);
+        kprint("Can't start the job, out of memory!\n", (os_color & 0xF0) | 0x0C);
+        return;
     }
-    if (!v) return NULL;
+    kput_char('[', os_color);
+    kprint_dec(t->id, os_color);
+    kprint("] ", os_color);
+    kprint(t->name, os_color);
+    kput_char('\n', os_color);
+}
 
-    v->type = VAR_INT;
-    v->int_value = value;
-    return v;
+static void dispatch_command(char* buffer);
+
+// the first | outside quotes, so kprint "a|b", 0x0F still works
+static char* pipe_find(char* line) {
+    int quoted = 0;
+    for (; *line; line++) {
+        if (*line == '"') quoted = !quoted;
+        else if (*line == '|' && !quoted) return line;
+    }
+    return NULL;
 }
 
-Variable* set_var_str(const char* name, const char* value) {
-    Variable* v = find_var(name);
-    if (!v) {
-        for (int i = 0; i < MAX_VARS; i++) {
-            if (!vars[i].used) {
-                v = &vars[i];
-                v->used = 1;
-                strncpy(v->name, name, MAX_VAR_NAME);
-                break;
-            }
+// "a | b | c": runs a with its output going into a buffer, then b reading that
+// buffer and writing the next one, and so on; only c prints to the screen.
+// Two buffers are enough since each stage only needs the one before it.
+static void run_pipeline(char* line) {
+    Thread* self = this_thread();
+    Pipe* saved_in = self->pipe_in;
+    Pipe* saved_out = self->pipe_out;
+    Pipe bufs[2];
+    memset(bufs, 0, sizeof(bufs));
+    int cur = 0, cut = 0;
+
+    for (;;) {
+        char* bar = pipe_find(line);
+        if (bar) {
+            char* e = bar;
+            while (e > line && e[-1] == ' ') e--; // "read x | ..." reads "x", not "x "
+            *e = '\0';
         }
+        self->pipe_out = bar ? &bufs[cur] : saved_out;
+        dispatch_command(line);
+        if (!bar || thread_killed()) break;
+        cut |= bufs[cur].full;
+
+        self->pipe_in = &bufs[cur];
+        cur ^= 1;
+        bufs[cur].len = bufs[cur].pos = 0;
+        bufs[cur].full = 0;
+        line = bar + 1;
     }
-    if (!v) return NULL;
 
-    v->type = VAR_STR;
-    strncpy(v->str_value, value, MAX_VAR_VALUE);
-    return v;
+    self->pipe_in = saved_in;
+    self->pipe_out = saved_out;
+    kfree(bufs[0].data);
+    kfree(bufs[1].data);
+    if (cut) kprint("Pipe cut off at 1MB!\n", (os_color & 0xF0) | 0x0C);
 }
 
-void cmd_str(char* args) {
-    char* p = args;
-
-    // read name
-    char name[MAX_VAR_NAME];
-    int ni = 0;
+static void dispatch_command(char* buffer) {
+    while (*buffer == ' ') buffer++; // skip leading spaces
 
-    while (*p && *p != ' ' && *p != '=' && ni < MAX_VAR_NAME - 1) {
-        name[ni++] = *p++;
+    uint32_t end = strlen(buffer);
+    while (end && buffer[end - 1] == ' ') end--;
+    if (end && buffer[end - 1] == '&') {
+        do buffer[--end] = '\0'; while (end && buffer[end - 1] == ' ');
+        uint32_t n = 0;
+        while (buffer[n] && buffer[n] != ' ') n++;
+        Command* cmd = command_lookup(buffer, n);
+        if (end && (!cmd || command_allowed(cmd, 1))) job_start(buffer);
+        return;
     }
-    name[ni] = 0;
 
-    if (ni == 0) {
-        kprint("missing name\n", os_color);
+    if (pipe_find(buffer)) {
+        run_pipeline(buffer);
         return;
     }
 
-    // skip spaces
-    while (*p == ' ') p++;
+    uint32_t len = 0;
+    while (buffer[len] && buffer[len] != ' ') len++;
+    if (len == 0) return;
 
-    // require =
-    if (*p != '=') {
-        kprint("syntax error: expected '='\n", os_color);
-        return;
-    }
-    p++;
+    Command* cmd = command_lookup(buffer, len);
+    if (cmd) {
+        if (!command_allowed(cmd, 0)) return;
 
-    // skip spaces
-    while (*p == ' ') p++;
+        if (cmd->flags & CMD_FULL_LINE) {
+            cmd->func(buffer);  // pass entire buffer
+            return;
+        }
 
-    // require starting quote
-    if (*p != '"') {
-        kprint("syntax error: expected opening '\"'\n", os_color);
+        // normal case: pass args only
+        char* args = buffer + len;
+        while (*args == ' ') args++; // skip spaces after command
+        cmd->func(args);
         return;
     }
-    p++;
 
-    // read string value
-    char value[MAX_VAR_VALUE];
-    int vi = 0;
+    kprint("Unknown command: ", os_color);
+    kprint(buffer, os_color);
+    kput_char('\n', os_color);
+}
 
-    while (*p && *p != '"' && vi < MAX_VAR_VALUE - 1) {
-        value[vi++] = *p++;
-    }
-    value[vi] = 0;
+// everything a command takes from the scratch arena is gone when it returns
+static void run_command_scoped(void (*fn)(char*), char* args) {
+    Thread* self = this_thread();
+    ArenaMark mark = scratch_mark();
+    self->command_depth++;
 
-    if (*p != '"') {
-        kprint("syntax error: missing closing '\"'\n", os_color);
-        return;
-    }
+    fn(args);
 
-    set_var_str(name, value);
-    kprint("ok\n", os_color);
+    self->command_depth--;
+    scratch_release(mark);
+    if (self->command_depth == 0)
+        arena_reset(&self->arena);
 }
 
-void cmd_int(char* args) {
-    char* p = args;
+void handle_command(char* buffer) {
+    run_command_scoped(dispatch_command, buffer);
+}
 
-    // read name
-    char name[MAX_VAR_NAME];
-    int ni = 0;
+// ================== User programs ==================
+// `run X` loads ELF32 executable X (static, linked at USER_BASE or above) into
+// an address space of its own and runs it in ring 3 in the calling thread, so
+// `run X &` makes it a background job like any other. The kernel half of every
+// address space is the same as page_directory; the user half gets 4KB pages
+// from the PMM.
+//
+// Syscalls are int 0x80 with the number in eax and arguments in ebx, ecx,
+// edx, esi; the result comes back in eax (negative = error):
+//   SYS_EXIT    code
+//   SYS_READ    fd (0), buf, len           a line from the keyboard, shell only;
+//                                          piped input: up to len bytes, 0 at the end
+//   SYS_WRITE   fd (1 or 2), buf, len      to the console, 2 in red
+//   SYS_FREAD   name, buf, len, offset     bytes read
+//   SYS_FWRITE  name, buf, len             replaces the file
+//   SYS_FAPPEND name, buf, len
+//   SYS_FSIZE   name
+// A program starts at its entry point with esp pointing at argc, then
+// argv[0..argc-1] and a NULL, like on Linux.
+#define USER_BASE 0x40000000u
+#define USER_TOP  0x80000000u
+#define USER_STACK_PAGES 16
+#define USER_STACK_BOTTOM (USER_TOP - USER_STACK_PAGES * PAGE_SIZE)
+#define USER_MAX_ARGS 16
+
+#define SYS_EXIT    1
+#define SYS_READ    3
+#define SYS_WRITE   4
+#define SYS_FREAD   100
+#define SYS_FWRITE  101
+#define SYS_FAPPEND 102
+#define SYS_FSIZE   103
+
+typedef struct {
+    uint8_t  ident[16];
+    uint16_t type;
+    uint16_t machine;
+    uint32_t version;
+    uint32_t entry;
+    uint32_t phoff;
+    uint32_t shoff;
+    uint32_t flags;
+    uint16_t ehsize;
+    uint16_t phentsize;
+    uint16_t phnum;
+    uint16_t shentsize;
+    uint16_t shnum;
+    uint16_t shstrndx;
+} __attribute__((packed)) Elf32Header;
+
+typedef struct {
+    uint32_t type;
+    uint32_t offset;
+    uint32_t vaddr;
+    uint32_t paddr;
+    uint32_t filesz;
+    uint32_t memsz;
+    uint32_t flags;
+    uint32_t align;
+} __attribute__((packed)) Elf32Phdr;
+
+#define PT_LOAD 1
+#define PF_W    2
+
+// in kernel.asm: drops to ring 3 at `entry` (interrupts off until then) after
+// saving the kernel esp in *kernel_esp and *tss_esp0; returns the code
+// user_leave gets
+extern int user_enter(uint32_t entry, uint32_t user_esp, uint32_t* kernel_esp, uint32_t* tss_esp0);
+extern void user_leave(uint32_t kernel_esp, int code);
+
+// ----------------- address spaces -----------------
+static uint32_t* uspace_create(void) {
+    uint32_t* pd = pmm_alloc_page();
+    if (!pd) return NULL;
+    memcpy(pd, page_directory, PAGE_SIZE);
+    for (uint32_t a = USER_BASE; a < USER_TOP; a += 1u << 22) pd[a >> 22] = 0;
+    return pd;
+}
 
-    while (*p && *p != ' ' && *p != '=' && ni < MAX_VAR_NAME - 1) {
-        name[ni++] = *p++;
+static uint32_t* uspace_pte(uint32_t* pd, uint32_t vaddr, int create) {
+    uint32_t pdi = vaddr >> 22;
+    if (!(pd[pdi] & PAGE_PRESENT)) {
+        if (!create) return NULL;
+        uint32_t* table = pmm_alloc_page();
+        if (!table) return NULL;
+        memset(table, 0, PAGE_SIZE);
+        pd[pdi] = (uint32_t)table | PAGE_PRESENT | PAGE_WRITE | PAGE_USER;
     }
-    name[ni] = 0;
+    uint32_t* table = (uint32_t*)(pd[pdi] & ~0xFFFu);
+    return &table[(vaddr >> 12) & 0x3FF];
+}
 
-    if (ni == 0) {
-        kprint("missing name\n", os_color);
-        return;
+// maps a zeroed page at `vaddr` (if it isn't yet) and returns its frame
+static uint8_t* uspace_map(uint32_t* pd, uint32_t vaddr, int writable) {
+    uint32_t* pte = uspace_pte(pd, vaddr, 1);
+    if (!pte) return NULL;
+    if (!(*pte & PAGE_PRESENT)) {
+        uint8_t* frame = pmm_alloc_page();
+        if (!frame) return NULL;
+        memset(frame, 0, PAGE_SIZE);
+        *pte = (uint32_t)frame | PAGE_PRESENT | PAGE_USER;
     }
+    if (writable) *pte |= PAGE_WRITE;
+    return (uint8_t*)(*pte & ~0xFFFu);
+}
 
-    // skip spaces
-    while (*p == ' ') p++;
+// copies into pages mapped already, through their identity-mapped frames
+static void uspace_copy(uint32_t* pd, uint32_t vaddr, const void* src, uint32_t len) {
+    while (len) {
+        uint32_t off = vaddr & (PAGE_SIZE - 1);
+        uint32_t n = PAGE_SIZE - off < len ? PAGE_SIZE - off : len;
+        uint8_t* frame = (uint8_t*)(*uspace_pte(pd, vaddr, 0) & ~0xFFFu);
+        memcpy(frame + off, src, n);
+        vaddr += n;
+        src = (const uint8_t*)src + n;
+        len -= n;
+    }
+}
 
-    // require =
-    if (*p != '=') {
-        kprint("syntax error: expected '='\n", os_color);
-        return;
+static void uspace_destroy(uint32_t* pd) {
+    for (uint32_t pdi = USER_BASE >> 22; pdi < USER_TOP >> 22; pdi++) {
+        if (!(pd[pdi] & PAGE_PRESENT)) continue;
+        uint32_t* table = (uint32_t*)(pd[pdi] & ~0xFFFu);
+        for (int i = 0; i < 1024; i++)
+            if (table[i] & PAGE_PRESENT) pmm_free_page((void*)(table[i] & ~0xFFFu));
+        pmm_free_page(table);
     }
-    p++;
+    pmm_free_page(pd);
+}
 
-    // skip spaces
-    while (*p == ' ') p++;
+// is [p, p + len) user memory the running program may `write` to?
+static int user_range_ok(uint32_t p, uint32_t len, int write) {
+    if (p < USER_BASE || p >= USER_TOP || len > USER_TOP - p) return 0;
+    uint32_t* pd = this_thread()->pgdir;
+    uint32_t need = PAGE_PRESENT | PAGE_USER | (write ? PAGE_WRITE : 0);
+    for (uint32_t page = p & ~0xFFFu; page < p + len; page += PAGE_SIZE) {
+        uint32_t* pte = uspace_pte(pd, page, 0);
+        if (!pte || (*pte & need) != need) return 0;
+    }
+    return 1;
+}
 
-    // read integer (supports sign)
-    int neg = 0;
-    int value = 0;
+// copies a file name out of user memory; 0 if it isn't a valid one
+static int user_name(uint32_t p, char* out) {
+    for (int i = 0; i < 16; i++) {
+        if (!user_range_ok(p + i, 1, 0)) return 0;
+        out[i] = ((const char*)p)[i];
+        if (!out[i]) return i > 0;
+    }
+    return 0; // names are at most 15 characters
+}
 
-    if (*p == '-') { neg = 1; p++; }
+// ----------------- loading -----------------
+// checks the ELF headers and maps every PT_LOAD segment into `pd`
+static const char* elf_load(uint32_t* pd, const uint8_t* img, uint32_t size, uint32_t* entry) {
+    const Elf32Header* h = (const Elf32Header*)img;
+    if (size < sizeof(Elf32Header) || h->ident[0] != 0x7F || h->ident[1] != 'E'
+        || h->ident[2] != 'L' || h->ident[3] != 'F')
+        return "not an ELF file";
+    if (h->ident[4] != 1 || h->ident[5] != 1 || h->type != 2 || h->machine != 3)
+        return "not a 32-bit x86 executable";
+    if (h->phentsize != sizeof(Elf32Phdr) || h->phoff > size
+        || h->phnum > (size - h->phoff) / sizeof(Elf32Phdr))
+        return "broken program headers";
+    if (h->entry < USER_BASE || h->entry >= USER_STACK_BOTTOM)
+        return "entry point outside user memory";
+
+    const Elf32Phdr* ph = (const Elf32Phdr*)(img + h->phoff);
+    for (int i = 0; i < h->phnum; i++, ph++) {
+        if (ph->type != PT_LOAD || ph->memsz == 0) continue;
+        if (ph->filesz > ph->memsz || ph->offset > size || ph->filesz > size - ph->offset)
+            return "broken segment";
+        if (ph->vaddr < USER_BASE || ph->memsz > USER_STACK_BOTTOM - ph->vaddr)
+            return "segment outside user memory";
+
+        for (uint32_t page = ph->vaddr & ~0xFFFu; page < ph->vaddr + ph->memsz; page += PAGE_SIZE)
+            if (!uspace_map(pd, page, ph->flags & PF_W)) return "out of memory";
+        uspace_copy(pd, ph->vaddr, img + ph->offset, ph->filesz); // the rest stays zero
+    }
+    *entry = h->entry;
+    return NULL;
+}
 
-    if (*p < '0' || *p > '9') {
-        kprint("syntax error: expected number\n", os_color);
-        return;
+// builds the initial stack: the argument strings, then argv[] and argc below them
+static uint32_t user_stack(uint32_t* pd, const char* name, char* args) {
+    for (uint32_t page = USER_STACK_BOTTOM; page < USER_TOP; page += PAGE_SIZE)
+        if (!uspace_map(pd, page, 1)) return 0;
+
+    char* argv[USER_MAX_ARGS];
+    int argc = 0;
+    argv[argc++] = (char*)name;
+    while (*args && argc < USER_MAX_ARGS) {
+        while (*args == ' ') *args++ = '\0';
+        if (!*args) break;
+        argv[argc++] = args;
+        while (*args && *args != ' ') args++;
     }
+    while (*args == ' ') *args++ = '\0';
+
+    uint32_t sp = USER_TOP;
+    uint32_t uargv[USER_MAX_ARGS + 2];
+    for (int i = argc - 1; i >= 0; i--) {
+        uint32_t len = strlen(argv[i]) + 1;
+        if (sp - len < USER_STACK_BOTTOM + PAGE_SIZE) return 0; // leave the program a page
+        sp -= len;
+        uspace_copy(pd, sp, argv[i], len);
+        uargv[i + 1] = sp;
+    }
+    uargv[0] = argc;
+    uargv[argc + 1] = 0;
+    sp = (sp & ~3u) - (argc + 2) * 4;
+    uspace_copy(pd, sp, uargv, (argc + 2) * 4);
+    return sp;
+}
 
-    while (*p >= '0' && *p <= '9') {
-        value = value * 10 + (*p - '0');
-        p++;
+// Runs ELF file `name` with `args` (split at spaces, modified in place) until it
+// exits; returns its exit code, or -1 if it crashed, got killed or didn't load.
+int user_exec(const char* name, char* args) {
+    uint8_t red = (os_color & 0xF0) | 0x0C;
+    uint32_t size;
+    uint8_t* img = fs_mmap(name, &size, FS_MAP_PRIVATE);
+    if (!img) {
+        kprint("File not found!\n", red);
+        return -1;
     }
 
-    if (neg) value = -value;
+    uint32_t* pd = uspace_create();
+    uint32_t entry = 0, esp = 0;
+    const char* err = pd ? elf_load(pd, img, size, &entry) : "out of memory";
+    if (!err && !(esp = user_stack(pd, name, args))) err = "arguments don't fit";
+    fs_munmap(img);
+    if (err) {
+        kprint(name, red);
+        kprint(": ", red);
+        kprint(err, red);
+        kput_char('\n', red);
+        if (pd) uspace_destroy(pd);
+        return -1;
+    }
 
-    set_var_int(name, value);
-    kprint("ok\n", os_color);
+    // user_leave comes back here from inside an interrupt or syscall
+    Thread* self = this_thread();
+    int depth = interrupt_depth;
+    __asm__ volatile("cli");
+    self->pgdir = pd;
+    __asm__ volatile("mov %0, %%cr3" : : "r"(pd) : "memory");
+    int code = user_enter(entry, esp, &self->user_return, &tss[self->cpu->id].esp0);
+    interrupt_depth = depth;
+
+    __asm__ volatile("cli");
+    self->pgdir = NULL;
+    __asm__ volatile("mov %0, %%cr3" : : "r"(page_directory) : "memory");
+    __asm__ volatile("sti");
+    uspace_destroy(pd);
+    return code;
 }
 
-// ----------------- Command functions -----------------
-void cmd_clear(char* args) {
-    (void)args;
-    kclear();
+void user_exit(int code) {
+    user_leave(this_thread()->user_return, code);
 }
 
-void cmd_help(char* args) {
-    (void)args;
-    kprint("ZurOS commands list:\n", (os_color & 0xF0) | 0x0A);
-    kprint("ascii - prints out an ascii art\n", os_color);
-    kprint("beep X Y - plays music from X notes (c-b) or pauses (x), for Yms (1000ms - 1s) separated by ':', for example: \"beep c 100: d 100: e 100: g 250: x 1000: c 100\"", os_color);
-    kprint("clear - clears the screen\n", os_color);
-    kprint("color 0xXY - sets OS's color\n", os_color);
-    kprint("color -themes - shows color themes\n", os_color);
-    kprint("dir - lists all files\n", os_color);
-    kprint("delete X - deletes file X\n", os_color);
-    kprint("exit - shuts down computer\n", os_color);
-    kprint("int X = Y - sets X integer variable to Y", os_color);
-    kprint("kprint \"X\", Y, Z - prints X in Z color (Z arg is optional) with Y args (for example kprint \"Hello, %s you are %i years old\", name, age, 0x0F)\n", os_color);
-    kprint("read X - prints file X\n", os_color);
-    kprint("str X = \"Y\" - sets X string variable to \"Y\"", os_color);
-    kprint("test - prints test messages\n", os_color);
-    kprint("write X Y - writes Y to X file\n", os_color);
-    kprint("zscript X - runs X zscript file (.zs) with shell commands inside", os_color);
-    kprint("zw X - opens ZurOS writer for file X\n", os_color);
-    kprint("Z - very funny polish joke\n", os_color);
+// an exception in ring 3 ends the program instead of the kernel
+void user_fault(InterruptFrame* f, const char* what) {
+    uint8_t red = (os_color & 0xF0) | 0x0C;
+    // the crash report goes to the screen even from "run prog | grep x"
+    Thread* self = this_thread();
+    Pipe* out = self->pipe_out;
+    self->pipe_out = NULL;
+    kprint("\nProgram crashed: ", red);
+    kprint(what, red);
+    kprint(" at eip=", red);
+    kprint_hex(f->eip, red);
+    kput_char('\n', red);
+    self->pipe_out = out;
+    user_exit(-1);
 }
 
-void cmd_exit(char* args) {
-	fs_dir();
-	delay(500);
-	kclear();
-	kprint("Goodbye...", os_color);
-	delay(2500);
-    (void)args;
-    shutdown();
+// ----------------- syscalls -----------------
+static int32_t sys_write(uint32_t fd, uint32_t buf, uint32_t len) {
+    if ((fd != 1 && fd != 2) || !user_range_ok(buf, len, 0)) return -1;
+    uint8_t color = fd == 2 ? (os_color & 0xF0) | 0x0C : os_color;
+    uint32_t flags = console_acquire(); // one write isn't torn up by another CPU's
+    for (uint32_t i = 0; i < len; i++) kput_char(((const char*)buf)[i], color);
+    console_release(flags);
+    return len;
 }
 
-void cmd_test(char* args) {
-    (void)args;
-    for (int i = 0; i < 16; i++) {
-        kprint("Hello, World! - 0x", i);
-        kput_char("0123456789ABCDEF"[i], i);
-        kput_char('\n', i);
+static int32_t sys_read(uint32_t fd, uint32_t buf, uint32_t len) {
+    if (fd != 0 || len == 0 || !user_range_ok(buf, len, 1)) return -1;
+    Pipe* in = this_thread()->pipe_in;
+    if (in) {
+        uint32_t n = in->len - in->pos;
+        if (n > len) n = len;
+        memcpy((char*)buf, in->data + in->pos, n);
+        in->pos += n;
+        return n;
     }
+    if (!this_thread()->shell) return -1; // jobs don't get the keyboard
+    char line[MAX_CMD_LEN];
+    kread_line(line, len < sizeof(line) ? len : sizeof(line));
+    uint32_t n = strlen(line);
+    memcpy((char*)buf, line, n + 1); // kread_line kept it under len
+    return n;
 }
 
-void cmd_Z(char* args) {
-    (void)args;
-    kprint("Przychodzi baba do lekarza...\n", os_color);
-    kprint("A lekarz tez baba!!!\n", os_color);
+static int32_t sys_fread(uint32_t name, uint32_t buf, uint32_t len, uint32_t offset) {
+    char fname[16];
+    if (!user_name(name, fname) || !user_range_ok(buf, len, 1)) return -1;
+    uint32_t size;
+    uint8_t* data = fs_mmap(fname, &size, FS_MAP_PRIVATE);
+    if (!data) return -1;
+    uint32_t n = offset < size ? size - offset : 0;
+    if (n > len) n = len;
+    memcpy((void*)buf, data + offset, n);
+    fs_munmap(data);
+    return n;
 }
 
-void cmd_ascii(char* args) {
-    (void)args;
-    kprint("ASCII art output...\n", os_color); // you can put the full art here
+static int32_t sys_fsize(uint32_t name) {
+    char fname[16];
+    if (!user_name(name, fname)) return -1;
+    mutex_lock(&fs_lock);
+    int fi = fs_find(fname);
+    int32_t size = fi < 0 ? -1 : (int32_t)files[fi].size;
+    mutex_unlock(&fs_lock);
+    return size;
 }
 
-void cmd_color(char* args) {
-    while (*args == ' ') args++;
-    if (*args == '-') {
-        if (strcmp(args, "-themes")) {
-            kprint("CLASSIC - 0x0F\n", 0x0F);
-            kprint("LIGHT MODE - 0xF2\n", 0xF2);
-            kprint("TEMPLE - 0xB2\n", 0xB2);
-            kprint("UNREADABLE PINK - 0xDF\n", 0xDF);
-        }
+void syscall_dispatch(InterruptFrame* f) {
+    if (!this_thread()->pgdir) { // int 0x80 from the kernel itself
+        f->eax = (uint32_t)-1;
         return;
     }
-    if (args[0] == '0' && (args[1] == 'x' || args[1] == 'X')) {
-        args += 2;
-        if ((args[0] >= '0' && args[0] <= '9') || (args[0] >= 'A' && args[0] <= 'F') || (args[0] >= 'a' && args[0] <= 'f')) {
-            if ((args[1] >= '0' && args[1] <= '9') || (args[1] >= 'A' && args[1] <= 'F') || (args[1] >= 'a' && args[1] <= 'f')) {
-                os_color = (hex_to_nibble(args[0]) << 4) | hex_to_nibble(args[1]);
-                kclear();
-                return;
-            }
+    char fname[16];
+    int32_t r = -1;
+    switch (f->eax) {
+    case SYS_EXIT:
+        user_exit((int)f->ebx);
+        break;
+    case SYS_READ:
+        r = sys_read(f->ebx, f->ecx, f->edx);
+        break;
+    case SYS_WRITE:
+        r = sys_write(f->ebx, f->ecx, f->edx);
+        break;
+    case SYS_FREAD:
+        r = sys_fread(f->ebx, f->ecx, f->edx, f->esi);
+        break;
+    case SYS_FWRITE:
+        if (user_name(f->ebx, fname) && user_range_ok(f->ecx, f->edx, 0)) {
+            fs_write_data(fname, (const char*)f->ecx, f->edx);
+            r = f->edx;
         }
+        break;
+    case SYS_FAPPEND:
+        if (user_name(f->ebx, fname) && user_range_ok(f->ecx, f->edx, 0))
+            r = fs_append_file(fname, (const char*)f->ecx, f->edx) ? (int32_t)f->edx : -1;
+        break;
+    case SYS_FSIZE:
+        r = sys_fsize(f->ebx);
+        break;
     }
-    kprint("Invalid color format! Use color 0xXY\n", (os_color & 0xF0) | 0x0C);
-}
-
-void cmd_dir(char* args) {
-    (void)args;
-    fs_load();
-    fs_dir();
-}
-
-void cmd_read(char* args) {
-    while (*args == ' ') args++;
-    fs_load();
-    fs_read_file(args);
+    f->eax = (uint32_t)r;
 }
 
-void cmd_write(char* args) {
+void cmd_run(char* args) {
     while (*args == ' ') args++;
-    char* space = strchr(args, ' ');
-    if (!space) {
-        kprint("Usage: write <filename> <text>\n", (os_color & 0xF0) | 0x0C);
-        return;
-    }
-    *space = '\0';
-    char* filename = args;
-    char* text = space + 1;
-    while (*text == ' ') text++;
-    fs_delete_file(filename);
-    fs_write_file(filename, text);
-    kprint("File written successfully!\n", (os_color & 0xF0) | 0x0A);
+    if (!*args) {
+        kprint("Usage: run X [args] (X is an ELF program)\n", (os_color & 0xF0) | 0x0C);
+        return;
+    }
+    char name[16];
+    int len = 0;
+    while (args[len] && args[len] != ' ') len++;
+    if (len > 15) {
+        kprint("File not found!\n", (os_color & 0xF0) | 0x0C);
+        return;
+    }
+    memcpy(name, args, len);
+    name[len] = '\0';
+
+    int code = user_exec(name, args + len);
+    if (code != 0) {
+        kprint(name, os_color);
+        kprint(" exited with ", os_color);
+        kprint_int(code, os_color);
+        kput_char('\n', os_color);
+    }
 }
 
-void cmd_delete(char* args) {
-    while (*args == ' ') args++;
-    fs_load();
-    fs_delete_file(args);
+// ================== zscript compiler and VM ==================
+// A script is compiled in one pass before anything runs. Each statement becomes
+// one instruction with its command already looked up, int/str values parsed,
+// variables turned into slot numbers and kprint's format cut into pieces, so a
+// syntax error stops the script before its first statement. Strings live in a
+// pool and the code refers to them by offset.
+enum { OP_END, OP_CALL, OP_SET_INT, OP_SET_STR, OP_PRINT };
+enum { PIECE_TEXT, PIECE_STR, PIECE_INT };
+
+#define ZS_MAX_ARGS 8
+#define ZS_DEFAULT_COLOR 0x100 // kprint without a color: os_color at run time
+
+typedef struct {
+    uint8_t* code;
+    uint32_t code_len, code_cap;
+    char* pool;
+    uint32_t pool_len, pool_cap;
+    uint32_t* var_names;     // pool offset of each slot's name
+    uint32_t var_count, var_cap;
+    int line;                // source line being compiled, 0 = typed at the prompt
+    int error;
+} ZsProgram;
+
+static void zs_free(ZsProgram* p) {
+    kfree(p->code);
+    kfree(p->pool);
+    kfree(p->var_names);
 }
 
-void cmd_zw(char* args) {
-    while (*args == ' ') args++;
-    if (*args) {
-        fs_load();
-        zuros_writer(args);
-    } else {
-        kprint("Usage: zw <filename>\n", (os_color & 0xF0) | 0x0C);
+static void zs_error(ZsProgram* p, const char* msg, const char* detail) {
+    if (p->error) return;
+    p->error = 1;
+    if (p->line) {
+        kprint("zscript: line ", (os_color & 0xF0) | 0x0C);
+        kprint_dec(p->line, (os_color & 0xF0) | 0x0C);
+        kprint(": ", (os_color & 0xF0) | 0x0C);
+    }
+    kprint(msg, os_color);
+    if (detail) {
+        kprint(detail, os_color);
+        kput_char('\n', os_color);
     }
 }
 
-static char* skip_leading_whitespace(char* str) {
-    while (*str == '\n' || *str == ' ' || *str == '\t') str++;
-    return str;
+// grows `*buf` (of `*cap` bytes) to hold `need`
+static int zs_reserve(ZsProgram* p, void** buf, uint32_t* cap, uint32_t need) {
+    if (need <= *cap) return 1;
+    uint32_t n = *cap ? *cap : 64;
+    while (n < need) n *= 2;
+    void* b = krealloc(*buf, n);
+    if (!b) {
+        zs_error(p, "zscript: out of memory!\n", NULL);
+        return 0;
+    }
+    *buf = b;
+    *cap = n;
+    return 1;
 }
 
-void cmd_zscript(char* args) {
-    fs_load();
-    uint8_t buffer[MAX_FILE_CONTENT];
+static void zs_emit(ZsProgram* p, const void* data, uint32_t n) {
+    if (!zs_reserve(p, (void**)&p->code, &p->code_cap, p->code_len + n)) return;
+    memcpy(p->code + p->code_len, data, n);
+    p->code_len += n;
+}
 
-    for (int i = 0; i < MAX_FILES; i++) {
-        if (files[i].used && strcmp(files[i].name, args)) {
-            if (files[i].size >= MAX_FILE_CONTENT) return;
+static void zs_emit8(ZsProgram* p, uint8_t v)   { zs_emit(p, &v, 1); }
+static void zs_emit16(ZsProgram* p, uint16_t v) { zs_emit(p, &v, 2); }
+static void zs_emit32(ZsProgram* p, uint32_t v) { zs_emit(p, &v, 4); }
+
+// copies `len` chars into the pool as a C string, returns its offset
+static uint32_t zs_string(ZsProgram* p, const char* s, uint32_t len) {
+    uint32_t off = p->pool_len;
+    if (!zs_reserve(p, (void**)&p->pool, &p->pool_cap, off + len + 1)) return 0;
+    memcpy(p->pool + off, s, len);
+    p->pool[off + len] = '\0';
+    p->pool_len += len + 1;
+    return off;
+}
 
-            uint32_t len = files[i].size;
-            uint32_t sectors = (len + 511)/512;
-            uint32_t offset = 0;
-            for (uint32_t s = 0; s < sectors; s++) {
-                ata_read28(files[i].start + s, buffer);
-                uint32_t chunk = len - offset;
-                if (chunk > 512) chunk = 512;
-                memcpy(saved_files[0].content + offset, buffer, chunk);
-                offset += chunk;
-            }
-            saved_files[0].content[offset] = '\0';
+// slot for variable `name`, the same name always gets the same slot
+static uint16_t zs_var_slot(ZsProgram* p, const char* name) {
+    for (uint32_t i = 0; i < p->var_count; i++)
+        if (strcmp(p->pool + p->var_names[i], name) == 1) return i;
+    if (!zs_reserve(p, (void**)&p->var_names, &p->var_cap, (p->var_count + 1) * sizeof(uint32_t)))
+        return 0;
+    p->var_names[p->var_count] = zs_string(p, name, strlen(name));
+    return p->var_count++;
+}
 
-            // Split by ';' and execute each command except "exit"
-            char* cmd = saved_files[0].content;
-            char* next;
-            while ((next = strchr(cmd, ';'))) {
-                *next = '\0';
-                cmd = skip_leading_whitespace(cmd);
+// "X = ..." -> the variable name, NULL (and an error) if it isn't followed by '='
+static char* zs_parse_assign(ZsProgram* p, char* s, char* name) {
+    int ni = 0;
+    while (*s && *s != ' ' && *s != '=' && ni < MAX_VAR_NAME - 1) {
+        name[ni++] = *s++;
+    }
+    name[ni] = 0;
 
-                if (*cmd && !starts_with(cmd, "exit")) {
-                    handle_command(cmd);
-                }
+    if (ni == 0) {
+        zs_error(p, "missing name\n", NULL);
+        return NULL;
+    }
 
-                cmd = next + 1;
-            }
+    while (*s == ' ') s++;
+    if (*s != '=') {
+        zs_error(p, "syntax error: expected '='\n", NULL);
+        return NULL;
+    }
+    s++;
+    while (*s == ' ') s++;
+    return s;
+}
 
-            // Handle the last command
-            cmd = skip_leading_whitespace(cmd);
-            if (*cmd && !starts_with(cmd, "exit")) {
-                handle_command(cmd);
-            }
+// int X = Y
+static void zs_compile_int(ZsProgram* p, char* args) {
+    char name[MAX_VAR_NAME];
+    char* s = zs_parse_assign(p, args, name);
+    if (!s) return;
 
-            return;
-        }
+    int neg = 0;
+    uint32_t value = 0;
+    if (*s == '-') { neg = 1; s++; }
+
+    if (*s < '0' || *s > '9') {
+        zs_error(p, "syntax error: expected number\n", NULL);
+        return;
+    }
+    while (*s >= '0' && *s <= '9') {
+        value = value * 10 + (*s - '0');
+        s++;
     }
+    if (neg) value = -value;
 
-    kprint("zscript file not found!\n", (os_color & 0xF0) | 0x0C);
+    uint16_t slot = zs_var_slot(p, name);
+    zs_emit8(p, OP_SET_INT);
+    zs_emit16(p, slot);
+    zs_emit32(p, value);
 }
 
-void cmd_kprint(char* input) {
-    const char* ptr = input;
+// str X = "Y"
+static void zs_compile_str(ZsProgram* p, char* args) {
+    char name[MAX_VAR_NAME];
+    char* s = zs_parse_assign(p, args, name);
+    if (!s) return;
+
+    if (*s != '"') {
+        zs_error(p, "syntax error: expected opening '\"'\n", NULL);
+        return;
+    }
+    s++;
 
-    if (strncmp(ptr, "kprint", 6) != 0)
+    uint32_t len = 0;
+    while (s[len] && s[len] != '"' && len < MAX_VAR_VALUE - 1) len++;
+    if (s[len] != '"') {
+        zs_error(p, "syntax error: missing closing '\"'\n", NULL);
         return;
+    }
 
+    uint16_t slot = zs_var_slot(p, name);
+    uint32_t str = zs_string(p, s, len);
+    zs_emit8(p, OP_SET_STR);
+    zs_emit16(p, slot);
+    zs_emit32(p, str);
+}
+
+// kprint "fmt", a, b, 0xYZ
+static void zs_compile_kprint(ZsProgram* p, char* line) {
+    char* ptr = line;
+    if (strncmp(ptr, "kprint", 6) != 0) return;
     ptr += 6;
     while (*ptr == ' ') ptr++;
 
     if (*ptr != '"') {
-        kprint("err: missing quote\n", os_color);
+        zs_error(p, "err: missing quote\n", NULL);
         return;
     }
-    ptr++;
-
-    static char fmt[256];
-    int fi = 0;
-
-    while (*ptr && *ptr != '"' && fi < 255) {
-        fmt[fi++] = *ptr++;
-    }
-    fmt[fi] = 0;
-
+    char* fmt = ++ptr;
+    while (*ptr && *ptr != '"') ptr++;
     if (*ptr != '"') {
-        kprint("err: missing closing quote\n", os_color);
+        zs_error(p, "err: missing closing quote\n", NULL);
         return;
     }
-    ptr++; // skip closing quote
+    char* fmt_end = ptr++;
 
-    PrintArg args_list[8];
+    uint16_t slots[ZS_MAX_ARGS];
     int arg_count = 0;
 
     while (*ptr == ' ') ptr++;
@@ -1345,222 +7783,675 @@ void cmd_kprint(char* input) {
         if (ptr[0] == '0' && ptr[1] == 'x')
             break;
 
-        // read variable name
         char name[32];
         int ni = 0;
         while (*ptr && *ptr != ',' && *ptr != ' ' && ni < 31)
             name[ni++] = *ptr++;
         name[ni] = 0;
 
-        Variable* v = find_var(name);
-        if (!v) {
-            kprint("err: unknown var\n", os_color);
+        if (arg_count == ZS_MAX_ARGS) {
+            zs_error(p, "err: too many args\n", NULL);
             return;
         }
-
-        if (v->type == VAR_STR) {
-            args_list[arg_count].type = ARG_STR;
-            args_list[arg_count].v.s = v->str_value;
-        } else {
-            args_list[arg_count].type = ARG_INT;
-            args_list[arg_count].v.i = v->int_value;
-        }
-        arg_count++;
+        slots[arg_count++] = zs_var_slot(p, name);
 
         while (*ptr == ' ') ptr++;
         if (*ptr == ',') ptr++;
         else break;
     }
 
-    uint8_t color = os_color;
-
+    uint16_t color = ZS_DEFAULT_COLOR;
     if (ptr[0] == '0' && (ptr[1] == 'x' || ptr[1] == 'X')) {
         ptr += 2;
-        color = 0;
-        while ( (*ptr >= '0' && *ptr <= '9') ||
-                (*ptr >= 'A' && *ptr <= 'F') ||
-                (*ptr >= 'a' && *ptr <= 'f') ) {
-
-            color <<= 4;
-            if (*ptr >= '0' && *ptr <= '9') color += *ptr - '0';
-            else if (*ptr >= 'A' && *ptr <= 'F') color += *ptr - 'A' + 10;
-            else color += *ptr - 'a' + 10;
+        uint8_t c = 0;
+        while ((*ptr >= '0' && *ptr <= '9') ||
+               (*ptr >= 'A' && *ptr <= 'F') ||
+               (*ptr >= 'a' && *ptr <= 'f')) {
+            c = (c << 4) | hex_to_nibble(*ptr++);
+        }
+        color = c;
+    }
 
-            ptr++;
+    // cut the format into text and %s/%i pieces; a '%' before anything
+    // else just disappears, like it always did
+    uint32_t fmt_len = fmt_end - fmt;
+    if (fmt_len > 0xFFFF) {
+        zs_error(p, "err: format too long\n", NULL);
+        return;
+    }
+    uint8_t* kinds = scratch_alloc(fmt_len + 1);
+    uint32_t* texts = scratch_alloc((fmt_len + 1) * sizeof(uint32_t));
+    char* text = scratch_alloc(fmt_len + 1);
+    if (!kinds || !texts || !text) return;
+    uint16_t pieces = 0;
+    uint32_t tlen = 0;
+
+    for (char* f = fmt; f < fmt_end; f++) {
+        int kind = -1;
+        if (*f == '%') {
+            if (++f == fmt_end) break;
+            if (*f == 's') kind = PIECE_STR;
+            else if (*f == 'i') kind = PIECE_INT;
+        }
+        if (kind < 0) {
+            text[tlen++] = *f;
+            continue;
+        }
+        if (tlen) {
+            kinds[pieces] = PIECE_TEXT;
+            texts[pieces++] = zs_string(p, text, tlen);
+            tlen = 0;
         }
+        kinds[pieces++] = kind;
+    }
+    if (tlen) {
+        kinds[pieces] = PIECE_TEXT;
+        texts[pieces++] = zs_string(p, text, tlen);
     }
 
-    kprintf_dynamic(fmt, color, args_list, arg_count);
+    zs_emit8(p, OP_PRINT);
+    zs_emit16(p, color);
+    zs_emit8(p, arg_count);
+    for (int i = 0; i < arg_count; i++) zs_emit16(p, slots[i]);
+    zs_emit16(p, pieces);
+    for (int i = 0; i < pieces; i++) {
+        zs_emit8(p, kinds[i]);
+        if (kinds[i] == PIECE_TEXT) zs_emit32(p, texts[i]);
+    }
 }
 
-static void pcspk_play(uint32_t freq) {
-    uint32_t divisor = 1193180 / freq;
+static void zs_compile_statement(ZsProgram* p, char* stmt) {
+    uint32_t len = 0;
+    while (stmt[len] && stmt[len] != ' ') len++;
+
+    Command* cmd = command_lookup(stmt, len);
+    if (!cmd) {
+        char c = stmt[len];
+        stmt[len] = '\0';
+        zs_error(p, "Unknown command: ", stmt);
+        stmt[len] = c;
+        return;
+    }
 
-    outb(0x43, 0xB6);
-    outb(0x42, (uint8_t)(divisor & 0xFF));
-    outb(0x42, (uint8_t)((divisor >> 8) & 0xFF));
+    char* args = stmt + len;
+    while (*args == ' ') args++;
 
-    uint8_t tmp = inb(0x61);
-    if (!(tmp & 3)) {
-        outb(0x61, tmp | 3);
+    if (cmd->func == cmd_int) zs_compile_int(p, args);
+    else if (cmd->func == cmd_str) zs_compile_str(p, args);
+    else if (cmd->func == cmd_kprint) zs_compile_kprint(p, stmt);
+    else {
+        char* arg = cmd->flags & CMD_FULL_LINE ? stmt : args;
+        uint32_t off = zs_string(p, arg, strlen(arg));
+        zs_emit8(p, OP_CALL);
+        zs_emit8(p, cmd - commands);
+        zs_emit32(p, off);
     }
 }
 
-static void pcspk_stop() {
-    uint8_t tmp = inb(0x61) & 0xFC;
-    outb(0x61, tmp);
-}
+// compiles one ';'-separated piece of a script; empty ones and "exit" are
+// skipped, `*line` is the line it starts on and ends up on the next one's
+static void zs_compile_piece(ZsProgram* p, char* cmd, int* line) {
+    for (; *cmd == '\n' || *cmd == ' ' || *cmd == '\t'; cmd++)
+        if (*cmd == '\n') (*line)++;
 
-static uint32_t note_to_freq(char n) {
-    switch (n) {
-        case 'c': return 261;
-        case 'd': return 294;
-        case 'e': return 329;
-        case 'f': return 349;
-        case 'g': return 392;
-        case 'a': return 440;
-        case 'b': return 494;
-    	case 'h': return 494;
-        default: return 0;
+    if (*cmd && !starts_with(cmd, "exit")) {
+        p->line = *line;
+        zs_compile_statement(p, cmd);
     }
+
+    for (char* c = cmd; *c; c++)
+        if (*c == '\n') (*line)++;
 }
 
-static void play_note(char note, int duration_ms) {
-    uint32_t freq = note_to_freq(note);
-    if (freq == 0) return;
-    pcspk_play(freq);
-    delay(duration_ms);
-    pcspk_stop();
+static void zs_compile_source(ZsProgram* p, char* src) {
+    int line = 1;
+    char* cmd = src;
+    for (;;) {
+        char* next = strchr(cmd, ';');
+        if (next) *next = '\0';
+
+        zs_compile_piece(p, cmd, &line);
+        if (p->error) return;
+
+        if (!next) break;
+        cmd = next + 1;
+    }
+    zs_emit8(p, OP_END);
 }
 
-static void play_melody(const char* melody) {
-    int i = 0;
-    while (melody[i]) {
-        // Skip spaces/tabs
-        while (melody[i] == ' ' || melody[i] == '\t') i++;
+static inline uint16_t zs_read16(const uint8_t* c) {
+    uint16_t v;
+    memcpy(&v, c, 2);
+    return v;
+}
 
-        char note = melody[i];
-        if (!note) break;  // end of string
+static inline uint32_t zs_read32(const uint8_t* c) {
+    uint32_t v;
+    memcpy(&v, c, 4);
+    return v;
+}
 
-        // Only valid notes or 'x'
-        if ((note < 'a' || note > 'h') && note != 'x') {
-            i++;
-            continue;
+// Slots are bound to Variables the first time they're used. The pointer stays
+// good for the whole run: var_scope_pop frees a scope's variables, but a scope
+// is only popped after the zs_run that binds into it has returned.
+// Returns 0 if the script was stopped (kill, out of memory), 1 if it ran to the end.
+static int zs_run(ZsProgram* p) {
+    Variable** bound = NULL;
+    if (p->var_count) {
+        bound = kmalloc(p->var_count * sizeof(Variable*));
+        if (!bound) {
+            kprint("zscript: out of memory!\n", (os_color & 0xF0) | 0x0C);
+            return 0;
         }
+        memset(bound, 0, p->var_count * sizeof(Variable*));
+    }
 
-        i++; // move past note
+    const uint8_t* pc = p->code;
+    for (;;) {
+        if (thread_killed()) {
+            kfree(bound);
+            return 0;
+        }
+        switch (*pc++) {
+        case OP_END:
+            kfree(bound);
+            return 1;
+
+        case OP_CALL: {
+            Command* cmd = &commands[*pc];
+            if (command_allowed(cmd, 0))
+                run_command_scoped(cmd->func, p->pool + zs_read32(pc + 1));
+            pc += 5;
+            break;
+        }
 
-        // skip spaces before duration
-        while (melody[i] == ' ' || melody[i] == '\t') i++;
+        case OP_SET_INT: {
+            uint16_t s = zs_read16(pc);
+            mutex_lock(&var_lock);
+            if (!bound[s]) bound[s] = get_or_add_var(p->pool + p->var_names[s]);
+            if (bound[s]) var_store_int(bound[s], (int)zs_read32(pc + 2));
+            mutex_unlock(&var_lock);
+            kprint("ok\n", os_color);
+            pc += 6;
+            break;
+        }
 
-        // parse duration
-        int duration = 0;
-        while (melody[i] >= '0' && melody[i] <= '9') {
-            duration = duration * 10 + (melody[i] - '0');
-            i++;
+        case OP_SET_STR: {
+            uint16_t s = zs_read16(pc);
+            mutex_lock(&var_lock);
+            if (!bound[s]) bound[s] = get_or_add_var(p->pool + p->var_names[s]);
+            if (bound[s]) var_store_str(bound[s], p->pool + zs_read32(pc + 2));
+            mutex_unlock(&var_lock);
+            kprint("ok\n", os_color);
+            pc += 6;
+            break;
         }
 
-        // enforce minimum duration for safety
-        if (duration == 0) duration = 100;  // default 100ms if not specified
+        case OP_PRINT: {
+            uint16_t color16 = zs_read16(pc);
+            uint8_t color = color16 == ZS_DEFAULT_COLOR ? os_color : color16;
+            uint8_t argc = pc[2];
+            const uint8_t* slots = pc + 3;
+            pc = slots + argc * 2;
+            uint16_t pieces = zs_read16(pc);
+            pc += 2;
+
+            // the values are printed straight from the variables, keep them still
+            mutex_lock(&var_lock);
+            int ok = 1;
+            for (int i = 0; i < argc; i++) {
+                uint16_t s = zs_read16(slots + i * 2);
+                if (!bound[s]) bound[s] = find_var(p->pool + p->var_names[s]);
+                if (!bound[s]) ok = 0;
+            }
+            if (!ok) kprint("err: unknown var\n", os_color);
 
-        // play or rest
-        if (note == 'x') {
-            delay(duration);
-        } else {
-            play_note(note, duration);
+            // an argument of the wrong type prints nothing and isn't used up
+            int idx = 0;
+            for (int i = 0; i < pieces; i++) {
+                uint8_t kind = *pc++;
+                if (kind == PIECE_TEXT) {
+                    if (ok) kprint(p->pool + zs_read32(pc), color);
+                    pc += 4;
+                    continue;
+                }
+                if (!ok || idx >= argc) continue;
+                Variable* v = bound[zs_read16(slots + idx * 2)];
+                if (kind == PIECE_STR && v->type == VAR_STR) {
+                    kprint(v->str_value, color);
+                    idx++;
+                } else if (kind == PIECE_INT && v->type == VAR_INT) {
+                    kprint_int(v->int_value, color);
+                    idx++;
+                }
+            }
+            mutex_unlock(&var_lock);
+            break;
+        }
         }
+    }
+}
 
-        // skip until semicolon (optional)
-        while (melody[i] && melody[i] != ':') i++;
-        if (melody[i] == ':') i++;
+// ----------------- compiled script cache -----------------
+// "name.zs" is compiled once into "name.zsc": a header, then the code, the
+// string pool and the variable name table. The header carries a hash of the
+// script text, so editing the script makes the cache stale, and a hash of the
+// command table (names and flags), since the code stores command indexes and
+// CMD_FULL_LINE decides which argument string gets stored. Only ".zs" scripts
+// are cached, and a file that isn't a cache is never written over.
+#define ZSC_MAGIC 0x3143535A // "ZSC1"
+
+typedef struct {
+    uint32_t magic;
+    uint32_t abi;        // zs_abi() when it was written
+    uint32_t src_hash;   // FNV-1a of the script text
+    uint32_t src_size;
+    uint32_t data_hash;  // FNV-1a of everything after the header
+    uint32_t code_len;
+    uint32_t pool_len;
+    uint32_t var_count;
+} ZscHeader;
+
+static uint32_t fnv1a(const void* data, uint32_t len, uint32_t h) {
+    const uint8_t* d = data;
+    for (uint32_t i = 0; i < len; i++) {
+        h ^= d[i];
+        h *= 16777619u;
     }
+    return h;
 }
 
-void cmd_beep(char *args) {
-    while (*args == ' ') args++;  // skip leading spaces
+static uint32_t zs_abi(void) {
+    uint32_t h = fnv1a("zs-bytecode-1", 13, 2166136261u);
+    for (int i = 0; i < command_count; i++) {
+        h = fnv1a(commands[i].name, strlen(commands[i].name) + 1, h);
+        h = fnv1a(&commands[i].flags, sizeof(commands[i].flags), h);
+    }
+    return h;
+}
 
-    if (strchr(args, ':')) {
-        // Already handles full melody
-        play_melody(args);
-    } else {
-        char note = args[0];
-        int i = 1;
-        while (args[i] == ' ') i++;  // skip space between note and duration
+// "x.zs" -> "x.zsc", 0 if it isn't a .zs script or that doesn't fit in a file name
+static int zs_cache_name(const char* script, char* out) {
+    uint32_t len = strlen(script);
+    if (len < 3 || !strcmp(script + len - 3, ".zs")) return 0; // strcmp is 1 when equal
+    if (len + 2 > sizeof(files[0].name)) return 0;
+    memcpy(out, script, len);
+    out[len] = 'c';
+    out[len + 1] = '\0';
+    return 1;
+}
 
-        int ms = 0;
-        while (args[i] >= '0' && args[i] <= '9') {
-            ms = ms * 10 + (args[i] - '0');
-            i++;
+static int zs_cache_load(const char* cache, uint32_t src_hash, uint32_t src_size, ZsProgram* p) {
+    uint32_t size;
+    uint8_t* data = fs_mmap(cache, &size, FS_MAP_PRIVATE);
+    if (!data) return 0;
+
+    int ok = 0;
+    ZscHeader h;
+    if (size >= sizeof(h)) {
+        memcpy(&h, data, sizeof(h));
+        uint32_t body = size - sizeof(h);
+        uint8_t* d = data + sizeof(h);
+        ok = h.magic == ZSC_MAGIC && h.abi == zs_abi()
+            && h.src_hash == src_hash && h.src_size == src_size
+            && h.code_len && h.var_count <= body / 4
+            && (uint64_t)h.code_len + h.pool_len + h.var_count * 4 == body
+            && fnv1a(d, body, 2166136261u) == h.data_hash
+            && d[h.code_len - 1] == OP_END;
+        if (ok) {
+            p->code = kmalloc(h.code_len);
+            p->pool = kmalloc(h.pool_len + 1);
+            p->var_names = kmalloc(h.var_count * 4 + 4);
+            if (p->code && p->pool && p->var_names) {
+                memcpy(p->code, d, h.code_len);
+                memcpy(p->pool, d + h.code_len, h.pool_len);
+                memcpy(p->var_names, d + h.code_len + h.pool_len, h.var_count * 4);
+                p->code_len = h.code_len;
+                p->pool_len = h.pool_len;
+                p->var_count = h.var_count;
+            } else {
+                ok = 0;
+            }
         }
+    }
+    fs_munmap(data);
+    return ok;
+}
 
-        // 'x' outside melody = rest
-        if (note == 'x' || note == 'X') {
-            if (ms > 0) delay(ms);
-        } else {
-            if (ms > 0) play_note(note, ms);
+// 1 if `cache` is missing or holds an old cache, 0 if it's someone's file
+static int zs_cache_replaceable(const char* cache) {
+    uint32_t size;
+    uint8_t* data = fs_mmap(cache, &size, FS_MAP_PRIVATE);
+    if (!data) return 1;
+    uint32_t magic = 0;
+    if (size >= sizeof(magic)) memcpy(&magic, data, sizeof(magic));
+    fs_munmap(data);
+    return magic == ZSC_MAGIC;
+}
+
+static void zs_cache_save(const char* cache, uint32_t src_hash, uint32_t src_size, ZsProgram* p) {
+    if (!zs_cache_replaceable(cache)) return;
+    uint32_t vars_len = p->var_count * 4;
+    uint32_t total = sizeof(ZscHeader) + p->code_len + p->pool_len + vars_len;
+    uint8_t* out = scratch_alloc(total);
+    if (!out) return;
+
+    uint8_t* d = out + sizeof(ZscHeader);
+    memcpy(d, p->code, p->code_len);
+    memcpy(d + p->code_len, p->pool, p->pool_len);
+    memcpy(d + p->code_len + p->pool_len, p->var_names, vars_len);
+
+    ZscHeader h;
+    h.magic = ZSC_MAGIC;
+    h.abi = zs_abi();
+    h.src_hash = src_hash;
+    h.src_size = src_size;
+    h.data_hash = fnv1a(d, total - sizeof(h), 2166136261u);
+    h.code_len = p->code_len;
+    h.pool_len = p->pool_len;
+    h.var_count = p->var_count;
+    memcpy(out, &h, sizeof(h));
+
+    fs_write_data(cache, (const char*)out, total);
+}
+
+// a script started by another script gets its own variable scope
+static void zs_run_script(ZsProgram* p) {
+    Thread* self = this_thread();
+    if (self->zs_file_depth) var_scope_push();
+    self->zs_file_depth++;
+    zs_run(p);
+    self->zs_file_depth--;
+    if (self->zs_file_depth) var_scope_pop();
+}
+
+// ----------------- streaming -----------------
+// Big scripts (or zscript -s) aren't compiled up front: the file is read a
+// sector at a time into a small ring and every statement is compiled and run
+// as soon as its ';' shows up, so memory use doesn't depend on the script's
+// size. A statement may straddle sectors but has to fit in the ring, and a
+// syntax error only stops the script where it is.
+#define ZS_STREAM_SECTORS 4
+#define ZS_STREAM_RING (ZS_STREAM_SECTORS * 512)
+#define ZS_STREAM_AUTO (64 * 1024) // scripts bigger than this always stream
+
+// `lba` and `size` are what files[fi] held when the caller looked, under
+// fs_lock; every sector is read under it too, and only while that still holds
+void zs_stream_file(int fi, uint32_t lba, uint32_t size) {
+    Thread* self = this_thread();
+
+    uint8_t* ring = kmalloc(ZS_STREAM_RING);
+    char* stmt = kmalloc(ZS_STREAM_RING + 1);
+    if (!ring || !stmt) {
+        kprint("zscript: out of memory!\n", (os_color & 0xF0) | 0x0C);
+        kfree(ring);
+        kfree(stmt);
+        return;
+    }
+
+    ZsProgram p;
+    memset(&p, 0, sizeof(p));
+    if (self->zs_file_depth) var_scope_push();
+    self->zs_file_depth++;
+
+    uint32_t start = 0;  // file offset of the statement being collected
+    uint32_t scan = 0;   // how far we've looked for its ';'
+    uint32_t loaded = 0; // file bytes in the ring so far
+    int line = 1;
+
+    for (;;) {
+        if (thread_killed()) break; // the rest of the file isn't read, let alone compiled
+        while (scan < loaded && ring[scan % ZS_STREAM_RING] != ';' && ring[scan % ZS_STREAM_RING])
+            scan++;
+
+        if (scan < loaded || loaded == size) {
+            int last = scan == loaded || !ring[scan % ZS_STREAM_RING];
+            uint32_t len = scan - start;
+            for (uint32_t i = 0; i < len; i++)
+                stmt[i] = ring[(start + i) % ZS_STREAM_RING];
+            stmt[len] = '\0';
+
+            p.code_len = p.pool_len = p.var_count = 0;
+            zs_compile_piece(&p, stmt, &line);
+            if (p.error) break;
+            zs_emit8(&p, OP_END);
+            if (!zs_run(&p)) break;
+
+            if (last) break;
+            start = scan = scan + 1;
+            continue;
+        }
+
+        // need the next sector; it goes where the oldest one was
+        if (loaded - start + 512 > ZS_STREAM_RING) {
+            p.line = line;
+            zs_error(&p, "zscript: statement too long\n", NULL);
+            break;
         }
+        uint32_t sector = loaded / 512;
+        mutex_lock(&fs_lock);
+        int same = files[fi].used && files[fi].start == lba && files[fi].size == size;
+        if (same) ata_read28(lba + sector, ring + (sector % ZS_STREAM_SECTORS) * 512);
+        mutex_unlock(&fs_lock);
+        if (!same) { // deleted or moved, its sectors may be someone else's by now
+            p.line = line;
+            zs_error(&p, "zscript: script file changed while it ran\n", NULL);
+            break;
+        }
+        loaded += 512;
+        if (loaded > size) loaded = size;
     }
+
+    self->zs_file_depth--;
+    if (self->zs_file_depth) var_scope_pop();
+    zs_free(&p);
+    kfree(ring);
+    kfree(stmt);
 }
 
-// ----------------- Command struct -----------------
-typedef struct {
-    const char* name;
-    void (*func)(char*);
-} Command;
+// Runs script file `name`, from its cache when that is still good. A script
+// started by another script gets its own scope: variables it creates are gone
+// when it ends, the ones it can see from outside it just updates.
+void zs_run_file(const char* name, int stream) {
+    // streaming reads the disk directly, so shared mappings go there first
+    mutex_lock(&fs_lock);
+    int fi = fs_find(name);
+    uint32_t lba = 0, size = 0;
+    if (fi >= 0) {
+        fs_msync_file_nolock(fi);
+        lba = files[fi].start;
+        size = files[fi].size;
+    }
+    mutex_unlock(&fs_lock);
+    if (fi >= 0 && (stream || size > ZS_STREAM_AUTO)) {
+        zs_stream_file(fi, lba, size);
+        return;
+    }
 
-Command commands[] = {
-    {"clear", cmd_clear},
-    {"help", cmd_help},
-    {"exit", cmd_exit},
-    {"test", cmd_test},
-    {"Z", cmd_Z},
-    {"ascii", cmd_ascii},
-    {"color", cmd_color},
-    {"dir", cmd_dir},
-    {"read", cmd_read},
-    {"write", cmd_write},
-    {"delete", cmd_delete},
-    {"zw", cmd_zw},
-    {"kprint", cmd_kprint},
-    {"zscript", cmd_zscript},
-    {"beep", cmd_beep},
-    {"str", cmd_str},
-    {"int", cmd_int}
-};
-const int command_count = sizeof(commands)/sizeof(commands[0]);
+    char* script = fs_mmap(name, &size, FS_MAP_PRIVATE);
+    if (!script) {
+        kprint("zscript file not found!\n", (os_color & 0xF0) | 0x0C);
+        return;
+    }
+    uint32_t hash = fnv1a(script, size, 2166136261u);
 
-#define COMMAND_COUNT (sizeof(commands)/sizeof(commands[0]))
+    char cache[sizeof(files[0].name)];
+    int cacheable = zs_cache_name(name, cache);
 
-void handle_command(char* buffer) {
-    while (*buffer == ' ') buffer++; // skip leading spaces
+    ZsProgram p;
+    memset(&p, 0, sizeof(p));
+    if (!cacheable || !zs_cache_load(cache, hash, size, &p)) {
+        // private mapping: the compiler writes '\0' over every ';' in place
+        zs_compile_source(&p, script);
+        if (!p.error && cacheable) zs_cache_save(cache, hash, size, &p);
+    }
+    fs_munmap(script);
 
-    for (int i = 0; i < COMMAND_COUNT; i++) {
-        size_t len = strlen(commands[i].name);
-        if (starts_with(buffer, commands[i].name)) {
+    if (!p.error) zs_run_script(&p);
+    zs_free(&p);
+}
 
-            // special case: kprint wants the full buffer
-            if (strcmp(commands[i].name, "kprint") == 1) {
-                commands[i].func(buffer);  // pass entire buffer
-                return;
-            }
+// one str/int/kprint typed at the prompt
+void zs_exec_single(int kind, char* text) {
+    ZsProgram p;
+    memset(&p, 0, sizeof(p));
+    if (kind == ZS_STMT_INT) zs_compile_int(&p, text);
+    else if (kind == ZS_STMT_STR) zs_compile_str(&p, text);
+    else zs_compile_kprint(&p, text);
+    zs_emit8(&p, OP_END);
+    if (!p.error) zs_run(&p);
+    zs_free(&p);
+}
 
-            // normal case: pass args only
-            char* args = buffer + len;
-            while (*args == ' ') args++; // skip spaces after command
-            commands[i].func(args);
-            return;
-        }
+static const char* thread_state_name(Thread* t) {
+    switch (t->state) {
+    case THREAD_READY:   return "ready   ";
+    case THREAD_RUNNING: return "running ";
+    case THREAD_BLOCKED: return "waiting ";
+    default:             return "done    ";
     }
+}
 
-    kprint("Unknown command: ", os_color);
-    kprint(buffer, os_color);
-    kput_char('\n', os_color);
+void cmd_jobs(char* args) {
+    (void)args;
+    int any = 0;
+    uint32_t flags = spin_lock_irqsave(&threads_lock); // the list changes under us otherwise
+    for (Thread* t = all_threads; t; t = t->all_next) {
+        if (t->shell || t->service) continue;
+        kput_char('[', os_color);
+        kprint_dec(t->id, os_color);
+        kprint("] ", os_color);
+        kprint(t->killed && t->state != THREAD_DEAD ? "killing " : thread_state_name(t), os_color);
+        kprint(t->name, os_color);
+        kput_char('\n', os_color);
+        any = 1;
+    }
+    spin_unlock_irqrestore(&threads_lock, flags);
+    if (!any) kprint("No jobs.\n", os_color);
+}
+
+void cmd_kill(char* args) {
+    while (*args == ' ') args++;
+    if (*args == '%') args++;
+    if (*args < '0' || *args > '9') {
+        kprint("Usage: kill N (N from jobs)\n", (os_color & 0xF0) | 0x0C);
+        return;
+    }
+    int id = 0;
+    while (*args >= '0' && *args <= '9') id = id * 10 + (*args++ - '0');
+    uint32_t flags = spin_lock_irqsave(&threads_lock);
+    Thread* t = thread_find(id);
+    if (!t || t->shell || t->service || t->state == THREAD_DEAD) {
+        spin_unlock_irqrestore(&threads_lock, flags);
+        kprint("No such job!\n", (os_color & 0xF0) | 0x0C);
+        return;
+    }
+    thread_kill(t);
+    spin_unlock_irqrestore(&threads_lock, flags);
+}
+
+void cmd_cpus(char* args) {
+    (void)args;
+    kprint("cpu apic queued switches stolen running\n", (os_color & 0xF0) | 0x09);
+    for (int i = 0; i < cpu_count; i++) {
+        Cpu* c = &cpus[i];
+        Thread* t = c->running;
+        kprint_dec(c->id, os_color);
+        kput_char(' ', os_color);
+        kprint_dec(c->apic_id, os_color);
+        kput_char(' ', os_color);
+        kprint_dec(c->rq_len, os_color);
+        kput_char(' ', os_color);
+        kprint_dec(c->switches, os_color);
+        kput_char(' ', os_color);
+        kprint_dec(c->steals, os_color);
+        kput_char(' ', os_color);
+        kprint(!c->online ? "(offline)" : t ? t->name : "-", os_color);
+        kput_char('\n', os_color);
+    }
+}
+
+static void boot_out_vga(const char* s) {
+    kprint(s, os_color);
+}
+
+void cmd_boottime(char* args) {
+    (void)args;
+    kprint("phase         since entry   (took)\n", (os_color & 0xF0) | 0x0A);
+    boot_trace_print(boot_out_vga);
+}
+
+void cmd_dmesg(char* args) {
+    (void)args;
+    uint32_t end = klog_next;
+    uint32_t i = end > KLOG_RECORDS ? end - KLOG_RECORDS : 0;
+    char line[KLOG_LINE];
+    for (; i != end; i++) {
+        KlogRecord r;
+        if (klog_read(i, &r) <= 0) continue;
+        uint8_t color = r.level <= KLOG_ERR ? (os_color & 0xF0) | 0x0C
+                      : r.level == KLOG_WARN ? (os_color & 0xF0) | 0x0E : os_color;
+        kwrite(line, klog_format(&r, line), color);
+    }
+}
+
+// the prompt every console runs
+static void shell_run(void) {
+    char buffer[256];
+    for (;;) {
+        jobs_reap(1);
+        kprint(SHELL_PROMPT, SHELL_PROMPT_COLOR);
+        kread_command(buffer, 256);
+
+        handle_command(buffer);
+    }
+}
+
+// consoles 2-4 (Alt+F2..F4), started once the boot console's autostart is done
+static void shell_main(void* arg) {
+    stack_head()->console = (int)arg;
+    this_thread()->shell = 1;
+    os_color = consoles[0].color;
+    kclear();
+    kprint("ZurOS console ", os_color);
+    kprint_dec((int)arg + 1, os_color);
+    kprint(" (Alt+F1 to Alt+F4 switch consoles)\n", os_color);
+    shell_run();
 }
 
-void kmain(void) {
+void kmain(uint32_t magic, MultibootInfo* mbi) {
+    boot_mark("kmain");
     os_color = 0x0F;
     kclear();
-    delay(2000);
+    serial_init();
+    if (magic == MULTIBOOT_MAGIC) boot_fast = boot_cmdline_has(mbi, "fastboot");
+
+    gdt_init();
+    idt_init();
+    cpu_init();
+    klog(KLOG_INFO, "kernel", "ZurOS starting");
+    register_interrupt_handler(14, page_fault_handler);
+    boot_mark("cpu");
+    pmm_init(magic, mbi);
+    smp_detect(); // the ACPI tables are read before paging is on
+    paging_init();
+    boot_mark("memory");
+    if (magic == MULTIBOOT_MAGIC) fb_console_init(mbi);
+
+    pic_init();
+    while (inb(0x64) & 1) inb(0x60); // drop whatever the BIOS left in the controller
+    register_irq_handler(1, keyboard_irq);
+    timer_init();
+    serial_start(magic == MULTIBOOT_MAGIC && boot_cmdline_has(mbi, "headless"));
+    threads_init();
+    __asm__ volatile("sti");
+    boot_mark("timer");
+    smp_init(magic != MULTIBOOT_MAGIC || !boot_cmdline_has(mbi, "nosmp"));
+    boot_mark("smp");
+    if (!boot_fast) {
+        sleep_ms(2000);
+        boot_mark("banner wait");
+    }
 
     kprint("Currently running ZurOS.\n", os_color);
     kprint("For help (commands list) write \"help\" and click enter.\n", os_color);
@@ -1569,27 +8460,43 @@ void kmain(void) {
 
     uint8_t sec[512];
 
+    if (sb16_init()) {
+        kprint("Sound Blaster 16 found, beep plays through it.\n", os_color);
+    }
+    boot_mark("sb16");
+
     kprint("Mounting FAT32...\n", os_color);
     fat32_mount();
-	fs_dir();
+    boot_mark("mount");
+    fs_load();
+    boot_mark("table load");
+    command_table_init();
+    boot_mark("commands");
+    thread_create("klogd", klogd_main, NULL);
 
-    int running = 1;
     char buffer[256];
 
     //backup_and_delete_all_files();
     //restore_all_files();
 
-    kprint("\nPress enter to continue...", os_color);
-    kread_line(buffer, 256);
-    kclear();
+    if (!boot_fast) {
+        fs_dir();
+        kprint("\nPress enter to continue...", os_color);
+        kread_line(buffer, 256);
+        kclear();
+        boot_mark("enter prompt");
+    }
 
     handle_command("zscript autostart.zs");
+    boot_mark("autostart");
 
-    while (running) {
-        kprint("~/[ZurOS >:3]$ ", (os_color & 0xF0) | 0x09);
-        kread_line(buffer, 256);
+    serial_write(boot_fast ? "ZurOS boot trace (fastboot):\n" : "ZurOS boot trace:\n");
+    boot_trace_print(serial_write);
 
-        handle_command(buffer);
+    for (int i = 1; i < NUM_CONSOLES; i++) {
+        char name[] = "shell N";
+        name[6] = '1' + i;
+        thread_create(name, shell_main, (void*)i);
     }
-    for (;;);
+    shell_run();
 }
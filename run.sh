@@ -7,7 +7,10 @@ rm -f kasm.o kc.o kernel ZurOS.iso
 nasm -f elf32 kernel.asm -o kasm.o
 
 # Compile C kernel
-gcc -m32 -ffreestanding -c kernel.c -o kc.o
+# (-fno-tree-loop-distribute-patterns stops gcc from turning loops inside our own
+#  memcpy/memset into calls to memcpy/memset, -fno-strict-aliasing because we cast
+#  sector buffers around a lot)
+gcc -m32 -ffreestanding -O2 -fno-strict-aliasing -fno-tree-loop-distribute-patterns -c kernel.c -o kc.o
 
 # Link everything
 ld -m elf_i386 -T link.ld -o kernel kasm.o kc.o
@@ -25,10 +28,26 @@ if [ ! -f hdd.img ]; then
     mkfs.fat -F 32 hdd.img
 fi
 
+# Audio backend for the Sound Blaster 16 and the PC speaker, for example
+# AUDIO=pa ./run.sh, or AUDIO=wav,path=zuros.wav ./run.sh to record what ZurOS plays
+AUDIO=${AUDIO:-none}
+
+# Where COM1 goes (everything ZurOS prints is copied there), for example
+# SERIAL=stdio ./run.sh, or SERIAL=file:zuros.log ./run.sh to keep a log
+SERIAL=${SERIAL:-vc}
+
 # Run QEMU with:
 #  - CD-ROM for booting
 #  - HDD for FAT32 persistent storage
+#  - Sound Blaster 16 (beep plays through it when it's there)
+#  - 4 CPUs (background jobs run on all of them)
+#  - COM1 on $SERIAL
 qemu-system-i386 \
+    -smp 4 \
     -cdrom ZurOS.iso \
     -drive file=hdd.img,format=raw,index=0,media=disk \
+    -audiodev ${AUDIO},id=snd0 \
+    -machine pcspk-audiodev=snd0 \
+    -device sb16,audiodev=snd0 \
+    -serial ${SERIAL} \
     -boot d